@@ -0,0 +1,315 @@
+/*
+ * Read-only access to the BAI index of a BAM file.
+ */
+#include "bamindex.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "samtools/bam_endian.h"
+
+#define BAI_MAX_BIN 37450 // =(8^6-1)/7+1
+#define BAI_LIDX_SHIFT 14
+
+/* A bin of the binning index with its chunks */
+typedef struct {
+	uint32_t bin;
+	int n;
+	bai_chunk_t *chunks;
+} bai_bin_t;
+
+/* Binning (bins sorted by id) and linear index of a reference */
+typedef struct {
+	int n_bins;
+	bai_bin_t *bins;
+	int n_offsets;
+	uint64_t *offsets;
+} bai_ref_t;
+
+struct bai_s {
+	int n;
+	bai_ref_t *refs;
+};
+
+static int bai_read(void *ptr, size_t size, size_t n, FILE *fp)
+{
+	return (fread(ptr, size, n, fp) == n);
+}
+
+static int bai_compare_bins(const void *a, const void *b)
+{
+	uint32_t x = ((const bai_bin_t *)a)->bin;
+	uint32_t y = ((const bai_bin_t *)b)->bin;
+	return (x > y) - (x < y);
+}
+
+static int bai_compare_chunks(const void *a, const void *b)
+{
+	uint64_t x = ((const bai_chunk_t *)a)->u;
+	uint64_t y = ((const bai_chunk_t *)b)->u;
+	return (x > y) - (x < y);
+}
+
+static bai_t *bai_load_core(FILE *fp)
+{
+	int i, j, k, ok;
+	char magic[4];
+	int be = bam_is_big_endian();
+	bai_t *idx;
+
+	if (!bai_read(magic, 1, 4, fp) || strncmp(magic, "BAI\1", 4) != 0) {
+		return NULL;
+	}
+	idx = (bai_t *)calloc(1, sizeof(bai_t));
+	ok = bai_read(&idx->n, 4, 1, fp);
+	if (be) {
+		bam_swap_endian_4p(&idx->n);
+	}
+	if (!ok || idx->n < 0) {
+		free(idx);
+		return NULL;
+	}
+	idx->refs = (bai_ref_t *)calloc(idx->n > 0 ? idx->n : 1, sizeof(bai_ref_t));
+	for (i = 0; i < idx->n && ok; i++) {
+		bai_ref_t *ref = &idx->refs[i];
+		// binning index
+		ok = bai_read(&ref->n_bins, 4, 1, fp);
+		if (be) {
+			bam_swap_endian_4p(&ref->n_bins);
+		}
+		if (!ok || ref->n_bins < 0) {
+			ok = 0;
+			break;
+		}
+		ref->bins = (bai_bin_t *)calloc(ref->n_bins > 0 ? ref->n_bins : 1, sizeof(bai_bin_t));
+		for (j = 0; j < ref->n_bins && ok; j++) {
+			bai_bin_t *bin = &ref->bins[j];
+			ok = bai_read(&bin->bin, 4, 1, fp) && bai_read(&bin->n, 4, 1, fp);
+			if (be) {
+				bam_swap_endian_4p(&bin->bin);
+				bam_swap_endian_4p(&bin->n);
+			}
+			if (!ok || bin->n < 0) {
+				ok = 0;
+				break;
+			}
+			bin->chunks = (bai_chunk_t *)malloc(sizeof(bai_chunk_t) * (bin->n > 0 ? bin->n : 1));
+			ok = bai_read(bin->chunks, sizeof(bai_chunk_t), bin->n, fp);
+			if (be) {
+				for (k = 0; k < bin->n; k++) {
+					bam_swap_endian_8p(&bin->chunks[k].u);
+					bam_swap_endian_8p(&bin->chunks[k].v);
+				}
+			}
+		}
+		if (!ok) {
+			break;
+		}
+		qsort(ref->bins, ref->n_bins, sizeof(bai_bin_t), bai_compare_bins);
+		// linear index
+		ok = bai_read(&ref->n_offsets, 4, 1, fp);
+		if (be) {
+			bam_swap_endian_4p(&ref->n_offsets);
+		}
+		if (!ok || ref->n_offsets < 0) {
+			ok = 0;
+			break;
+		}
+		ref->offsets = (uint64_t *)malloc(sizeof(uint64_t) * (ref->n_offsets > 0 ? ref->n_offsets : 1));
+		ok = bai_read(ref->offsets, 8, ref->n_offsets, fp);
+		if (be) {
+			for (k = 0; k < ref->n_offsets; k++) {
+				bam_swap_endian_8p(&ref->offsets[k]);
+			}
+		}
+	}
+	if (!ok) {
+		bai_destroy(idx);
+		return NULL;
+	}
+	return idx;
+}
+
+bai_t *bai_load(const char *fn)
+{
+	FILE *fp;
+	bai_t *idx;
+	size_t l = strlen(fn);
+	char *fnidx = (char *)malloc(l + 5);
+
+	sprintf(fnidx, "%s.bai", fn);
+	fp = fopen(fnidx, "rb");
+	if (fp == NULL && l >= 3 && strcmp(fn + l - 3, "bam") == 0) {
+		// try "{base}.bai"
+		strcpy(fnidx, fn);
+		fnidx[l - 1] = 'i';
+		fp = fopen(fnidx, "rb");
+	}
+	free(fnidx);
+	if (fp == NULL) {
+		return NULL;
+	}
+	idx = bai_load_core(fp);
+	fclose(fp);
+	return idx;
+}
+
+void bai_destroy(bai_t *idx)
+{
+	int i, j;
+	if (idx == NULL) {
+		return;
+	}
+	for (i = 0; i < idx->n; i++) {
+		if (idx->refs[i].bins != NULL) {
+			for (j = 0; j < idx->refs[i].n_bins; j++) {
+				free(idx->refs[i].bins[j].chunks);
+			}
+		}
+		free(idx->refs[i].bins);
+		free(idx->refs[i].offsets);
+	}
+	free(idx->refs);
+	free(idx);
+}
+
+static int reg2bins(uint32_t beg, uint32_t end, uint16_t *list)
+{
+	int i = 0, k;
+	if (beg >= end) {
+		return 0;
+	}
+	if (end >= 1u << 29) {
+		end = 1u << 29;
+	}
+	--end;
+	list[i++] = 0;
+	for (k =    1 + (beg >> 26); k <=    1 + (end >> 26); ++k) {
+		list[i++] = k;
+	}
+	for (k =    9 + (beg >> 23); k <=    9 + (end >> 23); ++k) {
+		list[i++] = k;
+	}
+	for (k =   73 + (beg >> 20); k <=   73 + (end >> 20); ++k) {
+		list[i++] = k;
+	}
+	for (k =  585 + (beg >> 17); k <=  585 + (end >> 17); ++k) {
+		list[i++] = k;
+	}
+	for (k = 4681 + (beg >> 14); k <= 4681 + (end >> 14); ++k) {
+		list[i++] = k;
+	}
+	return i;
+}
+
+static const bai_bin_t *bai_get_bin(const bai_ref_t *ref, uint32_t bin)
+{
+	bai_bin_t key;
+	key.bin = bin;
+	return (const bai_bin_t *)bsearch(&key, ref->bins, ref->n_bins, sizeof(bai_bin_t), bai_compare_bins);
+}
+
+int bai_query(const bai_t *idx, int tid, int beg, int end, bai_chunk_t **chunks)
+{
+	int i, j, l, n_bins, n_off;
+	uint16_t *bins;
+	uint64_t min_off;
+	const bai_ref_t *ref;
+	const bai_bin_t *bin;
+	bai_chunk_t *off;
+
+	*chunks = NULL;
+	if (beg < 0) {
+		beg = 0;
+	}
+	if (tid < 0 || tid >= idx->n || end < beg) {
+		return 0;
+	}
+	ref = &idx->refs[tid];
+
+	// minimum offset from the linear index
+	if (ref->n_offsets > 0) {
+		min_off = (beg >> BAI_LIDX_SHIFT >= ref->n_offsets) ? ref->offsets[ref->n_offsets - 1] : ref->offsets[beg >> BAI_LIDX_SHIFT];
+		if (min_off == 0) {
+			int n = beg >> BAI_LIDX_SHIFT;
+			if (n > ref->n_offsets) {
+				n = ref->n_offsets;
+			}
+			for (i = n - 1; i >= 0; --i)
+				if (ref->offsets[i] != 0) {
+					break;
+				}
+			if (i >= 0) {
+				min_off = ref->offsets[i];
+			}
+		}
+	} else {
+		min_off = 0;
+	}
+
+	bins = (uint16_t *)malloc(sizeof(uint16_t) * BAI_MAX_BIN);
+	n_bins = reg2bins(beg, end, bins);
+	for (i = n_off = 0; i < n_bins; i++) {
+		if ((bin = bai_get_bin(ref, bins[i])) != NULL) {
+			n_off += bin->n;
+		}
+	}
+	if (n_off == 0) {
+		free(bins);
+		return 0;
+	}
+	off = (bai_chunk_t *)malloc(sizeof(bai_chunk_t) * n_off);
+	for (i = n_off = 0; i < n_bins; i++) {
+		if ((bin = bai_get_bin(ref, bins[i])) != NULL) {
+			for (j = 0; j < bin->n; j++)
+				if (bin->chunks[j].v > min_off) {
+					off[n_off++] = bin->chunks[j];
+				}
+		}
+	}
+	free(bins);
+	if (n_off == 0) {
+		free(off);
+		return 0;
+	}
+
+	qsort(off, n_off, sizeof(bai_chunk_t), bai_compare_chunks);
+	// resolve completely contained adjacent blocks
+	for (i = 1, l = 0; i < n_off; ++i)
+		if (off[l].v < off[i].v) {
+			off[++l] = off[i];
+		}
+	n_off = l + 1;
+	// resolve overlaps between adjacent blocks
+	for (i = 1; i < n_off; ++i)
+		if (off[i - 1].v >= off[i].u) {
+			off[i - 1].v = off[i].u;
+		}
+	// merge chunks starting in the block where the previous one ends
+	for (i = 1, l = 0; i < n_off; ++i) {
+		if (off[l].v >> 16 == off[i].u >> 16) {
+			off[l].v = off[i].v;
+		} else {
+			off[++l] = off[i];
+		}
+	}
+	n_off = l + 1;
+
+	*chunks = off;
+	return n_off;
+}
+
+uint64_t bai_chunks_size(const bai_chunk_t *chunks, int n)
+{
+	int i;
+	uint64_t size = 0;
+	for (i = 0; i < n; i++) {
+		if (chunks[i].v >> 16 > chunks[i].u >> 16) {
+			size += (chunks[i].v >> 16) - (chunks[i].u >> 16);
+		} else if (chunks[i].v > chunks[i].u) {
+			// chunk within a single block: use its uncompressed length
+			size += (chunks[i].v & 0xffff) - (chunks[i].u & 0xffff);
+		}
+	}
+	return size;
+}
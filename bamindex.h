@@ -0,0 +1,51 @@
+/*
+ * Read-only access to the BAI index of a BAM file
+ *
+ * The samtools index structure is private to libbam, so the .bai file is parsed
+ * here again to get the list of chunks (pairs of BGZF virtual offsets) that
+ * bam_iter_query() would visit for a genomic interval. Chunks are resolved exactly
+ * as bam_iter_query() does, thus they can be used both to estimate the cost of a
+ * region and to read its alignments.
+ */
+#ifndef __BAMINDEX_H__
+#define __BAMINDEX_H__
+
+#include <stdint.h>
+
+/*
+ * A chunk of the BAM file spanning virtual offsets [u,v)
+ */
+typedef struct {
+	uint64_t u;
+	uint64_t v;
+} bai_chunk_t;
+
+/*
+ * bai_t is a pointer to an internally maintained data structure.
+ */
+typedef struct bai_s bai_t;
+
+/*
+ * Load the index of BAM file fn (fn.bai or fn with .bam replaced by .bai).
+ * Returns NULL if the index is not available or not valid.
+ */
+extern bai_t *bai_load(const char *fn);
+
+/*
+ * Free the index
+ */
+extern void bai_destroy(bai_t *idx);
+
+/*
+ * Get the chunks overlapping the 0-based interval [beg,end) of reference tid.
+ * Chunks are sorted and merged as in bam_iter_query(). Returns the number of chunks
+ * stored in *chunks (to be freed by the caller), 0 if there are no chunks.
+ */
+extern int bai_query(const bai_t *idx, int tid, int beg, int end, bai_chunk_t **chunks);
+
+/*
+ * Get the number of compressed bytes spanned by a list of chunks
+ */
+extern uint64_t bai_chunks_size(const bai_chunk_t *chunks, int n);
+
+#endif
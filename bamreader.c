@@ -0,0 +1,1047 @@
+/*
+ * Reading of BAM alignments through the BAI index.
+ *
+ * The BGZF stream is handled as in bgzf.c (bgzf_read_block, bgzf_read, bgzf_seek) and
+ * the iteration over the chunks as in bam_iter_read(), so that the same virtual offsets
+ * are visited and the same alignments are returned.
+ */
+#define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
+
+#include "bamreader.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "samtools/bam_endian.h"
+
+#ifdef _WIN32
+#define bamr_fseek _fseeki64
+#else
+#define bamr_fseek fseeko
+#endif
+
+#define BAMR_BLOCK_SIZE 65536
+#define BAMR_HEADER_SIZE 18
+#define BAMR_MAX_RING 16
+#define BAMR_PREFETCH_BUFFER 1048576
+#define BAMR_CACHE_SHARDS 16
+#define BAMR_CACHE_MIN_BLOCKS 4
+
+/* A BGZF block read ahead and inflated by the pool */
+typedef struct {
+	int64_t coffset; // file offset of the block
+	int size;        // compressed size, 0 at the end of the file
+	int length;      // inflated length, -1 on errors
+	int done;
+	uint8_t *src;
+	uint8_t *dst;
+} bamr_block_t;
+
+struct bamr_pool_s {
+	pthread_mutex_t lock;
+	pthread_cond_t job_ready;
+	pthread_cond_t job_done;
+	int n_threads;
+	pthread_t *threads;
+	bamr_block_t **jobs; // circular queue of blocks to inflate
+	int head;
+	int n_jobs;
+	int m_jobs;
+	int finished;
+};
+
+/* An inflated block in the cache */
+typedef struct bamr_entry_s {
+	uint64_t file;
+	int64_t coffset;
+	int size;
+	int length;
+	uint8_t *data;
+	struct bamr_entry_s *next;     // in the hash chain
+	struct bamr_entry_s *lru_prev; // towards the most recently used
+	struct bamr_entry_s *lru_next;
+} bamr_entry_t;
+
+/* A shard of the cache, with its own lock, hash table and LRU list */
+typedef struct {
+	pthread_mutex_t lock;
+	bamr_entry_t **buckets;
+	int n_buckets;
+	bamr_entry_t *lru_head;
+	bamr_entry_t *lru_tail;
+	size_t used;
+	size_t capacity;
+	uint64_t hits;
+	uint64_t misses;
+} bamr_shard_t;
+
+struct bamr_cache_s {
+	bamr_shard_t shards[BAMR_CACHE_SHARDS];
+};
+
+struct bamr_s {
+	FILE *fp;
+	uint64_t file_id;      // identifies the file in the cache
+	int big_endian;        // records are swapped as in bam_read1()
+	int64_t fp_pos;        // position of fp
+	int64_t file_pos;      // position following the last block read (ftello() in bgzf.c)
+	int64_t block_address;
+	int block_offset;
+	int block_length;
+	uint8_t *block;        // inflated current block
+	uint8_t *compressed;
+	bamr_pool_t *pool;
+	bamr_cache_t *cache;
+	// blocks read ahead, in file order
+	bamr_block_t ring[BAMR_MAX_RING];
+	int ring_size;
+	int ring_head;
+	int ring_count;
+	// chunks of the current fetch, which drive the read ahead
+	const bai_chunk_t *plan;
+	int n_plan;
+	int plan_i;
+	int64_t plan_pos;
+};
+
+///////////////////////////////////////////////////////////
+// BGZF blocks
+///////////////////////////////////////////////////////////
+
+static int bamr_check_header(const uint8_t *h)
+{
+	return (h[0] == 31 && h[1] == 139 && h[2] == 8 && (h[3] & 4) != 0 &&
+	        (h[10] | h[11] << 8) == 6 && h[12] == 'B' && h[13] == 'C' && (h[14] | h[15] << 8) == 2);
+}
+
+/* Read the compressed block at coffset in buf. *size is 0 at the end of the file. */
+static int bamr_read_raw(bamr_t *r, int64_t coffset, uint8_t *buf, int *size)
+{
+	size_t count;
+	int block_size;
+
+	*size = 0;
+	if (r->fp_pos != coffset) {
+		if (bamr_fseek(r->fp, coffset, SEEK_SET) != 0) {
+			r->fp_pos = -1;
+			return -1;
+		}
+		r->fp_pos = coffset;
+	}
+	count = fread(buf, 1, BAMR_HEADER_SIZE, r->fp);
+	r->fp_pos += count;
+	if (count == 0) {
+		return 0;
+	}
+	if (count != BAMR_HEADER_SIZE || !bamr_check_header(buf)) {
+		return -1;
+	}
+	block_size = (buf[16] | buf[17] << 8) + 1;
+	if (block_size <= BAMR_HEADER_SIZE) {
+		return -1;
+	}
+	count = fread(buf + BAMR_HEADER_SIZE, 1, block_size - BAMR_HEADER_SIZE, r->fp);
+	r->fp_pos += count;
+	if (count != block_size - BAMR_HEADER_SIZE) {
+		return -1;
+	}
+	*size = block_size;
+	return 0;
+}
+
+/* Inflate a compressed block, returns the inflated length or -1 */
+static int bamr_inflate(const uint8_t *src, int size, uint8_t *dst)
+{
+	z_stream zs;
+	int status;
+
+	memset(&zs, 0, sizeof(z_stream));
+	zs.next_in = (Bytef *)src + BAMR_HEADER_SIZE;
+	zs.avail_in = size - 16;
+	zs.next_out = dst;
+	zs.avail_out = BAMR_BLOCK_SIZE;
+	if (inflateInit2(&zs, -15) != Z_OK) {
+		return -1;
+	}
+	status = inflate(&zs, Z_FINISH);
+	if (status != Z_STREAM_END) {
+		inflateEnd(&zs);
+		return -1;
+	}
+	if (inflateEnd(&zs) != Z_OK) {
+		return -1;
+	}
+	return zs.total_out;
+}
+
+///////////////////////////////////////////////////////////
+// Helper threads
+///////////////////////////////////////////////////////////
+
+static void *bamr_pool_worker(void *args)
+{
+	bamr_pool_t *pool = (bamr_pool_t *)args;
+	bamr_block_t *block;
+	int length;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (pool->n_jobs == 0 && !pool->finished) {
+			pthread_cond_wait(&pool->job_ready, &pool->lock);
+		}
+		if (pool->n_jobs == 0) {
+			break;
+		}
+		block = pool->jobs[pool->head];
+		pool->head = (pool->head + 1) % pool->m_jobs;
+		pool->n_jobs--;
+		pthread_mutex_unlock(&pool->lock);
+
+		length = bamr_inflate(block->src, block->size, block->dst);
+
+		pthread_mutex_lock(&pool->lock);
+		block->length = length;
+		block->done = 1;
+		pthread_cond_broadcast(&pool->job_done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+bamr_pool_t *bamr_pool_init(int n)
+{
+	int i;
+	bamr_pool_t *pool;
+
+	if (n <= 0) {
+		return NULL;
+	}
+	pool = (bamr_pool_t *)calloc(1, sizeof(bamr_pool_t));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->job_ready, NULL);
+	pthread_cond_init(&pool->job_done, NULL);
+	pool->m_jobs = 64;
+	pool->jobs = (bamr_block_t **)malloc(sizeof(bamr_block_t *) * pool->m_jobs);
+	pool->n_threads = n;
+	pool->threads = (pthread_t *)malloc(sizeof(pthread_t) * n);
+	for (i = 0; i < n; i++) {
+		pthread_create(&pool->threads[i], NULL, bamr_pool_worker, pool);
+	}
+	return pool;
+}
+
+void bamr_pool_destroy(bamr_pool_t *pool)
+{
+	int i;
+	if (pool == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&pool->lock);
+	pool->finished = 1;
+	pthread_cond_broadcast(&pool->job_ready);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->n_threads; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->job_ready);
+	pthread_cond_destroy(&pool->job_done);
+	free(pool->threads);
+	free(pool->jobs);
+	free(pool);
+}
+
+static void bamr_pool_submit(bamr_pool_t *pool, bamr_block_t *block)
+{
+	int i;
+	pthread_mutex_lock(&pool->lock);
+	if (pool->n_jobs == pool->m_jobs) {
+		// grow the queue, keeping its order
+		bamr_block_t **jobs = (bamr_block_t **)malloc(sizeof(bamr_block_t *) * pool->m_jobs * 2);
+		for (i = 0; i < pool->n_jobs; i++) {
+			jobs[i] = pool->jobs[(pool->head + i) % pool->m_jobs];
+		}
+		free(pool->jobs);
+		pool->jobs = jobs;
+		pool->head = 0;
+		pool->m_jobs *= 2;
+	}
+	pool->jobs[(pool->head + pool->n_jobs) % pool->m_jobs] = block;
+	pool->n_jobs++;
+	pthread_cond_signal(&pool->job_ready);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void bamr_pool_wait(bamr_pool_t *pool, bamr_block_t *block)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (!block->done) {
+		pthread_cond_wait(&pool->job_done, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+///////////////////////////////////////////////////////////
+// Cache of inflated blocks
+///////////////////////////////////////////////////////////
+
+static uint64_t bamr_hash(uint64_t file, int64_t coffset)
+{
+	uint64_t h = (file ^ (uint64_t)coffset) * 0x9E3779B97F4A7C15ULL;
+	return (h ^ (h >> 29));
+}
+
+bamr_cache_t *bamr_cache_init(size_t size)
+{
+	int i;
+	bamr_shard_t *shard;
+	bamr_cache_t *cache;
+
+	if (size == 0) {
+		return NULL;
+	}
+	cache = (bamr_cache_t *)calloc(1, sizeof(bamr_cache_t));
+	for (i = 0; i < BAMR_CACHE_SHARDS; i++) {
+		shard = &cache->shards[i];
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->capacity = size / BAMR_CACHE_SHARDS;
+		// room for a few full blocks, or a shard would hold at most one
+		if (shard->capacity < BAMR_CACHE_MIN_BLOCKS * (sizeof(bamr_entry_t) + BAMR_BLOCK_SIZE)) {
+			shard->capacity = BAMR_CACHE_MIN_BLOCKS * (sizeof(bamr_entry_t) + BAMR_BLOCK_SIZE);
+		}
+		// about two buckets for each block the shard can hold
+		shard->n_buckets = 2 * (int)(shard->capacity / BAMR_BLOCK_SIZE) + 1;
+		shard->buckets = (bamr_entry_t **)calloc(shard->n_buckets, sizeof(bamr_entry_t *));
+	}
+	return cache;
+}
+
+void bamr_cache_destroy(bamr_cache_t *cache)
+{
+	int i;
+	bamr_entry_t *e, *next;
+
+	if (cache == NULL) {
+		return;
+	}
+	for (i = 0; i < BAMR_CACHE_SHARDS; i++) {
+		for (e = cache->shards[i].lru_head; e != NULL; e = next) {
+			next = e->lru_next;
+			free(e->data);
+			free(e);
+		}
+		free(cache->shards[i].buckets);
+		pthread_mutex_destroy(&cache->shards[i].lock);
+	}
+	free(cache);
+}
+
+void bamr_cache_stats(bamr_cache_t *cache, uint64_t *hits, uint64_t *misses)
+{
+	int i;
+	*hits = *misses = 0;
+	for (i = 0; i < BAMR_CACHE_SHARDS; i++) {
+		pthread_mutex_lock(&cache->shards[i].lock);
+		*hits += cache->shards[i].hits;
+		*misses += cache->shards[i].misses;
+		pthread_mutex_unlock(&cache->shards[i].lock);
+	}
+}
+
+static bamr_entry_t *bamr_shard_find(bamr_shard_t *shard, uint64_t h, uint64_t file, int64_t coffset)
+{
+	bamr_entry_t *e;
+	for (e = shard->buckets[h % shard->n_buckets]; e != NULL; e = e->next)
+		if (e->coffset == coffset && e->file == file) {
+			return e;
+		}
+	return NULL;
+}
+
+static void bamr_lru_unlink(bamr_shard_t *shard, bamr_entry_t *e)
+{
+	if (e->lru_prev != NULL) {
+		e->lru_prev->lru_next = e->lru_next;
+	} else {
+		shard->lru_head = e->lru_next;
+	}
+	if (e->lru_next != NULL) {
+		e->lru_next->lru_prev = e->lru_prev;
+	} else {
+		shard->lru_tail = e->lru_prev;
+	}
+}
+
+static void bamr_lru_push(bamr_shard_t *shard, bamr_entry_t *e)
+{
+	e->lru_prev = NULL;
+	e->lru_next = shard->lru_head;
+	if (shard->lru_head != NULL) {
+		shard->lru_head->lru_prev = e;
+	} else {
+		shard->lru_tail = e;
+	}
+	shard->lru_head = e;
+}
+
+/* Compressed size of a cached block, 0 if not cached (neither counted nor refreshed) */
+static int bamr_cache_peek(bamr_cache_t *cache, uint64_t file, int64_t coffset)
+{
+	int size = 0;
+	uint64_t h = bamr_hash(file, coffset);
+	bamr_shard_t *shard = &cache->shards[h % BAMR_CACHE_SHARDS];
+	bamr_entry_t *e;
+
+	pthread_mutex_lock(&shard->lock);
+	if ((e = bamr_shard_find(shard, h, file, coffset)) != NULL) {
+		size = e->size;
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return size;
+}
+
+/* Copy a cached block in buf, returns 0 if the block is not cached */
+static int bamr_cache_get(bamr_cache_t *cache, uint64_t file, int64_t coffset, uint8_t *buf, int *size, int *length)
+{
+	uint64_t h = bamr_hash(file, coffset);
+	bamr_shard_t *shard = &cache->shards[h % BAMR_CACHE_SHARDS];
+	bamr_entry_t *e;
+
+	pthread_mutex_lock(&shard->lock);
+	if ((e = bamr_shard_find(shard, h, file, coffset)) == NULL) {
+		shard->misses++;
+		pthread_mutex_unlock(&shard->lock);
+		return 0;
+	}
+	shard->hits++;
+	bamr_lru_unlink(shard, e);
+	bamr_lru_push(shard, e);
+	memcpy(buf, e->data, e->length);
+	*size = e->size;
+	*length = e->length;
+	pthread_mutex_unlock(&shard->lock);
+	return 1;
+}
+
+/* Count a block that was not cached and was inflated by the read ahead */
+static void bamr_cache_miss(bamr_cache_t *cache, uint64_t file, int64_t coffset)
+{
+	bamr_shard_t *shard = &cache->shards[bamr_hash(file, coffset) % BAMR_CACHE_SHARDS];
+
+	pthread_mutex_lock(&shard->lock);
+	shard->misses++;
+	pthread_mutex_unlock(&shard->lock);
+}
+
+static void bamr_cache_put(bamr_cache_t *cache, uint64_t file, int64_t coffset, const uint8_t *buf, int size, int length)
+{
+	uint64_t h = bamr_hash(file, coffset);
+	bamr_shard_t *shard = &cache->shards[h % BAMR_CACHE_SHARDS];
+	bamr_entry_t *e, **p;
+	size_t bytes = sizeof(bamr_entry_t) + length;
+
+	if (bytes > shard->capacity) {
+		return;
+	}
+	pthread_mutex_lock(&shard->lock);
+	if (bamr_shard_find(shard, h, file, coffset) != NULL) {
+		// inflated meanwhile by another thread
+		pthread_mutex_unlock(&shard->lock);
+		return;
+	}
+	// evict the least recently used blocks
+	while (shard->used + bytes > shard->capacity && shard->lru_tail != NULL) {
+		e = shard->lru_tail;
+		bamr_lru_unlink(shard, e);
+		for (p = &shard->buckets[bamr_hash(e->file, e->coffset) % shard->n_buckets]; *p != e; p = &(*p)->next);
+		*p = e->next;
+		shard->used -= sizeof(bamr_entry_t) + e->length;
+		free(e->data);
+		free(e);
+	}
+	e = (bamr_entry_t *)malloc(sizeof(bamr_entry_t));
+	e->file = file;
+	e->coffset = coffset;
+	e->size = size;
+	e->length = length;
+	e->data = (uint8_t *)malloc(length > 0 ? length : 1);
+	memcpy(e->data, buf, length);
+	e->next = shard->buckets[h % shard->n_buckets];
+	shard->buckets[h % shard->n_buckets] = e;
+	bamr_lru_push(shard, e);
+	shard->used += bytes;
+	pthread_mutex_unlock(&shard->lock);
+}
+
+///////////////////////////////////////////////////////////
+// Read ahead
+///////////////////////////////////////////////////////////
+
+/* Next block to read ahead, following the chunks of the current fetch */
+static int bamr_plan_next(bamr_t *r, int64_t *coffset)
+{
+	int64_t beg, end;
+	while (r->plan_i < r->n_plan) {
+		beg = r->plan[r->plan_i].u >> 16;
+		end = r->plan[r->plan_i].v >> 16;
+		if (r->plan_pos < beg) {
+			r->plan_pos = beg;
+		}
+		// the block where the chunk ends is needed only if the chunk ends inside it
+		if (r->plan_pos < end || (r->plan_pos == end && (r->plan[r->plan_i].v & 0xFFFF) != 0)) {
+			*coffset = r->plan_pos;
+			return 1;
+		}
+		r->plan_i++;
+	}
+	return 0;
+}
+
+static void bamr_ring_fill(bamr_t *r)
+{
+	int64_t coffset;
+	bamr_block_t *block;
+	int size;
+	while (r->ring_count < r->ring_size && bamr_plan_next(r, &coffset)) {
+		if (r->cache != NULL && (size = bamr_cache_peek(r->cache, r->file_id, coffset)) > 0) {
+			// no need to inflate it again
+			r->plan_pos = coffset + size;
+			continue;
+		}
+		block = &r->ring[(r->ring_head + r->ring_count) % r->ring_size];
+		block->coffset = coffset;
+		block->done = 0;
+		r->ring_count++;
+		if (bamr_read_raw(r, coffset, block->src, &block->size) != 0 || block->size == 0) {
+			// errors and the end of the file are left to the synchronous read
+			r->ring_count--;
+			r->plan_i = r->n_plan;
+			break;
+		}
+		r->plan_pos = coffset + block->size;
+		bamr_pool_submit(r->pool, block);
+	}
+}
+
+static void bamr_ring_pop(bamr_t *r)
+{
+	bamr_pool_wait(r->pool, &r->ring[r->ring_head]);
+	r->ring_head = (r->ring_head + 1) % r->ring_size;
+	r->ring_count--;
+}
+
+static void bamr_ring_clear(bamr_t *r)
+{
+	while (r->ring_count > 0) {
+		bamr_ring_pop(r);
+	}
+	r->plan = NULL;
+	r->n_plan = r->plan_i = 0;
+	r->plan_pos = 0;
+}
+
+/* Inflate the block at coffset in r->block, using the cache and the blocks read ahead if possible */
+static int bamr_load(bamr_t *r, int64_t coffset, int *size)
+{
+	bamr_block_t *block;
+	uint8_t *tmp;
+	int length, cached;
+
+	if (r->pool != NULL) {
+		while (r->ring_count > 0 && r->ring[r->ring_head].coffset < coffset) {
+			bamr_ring_pop(r);
+		}
+		if (r->ring_count > 0 && r->ring[r->ring_head].coffset == coffset) {
+			block = &r->ring[r->ring_head];
+			bamr_pool_wait(r->pool, block);
+			// swap the inflated buffer with the current block
+			tmp = r->block;
+			r->block = block->dst;
+			block->dst = tmp;
+			*size = block->size;
+			length = block->length;
+			r->ring_head = (r->ring_head + 1) % r->ring_size;
+			r->ring_count--;
+			if (r->cache != NULL) {
+				// the ring only reads ahead the blocks not found in the cache
+				bamr_cache_miss(r->cache, r->file_id, coffset);
+				if (length >= 0) {
+					bamr_cache_put(r->cache, r->file_id, coffset, r->block, *size, length);
+				}
+			}
+			bamr_ring_fill(r);
+			return length;
+		}
+	}
+	cached = (r->cache != NULL && bamr_cache_get(r->cache, r->file_id, coffset, r->block, size, &length));
+	if (!cached) {
+		if (bamr_read_raw(r, coffset, r->compressed, size) != 0) {
+			return -1;
+		}
+		if (*size == 0) {
+			return 0;
+		}
+	}
+	if (r->pool != NULL) {
+		if (r->ring_count == 0 && r->plan_pos <= coffset) {
+			// restart the read ahead after this block
+			r->plan_pos = coffset + *size;
+		}
+		bamr_ring_fill(r);
+	}
+	if (!cached) {
+		length = bamr_inflate(r->compressed, *size, r->block);
+		if (r->cache != NULL && length >= 0) {
+			bamr_cache_put(r->cache, r->file_id, coffset, r->block, *size, length);
+		}
+	}
+	return length;
+}
+
+///////////////////////////////////////////////////////////
+// BGZF stream
+///////////////////////////////////////////////////////////
+
+/* As bgzf_read_block() */
+static int bamr_read_block(bamr_t *r)
+{
+	int size, length;
+	int64_t coffset = r->file_pos;
+
+	length = bamr_load(r, coffset, &size);
+	if (length < 0) {
+		return -1;
+	}
+	if (size == 0) {
+		r->block_length = 0;
+		return 0;
+	}
+	r->file_pos = coffset + size;
+	if (r->block_length != 0) {
+		// do not reset the offset if this read follows a seek
+		r->block_offset = 0;
+	}
+	r->block_address = coffset;
+	r->block_length = length;
+	return 0;
+}
+
+/* As bgzf_read() */
+static int bamr_read(bamr_t *r, void *data, int length)
+{
+	int copy_length, available, bytes_read = 0;
+	uint8_t *output = (uint8_t *)data;
+
+	if (length <= 0) {
+		return 0;
+	}
+	while (bytes_read < length) {
+		available = r->block_length - r->block_offset;
+		if (available <= 0) {
+			if (bamr_read_block(r) != 0) {
+				return -1;
+			}
+			available = r->block_length - r->block_offset;
+			if (available <= 0) {
+				break;
+			}
+		}
+		copy_length = (length - bytes_read < available) ? length - bytes_read : available;
+		memcpy(output, r->block + r->block_offset, copy_length);
+		r->block_offset += copy_length;
+		output += copy_length;
+		bytes_read += copy_length;
+	}
+	if (r->block_offset == r->block_length) {
+		r->block_address = r->file_pos;
+		r->block_offset = 0;
+		r->block_length = 0;
+	}
+	return bytes_read;
+}
+
+/* As bgzf_seek() */
+static void bamr_seek(bamr_t *r, uint64_t pos)
+{
+	r->block_offset = pos & 0xFFFF;
+	r->block_address = (pos >> 16) & 0xFFFFFFFFFFFFLL;
+	r->file_pos = r->block_address;
+	r->block_length = 0;
+}
+
+static uint64_t bamr_tell(const bamr_t *r)
+{
+	return ((uint64_t)r->block_address << 16) | (r->block_offset & 0xFFFF);
+}
+
+///////////////////////////////////////////////////////////
+// Read ahead of the next intervals
+///////////////////////////////////////////////////////////
+
+typedef struct {
+	int tid;
+	int beg;
+	int end;
+} bamr_interval_t;
+
+struct bamr_prefetch_s {
+	FILE *fp;
+	const bai_t *idx;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t interval_ready;
+	bamr_interval_t *intervals; // circular queue of intervals to read
+	int head;
+	int n_intervals;
+	int m_intervals;
+	int finished;
+	uint8_t *buffer;
+};
+
+/* Read the compressed blocks spanned by the chunks of an interval */
+static void bamr_prefetch_read(bamr_prefetch_t *p, const bamr_interval_t *interval)
+{
+	int i, n;
+	int64_t beg, end, last = 0;
+	size_t count;
+	bai_chunk_t *chunks;
+
+	n = bai_query(p->idx, interval->tid, interval->beg, interval->end, &chunks);
+	for (i = 0; i < n; i++) {
+		beg = chunks[i].u >> 16;
+		// the block where the chunk ends is read up to its maximum size
+		end = (chunks[i].v >> 16) + ((chunks[i].v & 0xFFFF) != 0 ? BAMR_BLOCK_SIZE : 0);
+		if (beg < last) {
+			beg = last;
+		}
+		if (beg >= end || bamr_fseek(p->fp, beg, SEEK_SET) != 0) {
+			continue;
+		}
+		while (beg < end) {
+			count = fread(p->buffer, 1, (end - beg < BAMR_PREFETCH_BUFFER) ? end - beg : BAMR_PREFETCH_BUFFER, p->fp);
+			if (count == 0) {
+				break;
+			}
+			beg += count;
+		}
+		last = beg;
+	}
+	if (n > 0) {
+		free(chunks);
+	}
+}
+
+static void *bamr_prefetch_worker(void *args)
+{
+	bamr_prefetch_t *p = (bamr_prefetch_t *)args;
+	bamr_interval_t interval;
+
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (p->n_intervals == 0 && !p->finished) {
+			pthread_cond_wait(&p->interval_ready, &p->lock);
+		}
+		if (p->finished) {
+			break;
+		}
+		interval = p->intervals[p->head];
+		p->head = (p->head + 1) % p->m_intervals;
+		p->n_intervals--;
+		pthread_mutex_unlock(&p->lock);
+
+		bamr_prefetch_read(p, &interval);
+
+		pthread_mutex_lock(&p->lock);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+bamr_prefetch_t *bamr_prefetch_init(const char *fn, const bai_t *idx)
+{
+	bamr_prefetch_t *p;
+	FILE *fp = fopen(fn, "rb");
+
+	if (fp == NULL) {
+		return NULL;
+	}
+	p = (bamr_prefetch_t *)calloc(1, sizeof(bamr_prefetch_t));
+	p->fp = fp;
+	p->idx = idx;
+	p->buffer = (uint8_t *)malloc(BAMR_PREFETCH_BUFFER);
+	p->m_intervals = 64;
+	p->intervals = (bamr_interval_t *)malloc(sizeof(bamr_interval_t) * p->m_intervals);
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->interval_ready, NULL);
+	pthread_create(&p->thread, NULL, bamr_prefetch_worker, p);
+	return p;
+}
+
+void bamr_prefetch_destroy(bamr_prefetch_t *p)
+{
+	if (p == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&p->lock);
+	p->finished = 1;
+	pthread_cond_signal(&p->interval_ready);
+	pthread_mutex_unlock(&p->lock);
+	pthread_join(p->thread, NULL);
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->interval_ready);
+	fclose(p->fp);
+	free(p->buffer);
+	free(p->intervals);
+	free(p);
+}
+
+void bamr_prefetch(bamr_prefetch_t *p, int tid, int beg, int end)
+{
+	int i;
+	bamr_interval_t *intervals;
+
+	pthread_mutex_lock(&p->lock);
+	if (p->n_intervals == p->m_intervals) {
+		// grow the queue, keeping its order
+		intervals = (bamr_interval_t *)malloc(sizeof(bamr_interval_t) * p->m_intervals * 2);
+		for (i = 0; i < p->n_intervals; i++) {
+			intervals[i] = p->intervals[(p->head + i) % p->m_intervals];
+		}
+		free(p->intervals);
+		p->intervals = intervals;
+		p->head = 0;
+		p->m_intervals *= 2;
+	}
+	i = (p->head + p->n_intervals) % p->m_intervals;
+	p->intervals[i].tid = tid;
+	p->intervals[i].beg = beg;
+	p->intervals[i].end = end;
+	p->n_intervals++;
+	pthread_cond_signal(&p->interval_ready);
+	pthread_mutex_unlock(&p->lock);
+}
+
+///////////////////////////////////////////////////////////
+// BAM records
+///////////////////////////////////////////////////////////
+
+/* Swap the CIGAR and the auxiliary fields of a record read on a big-endian host */
+static void bamr_swap_data(const bam1_core_t *c, int data_len, uint8_t *data)
+{
+	uint8_t *s, *end = data + data_len;
+	uint32_t i, *cigar = (uint32_t *)(data + c->l_qname);
+	int32_t n, size;
+	uint8_t type;
+
+	for (i = 0; i < c->n_cigar; ++i) {
+		bam_swap_endian_4p(&cigar[i]);
+	}
+	s = data + c->n_cigar * 4 + c->l_qname + c->l_qseq + (c->l_qseq + 1) / 2;
+	while (s + 3 <= end) {
+		s += 2; // key
+		type = toupper(*s++);
+		if (type == 'C' || type == 'A') {
+			s++;
+		} else if (type == 'S') {
+			bam_swap_endian_2p(s);
+			s += 2;
+		} else if (type == 'I' || type == 'F') {
+			bam_swap_endian_4p(s);
+			s += 4;
+		} else if (type == 'D') {
+			bam_swap_endian_8p(s);
+			s += 8;
+		} else if (type == 'Z' || type == 'H') {
+			while (s < end && *s) {
+				s++;
+			}
+			s++;
+		} else if (type == 'B') {
+			size = bam_aux_type2size(*s);
+			bam_swap_endian_4p(s + 1);
+			memcpy(&n, s + 1, 4);
+			s += 5;
+			for (i = 0; i < (uint32_t)n && s + size <= end; ++i, s += size) {
+				if (size == 2) {
+					bam_swap_endian_2p(s);
+				} else if (size == 4) {
+					bam_swap_endian_4p(s);
+				}
+			}
+		} else {
+			break;
+		}
+	}
+}
+
+/* As bam_read1() */
+static int bamr_read1(bamr_t *r, bam1_t *b)
+{
+	bam1_core_t *c = &b->core;
+	int32_t block_len, ret, i;
+	uint32_t x[8];
+
+	if ((ret = bamr_read(r, &block_len, 4)) != 4) {
+		return (ret == 0) ? -1 : -2;
+	}
+	if (bamr_read(r, x, 32) != 32) {
+		return -3;
+	}
+	if (r->big_endian) {
+		bam_swap_endian_4p(&block_len);
+		for (i = 0; i < 8; ++i) {
+			bam_swap_endian_4p(x + i);
+		}
+	}
+	c->tid = x[0];
+	c->pos = x[1];
+	c->bin = x[2] >> 16;
+	c->qual = x[2] >> 8 & 0xff;
+	c->l_qname = x[2] & 0xff;
+	c->flag = x[3] >> 16;
+	c->n_cigar = x[3] & 0xffff;
+	c->l_qseq = x[4];
+	c->mtid = x[5];
+	c->mpos = x[6];
+	c->isize = x[7];
+	b->data_len = block_len - 32;
+	if (b->m_data < b->data_len) {
+		b->m_data = b->data_len;
+		kroundup32(b->m_data);
+		b->data = (uint8_t *)realloc(b->data, b->m_data);
+	}
+	if (bamr_read(r, b->data, b->data_len) != b->data_len) {
+		return -4;
+	}
+	b->l_aux = b->data_len - c->n_cigar * 4 - c->l_qname - c->l_qseq - (c->l_qseq + 1) / 2;
+	if (r->big_endian) {
+		bamr_swap_data(c, b->data_len, b->data);
+	}
+	return 4 + block_len;
+}
+
+bamr_t *bamr_open(const char *fn, bamr_pool_t *pool, bamr_cache_t *cache)
+{
+	int i;
+	const char *c;
+	bamr_t *r;
+	FILE *fp;
+
+	fp = fopen(fn, "rb");
+	if (fp == NULL) {
+		return NULL;
+	}
+	r = (bamr_t *)calloc(1, sizeof(bamr_t));
+	r->fp = fp;
+	r->big_endian = bam_is_big_endian();
+	r->block = (uint8_t *)malloc(BAMR_BLOCK_SIZE);
+	r->compressed = (uint8_t *)malloc(BAMR_BLOCK_SIZE);
+	r->pool = pool;
+	r->cache = cache;
+	// FNV-1a hash of the file name
+	r->file_id = 14695981039346656037ULL;
+	for (c = fn; *c; c++) {
+		r->file_id = (r->file_id ^ (unsigned char)*c) * 1099511628211ULL;
+	}
+	if (pool != NULL) {
+		r->ring_size = 2 * pool->n_threads;
+		if (r->ring_size > BAMR_MAX_RING) {
+			r->ring_size = BAMR_MAX_RING;
+		}
+		for (i = 0; i < r->ring_size; i++) {
+			r->ring[i].src = (uint8_t *)malloc(BAMR_BLOCK_SIZE);
+			r->ring[i].dst = (uint8_t *)malloc(BAMR_BLOCK_SIZE);
+		}
+	}
+	return r;
+}
+
+void bamr_close(bamr_t *r)
+{
+	int i;
+	if (r == NULL) {
+		return;
+	}
+	if (r->pool != NULL) {
+		bamr_ring_clear(r);
+	}
+	for (i = 0; i < r->ring_size; i++) {
+		free(r->ring[i].src);
+		free(r->ring[i].dst);
+	}
+	fclose(r->fp);
+	free(r->block);
+	free(r->compressed);
+	free(r);
+}
+
+static int bamr_is_overlap(uint32_t beg, uint32_t end, const bam1_t *b)
+{
+	uint32_t rbeg = b->core.pos;
+	uint32_t rend = b->core.n_cigar ? bam_calend(&b->core, bam1_cigar(b)) : b->core.pos + 1;
+	return (rend > beg && rbeg < end);
+}
+
+/* As bam_fetch() with bam_iter_query() and bam_iter_read() */
+int bamr_fetch(bamr_t *r, const bai_t *idx, int tid, int beg, int end, void *data, bam_fetch_f func)
+{
+	int i, n_off, ret;
+	uint64_t curr_off = 0;
+	bai_chunk_t *off;
+	bam1_t *b;
+
+	if (beg < 0) {
+		beg = 0;
+	}
+	if (end < beg) {
+		return 0;
+	}
+	n_off = bai_query(idx, tid, beg, end, &off);
+	if (n_off == 0) {
+		return 0;
+	}
+	if (r->pool != NULL) {
+		bamr_ring_clear(r);
+		r->plan = off;
+		r->n_plan = n_off;
+	}
+
+	b = bam_init1();
+	i = -1;
+	for (;;) {
+		if (curr_off == 0 || curr_off >= off[i].v) {
+			// jump to the next chunk
+			if (i == n_off - 1) {
+				ret = -1;
+				break;
+			}
+			if (i < 0 || off[i].v != off[i + 1].u) {
+				bamr_seek(r, off[i + 1].u);
+				curr_off = bamr_tell(r);
+			}
+			++i;
+		}
+		if ((ret = bamr_read1(r, b)) >= 0) {
+			curr_off = bamr_tell(r);
+			if (b->core.tid != tid || b->core.pos >= end) {
+				ret = -1;
+				break;
+			} else if (bamr_is_overlap(beg, end, b)) {
+				func(b, data);
+			}
+		} else {
+			break;
+		}
+	}
+
+	if (r->pool != NULL) {
+		bamr_ring_clear(r);
+	}
+	bam_destroy1(b);
+	free(off);
+	return (ret == -1) ? 0 : ret;
+}
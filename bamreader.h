@@ -0,0 +1,92 @@
+/*
+ * Reading of BAM alignments through the BAI index
+ *
+ * bamr_fetch() visits the same alignments as bam_fetch(), in the same order, but reads
+ * the BGZF blocks itself. Blocks of the chunks being visited can be read ahead and
+ * inflated in parallel by a pool of helper threads shared by all readers, so that a
+ * deep region is not bound by the inflate speed of a single stream. The chunks of the
+ * next intervals can also be read ahead by a helper thread, hiding the storage latency,
+ * and inflated blocks can be kept in a cache shared by all readers.
+ */
+#ifndef __BAMREADER_H__
+#define __BAMREADER_H__
+
+#include <stdint.h>
+#include "samtools/bam.h"
+#include "bamindex.h"
+
+/*
+ * bamr_t, bamr_pool_t and bamr_cache_t are pointers to internally maintained data structures.
+ */
+typedef struct bamr_s bamr_t;
+typedef struct bamr_pool_s bamr_pool_t;
+typedef struct bamr_cache_s bamr_cache_t;
+
+/*
+ * Start n helper threads inflating BGZF blocks. Returns NULL if n <= 0.
+ */
+extern bamr_pool_t *bamr_pool_init(int n);
+
+/*
+ * Stop the helper threads. All the readers using the pool must be closed before.
+ */
+extern void bamr_pool_destroy(bamr_pool_t *pool);
+
+/*
+ * Create a cache of inflated blocks of at most size bytes, shared by all the readers
+ * using it. The cache is split in shards, each with its own lock and LRU list, and holds
+ * at least a few blocks per shard (about 4 MB) whatever size is. Returns NULL if size is 0.
+ */
+extern bamr_cache_t *bamr_cache_init(size_t size);
+
+/*
+ * Free the cache. All the readers using it must be closed before.
+ */
+extern void bamr_cache_destroy(bamr_cache_t *cache);
+
+/*
+ * Get the number of blocks found and not found in the cache
+ */
+extern void bamr_cache_stats(bamr_cache_t *cache, uint64_t *hits, uint64_t *misses);
+
+/*
+ * Open BAM file fn for reading through the index. Blocks are inflated by the threads of
+ * pool, or by the calling thread if pool is NULL, and kept in cache unless it is NULL.
+ * Returns NULL if the file cannot be opened.
+ */
+extern bamr_t *bamr_open(const char *fn, bamr_pool_t *pool, bamr_cache_t *cache);
+
+/*
+ * Close the file
+ */
+extern void bamr_close(bamr_t *r);
+
+/*
+ * bamr_prefetch_t is a pointer to an internally maintained data structure.
+ */
+typedef struct bamr_prefetch_s bamr_prefetch_t;
+
+/*
+ * Start a helper thread reading ahead, through its own handle of BAM file fn, the chunks
+ * of the intervals passed to bamr_prefetch(), so that they are in the page cache when the
+ * readers get to them. Returns NULL if the file cannot be opened.
+ */
+extern bamr_prefetch_t *bamr_prefetch_init(const char *fn, const bai_t *idx);
+
+/*
+ * Stop the helper thread, dropping the intervals not yet read
+ */
+extern void bamr_prefetch_destroy(bamr_prefetch_t *p);
+
+/*
+ * Queue the chunks of reference tid overlapping the 0-based interval [beg,end) to be read ahead
+ */
+extern void bamr_prefetch(bamr_prefetch_t *p, int tid, int beg, int end);
+
+/*
+ * Call func on the alignments of reference tid overlapping the 0-based interval [beg,end),
+ * exactly as bam_fetch() does. Returns 0 on success, a negative value on errors.
+ */
+extern int bamr_fetch(bamr_t *r, const bai_t *idx, int tid, int beg, int end, void *data, bam_fetch_f func);
+
+#endif
@@ -3,19 +3,32 @@
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
+#include <stdarg.h>
 #include <time.h>
 #include <pthread.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <errno.h>
 #include <assert.h>
+#include <limits.h>
+#include <zlib.h>
 #include "samtools/sam.h"
 #include "samtools/faidx.h"
-#include "hashmap.h"
+#include "bamindex.h"
+#include "bamreader.h"
+#include "refcache.h"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 /////////////////////////////
 ///CIGAR related macros
 /////////////////////////////
 
+// Already defined by samtools/bam.h, except BAM_CBACK and the accessors
+#ifndef BAM_CIGAR_SHIFT
 #define BAM_CMATCH      0
 #define BAM_CINS        1
 #define BAM_CDEL        2
@@ -25,13 +38,19 @@
 #define BAM_CPAD        6
 #define BAM_CEQUAL      7
 #define BAM_CDIFF       8
-#define BAM_CBACK       9
 #define BAM_CIGAR_SHIFT 4
 #define BAM_CIGAR_MASK  0xf
+#endif
+#define BAM_CBACK       9
 
 #define bam_cigar_op(c) ((c)&BAM_CIGAR_MASK)
 #define bam_cigar_oplen(c) ((c)>>BAM_CIGAR_SHIFT)
 
+// Flag of the supplementary alignments, newer than samtools/bam.h
+#ifndef BAM_FSUPPLEMENTARY
+#define BAM_FSUPPLEMENTARY 2048
+#endif
+
 #ifdef _WIN32
 #include <windows.h>
 #define sleep(x) Sleep(1000 * x)
@@ -48,35 +67,190 @@ int max_isize = 0;
 
 #define CHUNK_SIZE 32768
 
+// Regions are handed out to threads in batches of about total_cost/(threads*REGION_BATCH_DIV),
+// capped at MAX_REGION_BATCH regions
+#define REGION_BATCH_DIV 16
+#define MAX_REGION_BATCH 64
+
+// Weight of a target base, in compressed BAM bytes, in the region cost estimate
+#define COST_BYTES_PER_BASE 2
+
+// With more threads, regions longer than TILE_LENGTH are split in tiles computed in parallel
+#define TILE_LENGTH 250000
+
 ///////////////////////////////////////////////////////////
-// Dedup hasmap data structures
+// Dedup data structures
 ///////////////////////////////////////////////////////////
 
-#define KEY_MAX_LENGTH (128)
-
-typedef struct dedup_struct_s {
-	char key_string[KEY_MAX_LENGTH];
+// A read of the dedup window, found by the 64-bit hash of its name
+struct dedup_read {
+	uint64_t name;
+	const char *qname;   // name, in the arena of the window
 	int32_t chr1;
 	int32_t chr2;
 	int32_t pos_r1;
 	int32_t pos_r2;
-	int bp;
-	int paired;
-	int isize;
-} dedup_struct_t;
+	int32_t bp;
+	int32_t moved;   // index of the read once the window has slid, -1 until then
+	int8_t paired;
+	int8_t kept;     // not filtered as a duplicate
+	int8_t evicted;  // some of its reads have left the window
+};
+
+// Fragment coordinates shared by duplicate reads
+struct dedup_signature {
+	uint64_t first;  // chromosome and position of the first end
+	uint64_t second; // chromosome and position of the second end, 0 if not paired
+	int32_t paired;
+	int32_t read;    // read kept for the signature, -1 if the slot is empty
+};
+
+// Reads of a dedup window, with open addressing tables by name and by signature
+struct dedup_table {
+	struct dedup_read *reads; // in fetch order
+	int length;
+	int size;
+	int32_t *names;           // index of the read + 1, 0 if the slot is empty
+	struct dedup_signature *signatures;
+	int capacity;             // slots of the tables, a power of 2
+};
+
+// Reads kept by the dedup pass, to be piled up without fetching them again.
+// Each read is stored as its bam1_t followed by its data, padded to 8 bytes.
+struct read_arena {
+	uint8_t *data;
+	size_t length;
+	size_t size;
+};
+
+// What the dedup pass needs of a read of the window, in fetch order
+struct dedup_record {
+	uint64_t name;   // hash of the read name
+	size_t offset;   // of the read in the arena
+	int32_t beg;     // 0-based reference interval [beg,end), as tested by bam_fetch()
+	int32_t end;
+	int32_t tid;
+	int32_t pos;     // 5' end, soft clips included
+	int32_t bp;      // covered bases, assigned by forward reads and added by reverse ones
+	int32_t read;    // index of the read in the dedup table
+	uint16_t flag;
+	uint8_t strand;
+};
+
+// Dedup state of a thread, sliding along a chromosome with the tiles it computes:
+// the reads of the previous window overlapping the next one are kept, with their
+// entries in the table, and only the rest of the next window is fetched and added
+struct dedup_window {
+	struct dedup_record *records;
+	int length;
+	int size;
+	int fresh;       // first record not yet in the table
+	struct read_arena reads;
+	struct dedup_table table;
+	struct dedup_read *moved; // table reads being reordered as the window slides
+	int moved_size;
+	int tid;         // interval fetched so far, tid -1 if none
+	int beg;
+	int end;
+	int min_beg;     // reads starting before are already in the window
+};
+
+// Streaming dedup: the coordinate sorted reads are grouped by fragment signature, as
+// in the window dedup, in a ring of buckets, one for each 5' position. The first read of
+// a pair waits for its mate, to know both 5' ends. Once the scan is past any read that
+// could still fall in a bucket, the reads kept for its signatures are final.
+
+#define STREAM_PENDING 0
+#define STREAM_KEPT 1
+#define STREAM_DUPLICATE 2
+
+// Mates further away are not waited for: the first read of the pair is grouped by its
+// own 5' end and, when reached, the mate starts a template of their own
+#define STREAM_MATE_DISTANCE 5000
+
+// Slot of an open addressing table by 64-bit key, pointing to an entry of a pool
+struct stream_slot {
+	uint64_t key;
+	int32_t entry;   // -1 if the slot is empty
+};
+
+struct stream_index {
+	struct stream_slot *slots;
+	int capacity;    // a power of 2
+	int length;
+};
 
+// Reads sharing a name. The first read and its mate, when waited for, give the fragment
+// signature, which decides for all the reads (secondary and supplementary alignments too).
+struct stream_template {
+	uint64_t name;   // hash of the name, key of the template index
+	char *qname;     // name, in a buffer of qname_size characters kept with the pool entry
+	int qname_size;
+	int32_t evict;   // scan position after which no other read of the template is expected
+	int32_t tid;     // of the first read
+	int32_t pos;     // 5' end of the first read
+	int32_t mate;    // position of the mate still waited for, -1 if none
+	int32_t bp;      // covered bases, counted as in the window dedup
+	uint32_t order;  // creation order, ties keep the first template
+	uint16_t flag;   // of the first read
+	int8_t state;
+	int32_t next;    // next template in creation order, or in the free list
+};
+
+// Reads with the same fragment signature, in the bucket of its last 5' end
+struct stream_group {
+	uint64_t key;
+	int32_t best;    // template kept so far, pending until the group is final
+	int32_t bp;      // its covered bases
+	uint32_t order;  // its creation order
+	int32_t pos;     // last 5' end, bucket of the group
+	int32_t next;    // next group of the bucket, or in the free list
+};
 
-typedef struct dup_struct_s {
-	char key_string[KEY_MAX_LENGTH];
-	char name[KEY_MAX_LENGTH];
-	int bp;
-} dup_struct_t;
+// A template waiting for its mate, holding back the buckets from the position of its
+// first read
+struct stream_wait {
+	int32_t template;
+	uint32_t order;  // of the template, which may have been evicted and reused since
+	int32_t pos;
+};
 
+// A read of the tile waiting for the decision on its template
+struct stream_read {
+	int32_t template; // not evicted while the read waits
+	int32_t pos;
+	size_t offset;   // of the read in the arena
+};
 
-typedef struct fetch_reads_s {
+struct dedup_stream {
+	struct stream_index template_index;
+	struct stream_template *templates;
+	int templates_size;
+	int free_template;
+	int first_template; // oldest template, evicted first
+	int last_template;
+	uint32_t templates_created;
+	struct stream_index group_index;
+	struct stream_group *groups;
+	int groups_size;
+	int free_group;
+	int32_t *buckets;   // first group of each 5' position, modulo ring_size
+	int ring_size;      // a power of 2
+	int32_t span;       // longest read seen, soft clips included
+	int32_t final_pos;  // buckets before are final
+	struct stream_wait *waits; // templates waiting for their mate, in creation order
+	int waits_head;
+	int waits_length;
+	int waits_size;
+	struct stream_read *queue; // reads of the tile, in fetch order
+	int queue_head;
+	int queue_length;
+	int queue_size;
+	struct read_arena reads;
+	uint32_t beg;       // tile whose reads are piled up
+	uint32_t end;
 	bam_plbuf_t *buf;
-	map_t *hmap;
-} fetch_reads_t;
+};
 
 /////////////////////////////////////////////////////////////////////////////////////
 // Normal CDF
@@ -117,7 +291,9 @@ struct input_args {
 	char *fasta;
 	char *outdir;
 	char *duptablename;
+	char *timings;
 	int dedup;
+	int dedup_stream;
 	int mode;
 	int cores;
 	int mbq;
@@ -127,6 +303,13 @@ struct input_args {
 	//int dupmode;
 	int strand_bias;
 	int dedup_window;
+	int max_memory; // MB
+	int bgzf_threads;
+	int prefetch;
+	int block_cache; // MB
+	int binary;      // pileup file in binary format
+	int bgzip;       // pileup file compressed in BGZF format
+	int ref_block;   // depth band (%) of the blocks of reference-only positions of the pileup, -1 without blocks
 	float region_perc;
 };
 
@@ -148,8 +331,17 @@ struct input_args *getInputArgs(char *argv[], int argc)
 	arguments->bam = NULL;
 	arguments->fasta = NULL;
 	arguments->duptablename = NULL;
+	arguments->timings = NULL;
 	arguments->dedup = 0;
+	arguments->dedup_stream = 0;
 	arguments->dedup_window = 1000;
+	arguments->max_memory = 0;
+	arguments->bgzf_threads = 0;
+	arguments->prefetch = 0;
+	arguments->block_cache = 0;
+	arguments->binary = 0;
+	arguments->bgzip = 0;
+	arguments->ref_block = -1;
 	arguments->outdir = (char *)malloc(3);
 	sprintf(arguments->outdir, "./");
 	arguments->region_perc = 0.5;
@@ -187,11 +379,35 @@ struct input_args *getInputArgs(char *argv[], int argc)
 			arguments->duptablename = (char*)malloc(sizeof(char) * strlen(argv[i]) + 1);
 			strcpy(arguments->duptablename, argv[i] + 7);
 			subSlash(arguments->duptablename);
+		} else if (strncmp(argv[i], "timings=", 8) == 0) {
+			arguments->timings = (char*)malloc(sizeof(char) * strlen(argv[i]) + 1);
+			strcpy(arguments->timings, argv[i] + 8);
+			subSlash(arguments->timings);
 		} else if (strncmp(argv[i], "threads=", 8) == 0) {
 			tmp = (char*)malloc(strlen(argv[i]) - 7);
 			strcpy(tmp, argv[i] + 8);
 			arguments->cores = atoi(tmp);
 			free(tmp);
+		} else if (strncmp(argv[i], "maxmem=", 7) == 0) {
+			tmp = (char*)malloc(strlen(argv[i]) - 6);
+			strcpy(tmp, argv[i] + 7);
+			arguments->max_memory = atoi(tmp);
+			free(tmp);
+		} else if (strncmp(argv[i], "bgzfthreads=", 12) == 0) {
+			tmp = (char*)malloc(strlen(argv[i]) - 11);
+			strcpy(tmp, argv[i] + 12);
+			arguments->bgzf_threads = atoi(tmp);
+			free(tmp);
+		} else if (strncmp(argv[i], "prefetch=", 9) == 0) {
+			tmp = (char*)malloc(strlen(argv[i]) - 8);
+			strcpy(tmp, argv[i] + 9);
+			arguments->prefetch = atoi(tmp);
+			free(tmp);
+		} else if (strncmp(argv[i], "blockcache=", 11) == 0) {
+			tmp = (char*)malloc(strlen(argv[i]) - 10);
+			strcpy(tmp, argv[i] + 11);
+			arguments->block_cache = atoi(tmp);
+			free(tmp);
 		} else if (strncmp(argv[i], "mbq=", 4) == 0) {
 			tmp = (char*)malloc(strlen(argv[i]) - 3);
 			strcpy(tmp, argv[i] + 4);
@@ -220,11 +436,27 @@ struct input_args *getInputArgs(char *argv[], int argc)
 			arguments->strand_bias = 1;
 		} else if (strncmp(argv[i], "dedup", 6) == 0) {
 			arguments->dedup = 1;
+		} else if (strncmp(argv[i], "dedupstream", 12) == 0) {
+			arguments->dedup = 1;
+			arguments->dedup_stream = 1;
 		} else if (strncmp(argv[i], "dedupwin=", 9) == 0) {
 			tmp = (char*)malloc(strlen(argv[i]) - 8);
 			strcpy(tmp, argv[i] + 9);
 			arguments->dedup_window = atoi(tmp);
 			free(tmp);
+		} else if (strcmp(argv[i], "binary") == 0) {
+			arguments->binary = 1;
+		} else if (strcmp(argv[i], "bgzip") == 0) {
+			arguments->bgzip = 1;
+		} else if (strncmp(argv[i], "refblock=", 9) == 0) {
+			tmp = (char*)malloc(strlen(argv[i]) - 8);
+			strcpy(tmp, argv[i] + 9);
+			arguments->ref_block = atoi(tmp);
+			if (arguments->ref_block < 0) {
+				fprintf(stderr, "ERROR: reference block depth band should be positive.\n");
+				exit(1);
+			}
+			free(tmp);
 		} else if (strncmp(argv[i], "genotype", 8) == 0) {
 			arguments->genotype = 1;
 		} else if (strncmp(argv[i], "genotypeBT", 16) == 0) {
@@ -261,6 +493,22 @@ int checkInputArgs(struct input_args *arguments)
 		fprintf(stderr, "ERROR: the number of threads is not valid.\n");
 		control = 1;
 	}
+	if (arguments->max_memory < 0) {
+		fprintf(stderr, "ERROR: the memory budget is not valid.\n");
+		control = 1;
+	}
+	if (arguments->bgzf_threads < 0) {
+		fprintf(stderr, "ERROR: the number of BGZF threads is not valid.\n");
+		control = 1;
+	}
+	if (arguments->prefetch < 0) {
+		fprintf(stderr, "ERROR: the number of regions to prefetch is not valid.\n");
+		control = 1;
+	}
+	if (arguments->block_cache < 0) {
+		fprintf(stderr, "ERROR: the size of the block cache is not valid.\n");
+		control = 1;
+	}
 	if (checkFileExistance(arguments->bed) > 0) {
 		fprintf(stderr, "ERROR: File BED does not exist or is not specified.\n");
 		control = 1;
@@ -306,6 +554,26 @@ int checkInputArgs(struct input_args *arguments)
 		fprintf(stderr, "ERROR: mode should be in 0,1,2,3,4,5,6.\n");
 		control = 1;
 	}
+	if (arguments->binary == 1 && arguments->mode != 1 && arguments->mode != 4 && arguments->mode != 6) {
+		fprintf(stderr, "ERROR: binary pileup output is available in modes 1, 4 and 6.\n");
+		control = 1;
+	}
+	if (arguments->bgzip == 1 && arguments->mode != 1 && arguments->mode != 4 && arguments->mode != 6) {
+		fprintf(stderr, "ERROR: compressed pileup output is available in modes 1, 4 and 6.\n");
+		control = 1;
+	}
+	if (arguments->bgzip == 1 && arguments->binary == 1) {
+		fprintf(stderr, "ERROR: binary and bgzip options are not compatible.\n");
+		control = 1;
+	}
+	if (arguments->ref_block >= 0 && arguments->mode != 1 && arguments->mode != 4 && arguments->mode != 6) {
+		fprintf(stderr, "ERROR: reference blocks are available in modes 1, 4 and 6.\n");
+		control = 1;
+	}
+	if (arguments->ref_block >= 0 && arguments->binary == 1) {
+		fprintf(stderr, "ERROR: binary and refblock options are not compatible.\n");
+		control = 1;
+	}
 	if (arguments->region_perc < 0 || arguments->region_perc > 1) {
 		fprintf(stderr, "ERROR: Region fraction should be in the range [0,1].\n");
 		control = 1;
@@ -335,15 +603,22 @@ void printArguments(struct input_args *arguments)
 
 void printHelp()
 {
-	fprintf(stderr, "\nUsage: \n ./pacbam bam=string bed=string vcf=string fasta=string [mode=int] [threads=int] [mbq=int] [mrq=int] [mdc=int] [out=string] [dedup] [dedupwin=int] [regionperc=float] [strandbias]\n\n");
+	fprintf(stderr, "\nUsage: \n ./pacbam bam=string bed=string vcf=string fasta=string [mode=int] [threads=int] [mbq=int] [mrq=int] [mdc=int] [out=string] [dedup] [dedupstream] [dedupwin=int] [duptab=string] [regionperc=float] [strandbias] [timings=string] [maxmem=int] [bgzfthreads=int] [prefetch=int] [blockcache=int] [binary] [bgzip] [refblock=int]\n ./pacbam view in=string [region=string]\n\n");
 	fprintf(stderr, "bam=string \n NGS data file in BAM format\n");
 	fprintf(stderr, "bed=string \n List of target captured regions in BED format\n");
 	fprintf(stderr, "vcf=string \n List of SNP positions in VCF format (no compressed files are admitted)\n");
 	fprintf(stderr, "fasta=string \n Reference genome FASTA format file \n");
 	fprintf(stderr, "mode=string \n Execution mode [0=RC+SNPs+SNVs|1=RC+SNPs+SNVs+PILEUP(not including SNPs)|2=SNPs|3=RC|4=PILEUP|6=BAMCOUNT]\n (default 4)\n");
 	fprintf(stderr, "dedup \n On-the-fly duplicates filtering\n");
+	fprintf(stderr, "dedupstream \n On-the-fly duplicates filtering in a single scan of the coordinate sorted reads, with memory bounded by depth and mate distance\n (same reads kept as dedup, except for pairs whose mate is more than 5000 bp ahead, compared by the 5' end of their first read only)\n");
 	fprintf(stderr, "dedupwin=int \n Flanking region around captured regions to consider in duplicates filtering [default 1000]\n");
+	fprintf(stderr, "duptab=string \n Coverage-dependent duplicates lookup table: at each position, at most as many reads per base with the same start, strand and mate position are counted\n as the threshold of the base coverage (tab separated lines with min coverage, max coverage (excluded) and threshold)\n");
 	fprintf(stderr, "threads=int \n Number of threads used (if available) for the pileup computation\n (default 1)\n");
+	fprintf(stderr, "timings=string \n File where per-region computation times are saved, and loaded from a previous run on the same target to balance threads workload\n");
+	fprintf(stderr, "bgzfthreads=int \n Number of helper threads inflating BAM blocks ahead of the pileup threads\n (default 0, blocks are inflated by the pileup threads)\n");
+	fprintf(stderr, "prefetch=int \n Number of upcoming regions of each thread whose BAM data is read ahead by a helper thread, to hide the storage latency\n (default 0, no read ahead)\n");
+	fprintf(stderr, "blockcache=int \n Size (MB) of the cache of inflated BAM blocks shared by all threads, so that blocks spanning adjacent regions or dedup windows are inflated once\n Sizes below 4 are rounded up to 4, the least that holds a few blocks in each of the 16 parts of the cache\n (default 0, no cache)\n");
+	fprintf(stderr, "maxmem=int \n Approximate memory budget (MB) for regions computed and not yet written; when reached, threads wait for the output to catch up\n (default 0, no limit)\n");
 	fprintf(stderr, "regionperc=float \n Fraction of the captured region to consider for maximum peak signal characterization\n (default 0.5)\n");
 	fprintf(stderr, "mbq=int \n Min base quality\n (default 20)\n");
 	fprintf(stderr, "mrq=int \n Min read quality\n (default 1)\n");
@@ -351,79 +626,101 @@ void printHelp()
 	fprintf(stderr, "strandbias \n Print strand bias count information\n");
 	fprintf(stderr, "genotype \n Print genotype calls for input SNPs using a strategy based on an allelic fraction cutoff threshold at 20%\n");
 	fprintf(stderr, "genotypeBT \n Print genotype calls for input SNPs using a strategy based on a binomial test with significance at 1%)\n");
+	fprintf(stderr, "binary \n Write the pileup file of modes 1, 4 and 6 in indexed binary format (.pbin), printed as text by pacbam view\n");
+	fprintf(stderr, "bgzip \n Write the pileup file of modes 1, 4 and 6 compressed in BGZF format (.pileup.gz), with a tabix index (.pileup.gz.tbi)\n");
+	fprintf(stderr, "refblock=int \n Merge in one row of the pileup file of modes 1, 4 and 6 each run of consecutive positions without alternative bases whose depth\n stays within the band (%%) above its minimum, adding an end column; full rows are written for the other positions\n");
 	fprintf(stderr, "out=string \n Path of output directory (default is the current directory)\n\n");
+	fprintf(stderr, "view in=string \n Print a binary pileup file as the text pileup file\n");
+	fprintf(stderr, "region=string \n Print only the rows of region chr, chr:from or chr:from-to\n\n");
 }
 
 
 ///////////////////////////////////////////////////////////
-// Duplicates list
+// Duplicates signatures
 ///////////////////////////////////////////////////////////
 
-struct Dnode {
-	int pos;
-	int pos_pair;
-	int chr_pair;
-	int number;
-	int strand;
-	struct Dlist *next;
+// Reads of a position with the same base, strand, unclipped start and mate position
+struct dup_signature {
+	int32_t pos;
+	int32_t pos_pair;
+	int32_t chr_pair;
+	int32_t base;    // base index (0-3) and strand (bit 2), -1 if the slot is empty
+	int32_t number;  // count of reads
 };
 
-typedef struct Dnode Dlist;
+// Open addressing table of the signatures of the reads piled up at a position. It is
+// sized for the depth of each position and cleared through the list of used slots, so
+// that it is allocated once per thread.
+struct dup_signatures {
+	struct dup_signature *slots;
+	int *used;       // indices of the used slots, in insertion order
+	int length;
+	int capacity;    // a power of 2
+};
 
-Dlist *addDlist(Dlist *list, int *list_counts, int npos, int npos_pair, int nchr_pair, int nstrand)
+void initDupSignatures(struct dup_signatures *sigs)
 {
-	Dlist *tmp = list;
-	// Assumes reads in the pileup area ordered by position
-	//if(list!=NULL && npos>(list->pos+MAX_CSOFT_CLIP))
-	//{
-	//	countAndFreeDlist(tmp,list_counts);
-	//	list = NULL;
-	//}
+	sigs->slots = NULL;
+	sigs->used = NULL;
+	sigs->length = 0;
+	sigs->capacity = 0;
+}
 
-	tmp = list;
-	while (list != NULL) {
-		if (list->pos == npos && list->pos_pair == npos_pair && list->chr_pair == nchr_pair && list->strand == nstrand) {
-			list->number++;
-			return (tmp);
-		}
-		list = list->next;
-	}
-	Dlist *link = (struct Dnode*)malloc(sizeof(struct Dnode));
-	link->pos = npos;
-	link->pos_pair = npos_pair;
-	link->chr_pair = nchr_pair;
-	link->number = 1;
-	link->strand = nstrand;
-	link->next = tmp;
-	return (link);
+void destroyDupSignatures(struct dup_signatures *sigs)
+{
+	free(sigs->slots);
+	free(sigs->used);
+	initDupSignatures(sigs);
 }
 
-void countAndFreeDlist(Dlist *list, int *list_counts)
+// Empties the table, making room for the signatures of n reads
+void resetDupSignatures(struct dup_signatures *sigs, int n)
 {
-	int idx;
-	Dlist *tmp;
-	while (list != NULL) {
-		idx = list->number - 1;
-		if (idx > (MAX_DUP - 1)) {
-			idx = MAX_DUP - 1;
+	int i, capacity;
+	if (sigs->capacity < 2 * n) {
+		for (capacity = 64; capacity < 2 * n; capacity *= 2);
+		free(sigs->slots);
+		free(sigs->used);
+		sigs->slots = (struct dup_signature *)malloc(sizeof(struct dup_signature) * capacity);
+		sigs->used = (int *)malloc(sizeof(int) * capacity);
+		sigs->capacity = capacity;
+		for (i = 0; i < capacity; i++) {
+			sigs->slots[i].base = -1;
+		}
+	} else {
+		for (i = 0; i < sigs->length; i++) {
+			sigs->slots[sigs->used[i]].base = -1;
 		}
-		list_counts[idx]++;
-		tmp = list;
-		list = list->next;
-		free(tmp);
 	}
+	sigs->length = 0;
 }
 
-void printDlist(Dlist *list)
+// Counts a read with the given signature
+void addDupSignature(struct dup_signatures *sigs, int base, int strand, int pos, int pos_pair, int chr_pair)
 {
-	if (list == NULL) {
-		fprintf(stderr, "NA");
-	}
-	while (list != NULL) {
-		fprintf(stderr, "%d-%d:%d", list->pos, list->pos_pair, list->number);
-		list = list->next;
-		if (list != NULL) {
-			fprintf(stderr, "|");
+	uint64_t h;
+	int i;
+	struct dup_signature *slot;
+
+	base |= (strand != 0) << 2;
+	h = (uint64_t)(uint32_t)pos * 0x9E3779B97F4A7C15ULL ^
+	    (uint64_t)(uint32_t)pos_pair * 0xC2B2AE3D27D4EB4FULL ^
+	    (uint64_t)(((uint32_t)chr_pair << 3) | (uint32_t)base) * 0x165667B19E3779F9ULL;
+	h ^= h >> 29;
+	for (i = (int)(h & (uint64_t)(sigs->capacity - 1)); ; i = (i + 1) & (sigs->capacity - 1)) {
+		slot = &(sigs->slots[i]);
+		if (slot->base == -1) {
+			slot->pos = pos;
+			slot->pos_pair = pos_pair;
+			slot->chr_pair = chr_pair;
+			slot->base = base;
+			slot->number = 1;
+			sigs->used[sigs->length++] = i;
+			return;
+		}
+		if (slot->base == base && slot->pos == pos && slot->pos_pair == pos_pair && slot->chr_pair == chr_pair) {
+			slot->number++;
+			return;
 		}
 	}
 }
@@ -468,6 +765,24 @@ void subSlash(char *s)
 #endif
 }
 
+// Gets the path of file name.extension in the output directory
+char *getOutputFileName(char *outdir, char *name, char *extension)
+{
+	int l = strlen(outdir);
+	char *file_name = (char *)malloc(l + strlen(name) + strlen(extension) + 3);
+#ifdef _WIN32
+	char sep = '\\';
+#else
+	char sep = '/';
+#endif
+	if (l > 0 && outdir[l - 1] != sep) {
+		sprintf(file_name, "%s%c%s.%s", outdir, sep, name, extension);
+	} else {
+		sprintf(file_name, "%s%s.%s", outdir, name, extension);
+	}
+	return (file_name);
+}
+
 void printMessage(char *message)
 {
 	time_t current_time;
@@ -499,10 +814,15 @@ struct lookup_dup {
 	int *covs_up;
 	int *covs_down;
 	int *thresholds;
+	int covs;        // number of coverages with a threshold in by_cov
+	int *by_cov;     // threshold of each coverage below covs
 };
 
+// Largest number of coverages whose threshold is tabulated (4 MB)
+#define MAX_DUP_LOOKUP_COVS 1048576
 
-int getThrDupLookup(struct lookup_dup *duptable, int cov)
+// Threshold of a coverage, from the first interval of the table containing it
+int scanThrDupLookup(struct lookup_dup *duptable, int cov)
 {
 	int i;
 	if (cov < duptable->covs_down[0]) {
@@ -519,41 +839,261 @@ int getThrDupLookup(struct lookup_dup *duptable, int cov)
 	return (10000);
 }
 
+// Tabulates the threshold of the coverages up to the largest interval bound, above
+// which the threshold of the last interval applies
+void indexDUPLookupTable(struct lookup_dup *duptable)
+{
+	int i, covs = duptable->covs_down[0];
+	for (i = 0; i < duptable->length; i++) {
+		if (duptable->covs_up[i] > covs) {
+			covs = duptable->covs_up[i];
+		}
+	}
+	if (covs > MAX_DUP_LOOKUP_COVS) {
+		covs = MAX_DUP_LOOKUP_COVS;
+	}
+	duptable->covs = covs;
+	duptable->by_cov = (int *)malloc(sizeof(int) * (covs > 0 ? covs : 1));
+	for (i = 0; i < covs; i++) {
+		duptable->by_cov[i] = scanThrDupLookup(duptable, i);
+	}
+}
+
+int getThrDupLookup(struct lookup_dup *duptable, int cov)
+{
+	if (cov < duptable->covs) {
+		return (duptable->by_cov[cov]);
+	}
+	return (scanThrDupLookup(duptable, cov));
+}
+
+// Counts of a single position while it is piled up or printed, the base counters also
+// indexed by base (BASE_A, BASE_C, BASE_G, BASE_T)
 struct pos_pileup {
-	uint32_t pos; // Max 4,294,967,295
-	int A;        // Count of fwd mapped read. Max 2,147,483,647
-	int C;
-	int G;
-	int T;
-	int Asb;      // Count of rc mapped read
-	int Csb;
-	int Gsb;
-	int Tsb;
+	union {
+		struct {
+			int A;        // Count of fwd mapped read. Max 2,147,483,647
+			int C;
+			int G;
+			int T;
+		};
+		int base[4];
+	};
+	union {
+		struct {
+			int Asb;      // Count of rc mapped read
+			int Csb;
+			int Gsb;
+			int Tsb;
+		};
+		int base_rev[4];
+	};
 	int del;      // Count deletions
 };
 
+#define BASE_A 0
+#define BASE_C 1
+#define BASE_G 2
+#define BASE_T 3
+
+// Base index of a 4-bit BAM base code, -1 for the codes other than A, C, G and T
+static const int8_t nt16_base_index[16] = {-1, BASE_A, BASE_C, -1, BASE_G, -1, -1, -1, BASE_T, -1, -1, -1, -1, -1, -1, -1};
+
+// Base index of an uppercase reference character plus 1, 0 for the characters other than A, C, G and T
+static const int8_t char_base_index[256] = {['A'] = BASE_A + 1, ['C'] = BASE_C + 1, ['G'] = BASE_G + 1, ['T'] = BASE_T + 1};
+
+// Stored counts of the positions of a region, one array per counter indexed by the
+// position in the region (the arrays are slices of a single block of POS_COUNTERS
+// arrays). Counts up to POS_COUNT_MAX fit 16 bits; a position with a larger count has
+// del set to POS_COUNT_OVERFLOW and its counts in the overflow table of the region.
+struct pos_counts {
+	uint16_t *A;
+	uint16_t *C;
+	uint16_t *G;
+	uint16_t *T;
+	uint16_t *Asb;
+	uint16_t *Csb;
+	uint16_t *Gsb;
+	uint16_t *Tsb;
+	uint16_t *del;
+};
+
+#define POS_COUNTERS 9
+#define POS_COUNT_MAX 0xFFFE
+#define POS_COUNT_OVERFLOW 0xFFFF
+
+struct pos_overflow_entry {
+	uint32_t pos;     // 0-based reference position
+	struct pos_pileup counts;
+};
+
+// Positions of a region whose counts do not fit 16 bits. The tiles of the region add
+// them under the lock, and they are sorted by position once the region is computed.
+struct pos_overflow {
+	pthread_mutex_t lock;
+	struct pos_overflow_entry *entries;
+	int length;
+	int size;
+};
+
 // Data for a single region
 struct region_data {
 	uint32_t beg;
 	uint32_t end;
-	struct pos_pileup *positions;
-	samfile_t *in;
+	uint16_t *counts;             // block of the count arrays
+	struct pos_counts positions;
+	struct pos_overflow *overflow;
+	bamr_t *in;
 	struct lookup_dup *duptable;
+	struct dup_signatures *signatures; // signatures table of the thread, when duptable is set
 	struct input_args *arguments;
 };
 
+// Points the count arrays to a block of POS_COUNTERS arrays of length positions
+void setPosCountsArrays(struct pos_counts *c, uint16_t *block, size_t length)
+{
+	c->A = block;
+	c->C = block + length;
+	c->G = block + 2 * length;
+	c->T = block + 3 * length;
+	c->Asb = block + 4 * length;
+	c->Csb = block + 5 * length;
+	c->Gsb = block + 6 * length;
+	c->Tsb = block + 7 * length;
+	c->del = block + 8 * length;
+}
+
+// Points the count arrays of slice to the positions of c from offset on
+void slicePosCounts(struct pos_counts *slice, const struct pos_counts *c, size_t offset)
+{
+	slice->A = c->A + offset;
+	slice->C = c->C + offset;
+	slice->G = c->G + offset;
+	slice->T = c->T + offset;
+	slice->Asb = c->Asb + offset;
+	slice->Csb = c->Csb + offset;
+	slice->Gsb = c->Gsb + offset;
+	slice->Tsb = c->Tsb + offset;
+	slice->del = c->del + offset;
+}
+
+// Stores the counts of 0-based position pos, the region being piled up from rdata->beg
+void setPosCounts(struct region_data *rdata, uint32_t pos, const struct pos_pileup *counts)
+{
+	struct pos_counts *c = &(rdata->positions);
+	struct pos_overflow *overflow = rdata->overflow;
+	uint32_t i = pos - rdata->beg;
+
+	if (counts->A > POS_COUNT_MAX || counts->C > POS_COUNT_MAX || counts->G > POS_COUNT_MAX || counts->T > POS_COUNT_MAX ||
+	        counts->Asb > POS_COUNT_MAX || counts->Csb > POS_COUNT_MAX || counts->Gsb > POS_COUNT_MAX || counts->Tsb > POS_COUNT_MAX ||
+	        counts->del > POS_COUNT_MAX) {
+		pthread_mutex_lock(&overflow->lock);
+		if (overflow->length == overflow->size) {
+			overflow->size = overflow->size ? overflow->size * 2 : 64;
+			overflow->entries = (struct pos_overflow_entry *)realloc(overflow->entries, sizeof(struct pos_overflow_entry) * overflow->size);
+		}
+		overflow->entries[overflow->length].pos = pos;
+		overflow->entries[overflow->length].counts = *counts;
+		overflow->length++;
+		pthread_mutex_unlock(&overflow->lock);
+		c->del[i] = POS_COUNT_OVERFLOW;
+		return;
+	}
+	c->A[i] = counts->A;
+	c->C[i] = counts->C;
+	c->G[i] = counts->G;
+	c->T[i] = counts->T;
+	c->Asb[i] = counts->Asb;
+	c->Csb[i] = counts->Csb;
+	c->Gsb[i] = counts->Gsb;
+	c->Tsb[i] = counts->Tsb;
+	c->del[i] = counts->del;
+}
+
+static int compareOverflowEntries(const void *a, const void *b)
+{
+	uint32_t x = ((const struct pos_overflow_entry *)a)->pos;
+	uint32_t y = ((const struct pos_overflow_entry *)b)->pos;
+	return ((x > y) - (x < y));
+}
+
+// Sorts the overflow table of a computed region, to look its positions up
+void sortPosOverflow(struct region_data *rdata)
+{
+	if (rdata->overflow->length > 1) {
+		qsort(rdata->overflow->entries, rdata->overflow->length, sizeof(struct pos_overflow_entry), compareOverflowEntries);
+	}
+}
+
+// Gets the counts of the position at index of a computed region
+void getPosCounts(const struct region_data *rdata, int index, struct pos_pileup *counts)
+{
+	const struct pos_counts *c = &(rdata->positions);
+	const struct pos_overflow *overflow;
+	uint32_t pos;
+	int lo, hi, mid;
+
+	if (c->del[index] != POS_COUNT_OVERFLOW) {
+		counts->A = c->A[index];
+		counts->C = c->C[index];
+		counts->G = c->G[index];
+		counts->T = c->T[index];
+		counts->Asb = c->Asb[index];
+		counts->Csb = c->Csb[index];
+		counts->Gsb = c->Gsb[index];
+		counts->Tsb = c->Tsb[index];
+		counts->del = c->del[index];
+		return;
+	}
+	overflow = rdata->overflow;
+	pos = rdata->beg + index;
+	lo = 0;
+	hi = overflow->length - 1;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (overflow->entries[mid].pos < pos) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	*counts = overflow->entries[lo].counts;
+}
+
+// Coverage of the position at index of a computed region
+static inline int getPosCoverage(const struct region_data *rdata, int index)
+{
+	const struct pos_counts *c = &(rdata->positions);
+	struct pos_pileup counts;
+
+	if (c->del[index] != POS_COUNT_OVERFLOW) {
+		return (c->A[index] + c->C[index] + c->G[index] + c->T[index]);
+	}
+	getPosCounts(rdata, index, &counts);
+	return (counts.A + counts.C + counts.G + counts.T);
+}
+
 // Contains info of a captured region
 struct target_t {
 	char *chr;
 	uint32_t from;
 	uint32_t to;
+	int tid;        // BAM reference id
+	int tiles;      // number of tiles the region is split in
+	int tiles_done;
+	int ready;      // region completely computed
 	struct region_data *rdata;
-	char *sequence;
+	ref_packed_t *reference; // reference of the region, while it is formatted
 	uint32_t from_sel;
 	uint32_t to_sel;
 	float gc;
 	float read_count;
 	float read_count_global;
+	double cost;    // estimated computation cost used for scheduling
+	double elapsed; // seconds spent computing the pileup
+	size_t memory;  // bytes held by the region until it is written
+	int snp_index;  // first SNP of the VCF to check for the region
+	struct region_output *output; // formatted output rows of the region
 };
 
 // Collects info of all captured regions
@@ -592,83 +1132,47 @@ char getBase(int val)
 
 void incBase(struct pos_pileup *elem, int val)
 {
-	if (val == 1) {
-		elem->A++;
-	} else if (val == 2) {
-		elem->C++;
-	} else if (val == 4) {
-		elem->G++;
-	} else if (val == 8) {
-		elem->T++;
+	int b = nt16_base_index[val];
+	if (b >= 0) {
+		elem->base[b]++;
 	}
 }
 
 void incBaseStrand(struct pos_pileup *elem, int val, int strand)
 {
-	if (val == 1 && strand) {
-		elem->Asb++;
-	} else if (val == 2 && strand) {
-		elem->Csb++;
-	} else if (val == 4 && strand) {
-		elem->Gsb++;
-	} else if (val == 8 && strand) {
-		elem->Tsb++;
-	}
-}
-
-
-// Increments the number of duplicated reads per base
-void incBaseDup(Dlist *dup[], int *dup_counts[], int val, int pos, int pos_pair, int chr_pair, int strand)
-{
-	if (val == 1) {
-		dup[0] = addDlist(dup[0], dup_counts[0], pos, pos_pair, chr_pair, strand);
-	} else if (val == 2) {
-		dup[1] = addDlist(dup[1], dup_counts[1], pos, pos_pair, chr_pair, strand);
-	} else if (val == 4) {
-		dup[2] = addDlist(dup[2], dup_counts[2], pos, pos_pair, chr_pair, strand);
-	} else if (val == 8) {
-		dup[3] = addDlist(dup[3], dup_counts[3], pos, pos_pair, chr_pair, strand);
+	int b = nt16_base_index[val];
+	if (b >= 0 && strand) {
+		elem->base_rev[b]++;
 	}
 }
 
-// Compute coverage of bases by duplicates lists
-void computeCovBaseDup(int *dup_counts[], struct pos_pileup *elem, int thr_cov_A, int thr_cov_C, int thr_cov_G, int thr_cov_T)
+// Recomputes the count of each base at a position, counting at most as many reads of a
+// signature as the duplicates threshold of the base coverage, and with strand_bias the
+// count on the reverse strand in the same way
+void capBaseDup(struct dup_signatures *sigs, struct lookup_dup *duptable, struct pos_pileup *elem, int strand_bias)
 {
-	int i;
-	elem->A = 0;
-	for (i = 0; i < MAX_DUP; i++) {
-		if (i <= (thr_cov_A - 1)) {
-			elem->A += (i + 1) * dup_counts[0][i];
-		} else {
-			elem->A += thr_cov_A * dup_counts[0][i];
-		}
-	}
-	elem->C = 0;
-	for (i = 0; i < MAX_DUP; i++) {
-		if (i <= (thr_cov_C - 1)) {
-			elem->C += (i + 1) * dup_counts[1][i];
-		} else {
-			elem->C += thr_cov_C * dup_counts[1][i];
-		}
-	}
-	elem->G = 0;
-	for (i = 0; i < MAX_DUP; i++) {
-		if (i <= (thr_cov_G - 1)) {
-			elem->G += (i + 1) * dup_counts[2][i];
-		} else {
-			elem->G += thr_cov_G * dup_counts[2][i];
+	int i, b, n, thr[4];
+	struct dup_signature *sig;
+
+	for (b = 0; b < 4; b++) {
+		thr[b] = getThrDupLookup(duptable, elem->base[b]);
+		elem->base[b] = 0;
+		if (strand_bias == 1) {
+			elem->base_rev[b] = 0;
 		}
 	}
-	elem->T = 0;
-	for (i = 0; i < MAX_DUP; i++) {
-		if (i <= (thr_cov_T - 1)) {
-			elem->T += (i + 1) * dup_counts[3][i];
-		} else {
-			elem->T += thr_cov_T * dup_counts[3][i];
+	for (i = 0; i < sigs->length; i++) {
+		sig = &(sigs->slots[sigs->used[i]]);
+		b = sig->base & 3;
+		n = (sig->number < thr[b] ? sig->number : thr[b]);
+		elem->base[b] += n;
+		if (strand_bias == 1 && (sig->base & 4)) {
+			elem->base_rev[b] += n;
 		}
 	}
 }
 
+
 void mergeBEDVCFCHRLists(char **vcf, char **bed, char **merge)
 {
 	int i = 0, j = 0, k = 0, l, n;
@@ -736,138 +1240,278 @@ int getChrPos(char *chr)
 	}
 }
 
-int getBaseCount(struct region_data *elem, char *s, int index)
+int getBaseCount(const struct pos_pileup *counts, char *s)
 {
-	if (strncmp(s, "A", 1) == 0) {
-		return (elem->positions[index].A);
-	} else if (strncmp(s, "C", 1) == 0) {
-		return (elem->positions[index].C);
-	} else if (strncmp(s, "G", 1) == 0) {
-		return (elem->positions[index].G);
-	} else if (strncmp(s, "T", 1) == 0) {
-		return (elem->positions[index].T);
-	}
-	return (0);
+	int b = char_base_index[(unsigned char)*s] - 1;
+	return (b >= 0 ? counts->base[b] : 0);
 }
 
-int getAlternativeSum(struct region_data *elem, char *s, int index)
+///////////////////////////////////////////////////////////
+// Per-position statistics
+///////////////////////////////////////////////////////////
+
+// Positions whose statistics are computed at once, before their rows are formatted
+#define POS_STATS_BLOCK 512
+
+// Statistics of a block of positions of a region
+struct pos_stats {
+	int cov[POS_STATS_BLOCK];          // sum of the base counts
+	int ref[POS_STATS_BLOCK];          // count of the reference base, 0 if it is not A, C, G or T
+	int alt_sum[POS_STATS_BLOCK];      // sum of the counts of the other bases, 0 if the reference is not A, C, G or T
+	int alt[POS_STATS_BLOCK];          // count of the most frequent other base, 0 on ties
+	char alt_base[POS_STATS_BLOCK];    // the most frequent other base, N on ties
+	double frac[4][POS_STATS_BLOCK];   // count of A, C, G and T over the coverage (mode 6)
+	double strand[4][POS_STATS_BLOCK]; // fraction of the reads of a base mapped forward (mode 6)
+	char bases[POS_STATS_BLOCK];       // reference bases of the positions
+};
+
+// Statistics of a single position with reference base base
+static void setPosStats(struct pos_stats *stats, int k, const struct pos_pileup *c, char base, int fractions)
 {
-	if (strncmp(s, "A", 1) == 0) {
-		return (elem->positions[index].C + elem->positions[index].G + elem->positions[index].T);
-	} else if (strncmp(s, "C", 1) == 0) {
-		return (elem->positions[index].A + elem->positions[index].G + elem->positions[index].T);
-	} else if (strncmp(s, "G", 1) == 0) {
-		return (elem->positions[index].A + elem->positions[index].C + elem->positions[index].T);
-	} else if (strncmp(s, "T", 1) == 0) {
-		return (elem->positions[index].A + elem->positions[index].C + elem->positions[index].G);
+	const int *counts = c->base;
+	int b, r, max, ties;
+
+	r = char_base_index[(unsigned char)base] - 1;
+	stats->cov[k] = counts[0] + counts[1] + counts[2] + counts[3];
+	stats->ref[k] = stats->alt_sum[k] = stats->alt[k] = 0;
+	stats->alt_base[k] = 'N';
+	if (r >= 0) {
+		stats->ref[k] = counts[r];
+		stats->alt_sum[k] = stats->cov[k] - counts[r];
+		max = -1;
+		ties = 0;
+		for (b = 0; b < 4; b++) {
+			if (b == r) {
+				continue;
+			}
+			if (counts[b] > max) {
+				max = counts[b];
+				ties = 0;
+				stats->alt_base[k] = "ACGT"[b];
+			}
+			ties += (counts[b] == max);
+		}
+		if (ties > 1) {
+			stats->alt_base[k] = 'N';
+		} else {
+			stats->alt[k] = max;
+		}
+	}
+	if (fractions) {
+		for (b = 0; b < 4; b++) {
+			stats->frac[b][k] = (stats->cov[k] ? counts[b] / (double)stats->cov[k] : 0.0);
+			stats->strand[b][k] = (counts[b] ? (counts[b] - c->base_rev[b]) / (double)counts[b] : 0.0);
+		}
 	}
-	return (0);
 }
 
-int getSum(struct region_data *elem, int index)
+#if defined(__AVX2__)
+
+// Mode 6 fractions of 4 positions from their 32-bit count, reverse strand count and coverage
+static inline void setPosFractions(__m128i count, __m128i rev, __m128i cov, double *frac, double *strand)
 {
-	return (elem->positions[index].A + elem->positions[index].C + elem->positions[index].G + elem->positions[index].T);
-}
+	const __m256d zero = _mm256_setzero_pd();
+	__m256d x = _mm256_cvtepi32_pd(count);
+	__m256d n = _mm256_cvtepi32_pd(cov);
 
+	_mm256_storeu_pd(frac, _mm256_and_pd(_mm256_div_pd(x, n), _mm256_cmp_pd(n, zero, _CMP_NEQ_UQ)));
+	_mm256_storeu_pd(strand, _mm256_and_pd(_mm256_div_pd(_mm256_cvtepi32_pd(_mm_sub_epi32(count, rev)), x), _mm256_cmp_pd(x, zero, _CMP_NEQ_UQ)));
+}
 
-int CheckAlt(struct target_t *elem, int index)
+// Statistics of the positions of a block 16 at a time. Returns the positions computed.
+static int setPosStatsVector(const struct pos_counts *c, const char *sequence, int n, int fractions, struct pos_stats *stats)
 {
-	if (elem->sequence == NULL) {
-		return (0);
-	}
-	if (elem->sequence[index] == 'A') {
-		return (elem->rdata->positions[index].C + elem->rdata->positions[index].G + elem->rdata->positions[index].T);
-	} else if (elem->sequence[index] == 'C') {
-		return (elem->rdata->positions[index].A + elem->rdata->positions[index].G + elem->rdata->positions[index].T);
-	} else if (elem->sequence[index] == 'G') {
-		return (elem->rdata->positions[index].A + elem->rdata->positions[index].C + elem->rdata->positions[index].T);
-	} else if (elem->sequence[index] == 'T') {
-		return (elem->rdata->positions[index].A + elem->rdata->positions[index].C + elem->rdata->positions[index].G);
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i one = _mm256_set1_epi16(1);
+	__m256i seq, isA, isC, isG, isT, acgt, x[4], rev[4], ref, max, eq[4], ties, base;
+	__m128i cov[2], half[2], h;
+	int k, b, j;
+
+	for (k = 0; k + 16 <= n; k += 16) {
+		seq = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(sequence + k)));
+		isA = _mm256_cmpeq_epi16(seq, _mm256_set1_epi16('A'));
+		isC = _mm256_cmpeq_epi16(seq, _mm256_set1_epi16('C'));
+		isG = _mm256_cmpeq_epi16(seq, _mm256_set1_epi16('G'));
+		isT = _mm256_cmpeq_epi16(seq, _mm256_set1_epi16('T'));
+		acgt = _mm256_or_si256(_mm256_or_si256(isA, isC), _mm256_or_si256(isG, isT));
+		x[0] = _mm256_loadu_si256((const __m256i *)(c->A + k));
+		x[1] = _mm256_loadu_si256((const __m256i *)(c->C + k));
+		x[2] = _mm256_loadu_si256((const __m256i *)(c->G + k));
+		x[3] = _mm256_loadu_si256((const __m256i *)(c->T + k));
+
+		// coverage and reference count, 8 positions per 32-bit half
+		ref = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(x[0], isA), _mm256_and_si256(x[1], isC)),
+		                      _mm256_or_si256(_mm256_and_si256(x[2], isG), _mm256_and_si256(x[3], isT)));
+		for (j = 0; j < 2; j++) {
+			__m256i sum = zero, r32, m32;
+			for (b = 0; b < 4; b++) {
+				sum = _mm256_add_epi32(sum, _mm256_cvtepu16_epi32(j ? _mm256_extracti128_si256(x[b], 1) : _mm256_castsi256_si128(x[b])));
+			}
+			r32 = _mm256_cvtepu16_epi32(j ? _mm256_extracti128_si256(ref, 1) : _mm256_castsi256_si128(ref));
+			m32 = _mm256_cvtepi16_epi32(j ? _mm256_extracti128_si256(acgt, 1) : _mm256_castsi256_si128(acgt));
+			_mm256_storeu_si256((__m256i *)(stats->cov + k + 8 * j), sum);
+			_mm256_storeu_si256((__m256i *)(stats->ref + k + 8 * j), r32);
+			_mm256_storeu_si256((__m256i *)(stats->alt_sum + k + 8 * j), _mm256_and_si256(_mm256_sub_epi32(sum, r32), m32));
+			cov[0] = _mm256_castsi256_si128(sum);
+			cov[1] = _mm256_extracti128_si256(sum, 1);
+			if (fractions) {
+				for (b = 0; b < 4; b++) {
+					rev[b] = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)((b == 0 ? c->Asb : b == 1 ? c->Csb : b == 2 ? c->Gsb : c->Tsb) + k + 8 * j)));
+					h = (j ? _mm256_extracti128_si256(x[b], 1) : _mm256_castsi256_si128(x[b]));
+					half[0] = _mm256_castsi256_si128(_mm256_cvtepu16_epi32(h));
+					half[1] = _mm256_extracti128_si256(_mm256_cvtepu16_epi32(h), 1);
+					setPosFractions(half[0], _mm256_castsi256_si128(rev[b]), cov[0], stats->frac[b] + k + 8 * j, stats->strand[b] + k + 8 * j);
+					setPosFractions(half[1], _mm256_extracti128_si256(rev[b], 1), cov[1], stats->frac[b] + k + 8 * j + 4, stats->strand[b] + k + 8 * j + 4);
+				}
+			}
+		}
+
+		// most frequent other base: the reference count is left out of the comparison
+		x[0] = _mm256_andnot_si256(isA, x[0]);
+		x[1] = _mm256_andnot_si256(isC, x[1]);
+		x[2] = _mm256_andnot_si256(isG, x[2]);
+		x[3] = _mm256_andnot_si256(isT, x[3]);
+		max = _mm256_max_epu16(_mm256_max_epu16(x[0], x[1]), _mm256_max_epu16(x[2], x[3]));
+		eq[0] = _mm256_andnot_si256(isA, _mm256_cmpeq_epi16(x[0], max));
+		eq[1] = _mm256_andnot_si256(isC, _mm256_cmpeq_epi16(x[1], max));
+		eq[2] = _mm256_andnot_si256(isG, _mm256_cmpeq_epi16(x[2], max));
+		eq[3] = _mm256_andnot_si256(isT, _mm256_cmpeq_epi16(x[3], max));
+		// ties (or no reference base) give N
+		ties = _mm256_sub_epi16(zero, _mm256_add_epi16(_mm256_add_epi16(eq[0], eq[1]), _mm256_add_epi16(eq[2], eq[3])));
+		ties = _mm256_or_si256(_mm256_cmpgt_epi16(ties, one), _mm256_cmpeq_epi16(acgt, zero));
+		base = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(eq[0], _mm256_set1_epi16('A')), _mm256_and_si256(eq[1], _mm256_set1_epi16('C'))),
+		                       _mm256_or_si256(_mm256_and_si256(eq[2], _mm256_set1_epi16('G')), _mm256_and_si256(eq[3], _mm256_set1_epi16('T'))));
+		base = _mm256_or_si256(_mm256_andnot_si256(ties, base), _mm256_and_si256(ties, _mm256_set1_epi16('N')));
+		max = _mm256_andnot_si256(ties, max);
+		_mm256_storeu_si256((__m256i *)(stats->alt + k), _mm256_cvtepu16_epi32(_mm256_castsi256_si128(max)));
+		_mm256_storeu_si256((__m256i *)(stats->alt + k + 8), _mm256_cvtepu16_epi32(_mm256_extracti128_si256(max, 1)));
+		_mm_storeu_si128((__m128i *)(stats->alt_base + k), _mm_packus_epi16(_mm256_castsi256_si128(base), _mm256_extracti128_si256(base, 1)));
 	}
-	return (0);
+	return (k);
 }
 
-// Returns read count of alternative allele
-int FindAlternative(struct region_data *elem, char *s, int index, char *alt)
+#elif defined(__SSE2__)
+
+// Mode 6 fractions of 2 positions (the low ones of the vectors) from their 32-bit count,
+// reverse strand count and coverage
+static inline void setPosFractions(__m128i count, __m128i rev, __m128i cov, double *frac, double *strand)
 {
-	int max = 0;
+	const __m128d zero = _mm_setzero_pd();
+	__m128d x = _mm_cvtepi32_pd(count);
+	__m128d n = _mm_cvtepi32_pd(cov);
 
-	// Reference is specified
-	if (strncmp(s, "A", 1) == 0) {
-		sprintf(alt, "C");
-		max = elem->positions[index].C;
-		if (max < elem->positions[index].G) {
-			max = elem->positions[index].G;
-			sprintf(alt, "G");
-		}
-		if (max < elem->positions[index].T) {
-			max = elem->positions[index].T;
-			sprintf(alt, "T");
-		}
-		if ((max == elem->positions[index].C) + (max == elem->positions[index].G) + (max == elem->positions[index].T) > 1) {
-			sprintf(alt, "N");
-			return (0);
-		}
-		return (max);
-	}
+	_mm_storeu_pd(frac, _mm_and_pd(_mm_div_pd(x, n), _mm_cmpneq_pd(n, zero)));
+	_mm_storeu_pd(strand, _mm_and_pd(_mm_div_pd(_mm_cvtepi32_pd(_mm_sub_epi32(count, rev)), x), _mm_cmpneq_pd(x, zero)));
+}
 
-	if (strncmp(s, "C", 1) == 0) {
-		sprintf(alt, "A");
-		max = elem->positions[index].A;
-		if (max < elem->positions[index].G) {
-			max = elem->positions[index].G;
-			sprintf(alt, "G");
-		}
-		if (max < elem->positions[index].T) {
-			max = elem->positions[index].T;
-			sprintf(alt, "T");
-		}
-		if ((max == elem->positions[index].A) + (max == elem->positions[index].G) + (max == elem->positions[index].T) > 1) {
-			sprintf(alt, "N");
-			return (0);
+// Statistics of the positions of a block 8 at a time. Returns the positions computed.
+static int setPosStatsVector(const struct pos_counts *c, const char *sequence, int n, int fractions, struct pos_stats *stats)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi16(1);
+	const __m128i bias = _mm_set1_epi16((short)0x8000);
+	__m128i seq, isA, isC, isG, isT, acgt, x[4], ref, max, eq[4], ties, base, sum, r32, m32, c32, v32;
+	int k, b, j;
+
+	for (k = 0; k + 8 <= n; k += 8) {
+		seq = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(sequence + k)), zero);
+		isA = _mm_cmpeq_epi16(seq, _mm_set1_epi16('A'));
+		isC = _mm_cmpeq_epi16(seq, _mm_set1_epi16('C'));
+		isG = _mm_cmpeq_epi16(seq, _mm_set1_epi16('G'));
+		isT = _mm_cmpeq_epi16(seq, _mm_set1_epi16('T'));
+		acgt = _mm_or_si128(_mm_or_si128(isA, isC), _mm_or_si128(isG, isT));
+		x[0] = _mm_loadu_si128((const __m128i *)(c->A + k));
+		x[1] = _mm_loadu_si128((const __m128i *)(c->C + k));
+		x[2] = _mm_loadu_si128((const __m128i *)(c->G + k));
+		x[3] = _mm_loadu_si128((const __m128i *)(c->T + k));
+
+		// coverage and reference count, 4 positions per 32-bit half
+		ref = _mm_or_si128(_mm_or_si128(_mm_and_si128(x[0], isA), _mm_and_si128(x[1], isC)),
+		                   _mm_or_si128(_mm_and_si128(x[2], isG), _mm_and_si128(x[3], isT)));
+		for (j = 0; j < 2; j++) {
+			sum = zero;
+			for (b = 0; b < 4; b++) {
+				sum = _mm_add_epi32(sum, j ? _mm_unpackhi_epi16(x[b], zero) : _mm_unpacklo_epi16(x[b], zero));
+			}
+			r32 = (j ? _mm_unpackhi_epi16(ref, zero) : _mm_unpacklo_epi16(ref, zero));
+			m32 = (j ? _mm_unpackhi_epi16(acgt, acgt) : _mm_unpacklo_epi16(acgt, acgt));
+			_mm_storeu_si128((__m128i *)(stats->cov + k + 4 * j), sum);
+			_mm_storeu_si128((__m128i *)(stats->ref + k + 4 * j), r32);
+			_mm_storeu_si128((__m128i *)(stats->alt_sum + k + 4 * j), _mm_and_si128(_mm_sub_epi32(sum, r32), m32));
+			if (fractions) {
+				for (b = 0; b < 4; b++) {
+					c32 = (j ? _mm_unpackhi_epi16(x[b], zero) : _mm_unpacklo_epi16(x[b], zero));
+					v32 = _mm_loadl_epi64((const __m128i *)((b == 0 ? c->Asb : b == 1 ? c->Csb : b == 2 ? c->Gsb : c->Tsb) + k + 4 * j));
+					v32 = _mm_unpacklo_epi16(v32, zero);
+					setPosFractions(c32, v32, sum, stats->frac[b] + k + 4 * j, stats->strand[b] + k + 4 * j);
+					setPosFractions(_mm_srli_si128(c32, 8), _mm_srli_si128(v32, 8), _mm_srli_si128(sum, 8),
+					                stats->frac[b] + k + 4 * j + 2, stats->strand[b] + k + 4 * j + 2);
+				}
+			}
 		}
-		return (max);
-	}
 
-	if (strncmp(s, "G", 1) == 0) {
-		sprintf(alt, "C");
-		max = elem->positions[index].C;
-		if (max < elem->positions[index].A) {
-			max = elem->positions[index].A;
-			sprintf(alt, "A");
-		}
-		if (max < elem->positions[index].T) {
-			max = elem->positions[index].T;
-			sprintf(alt, "T");
-		}
-		if ((max == elem->positions[index].C) + (max == elem->positions[index].A) + (max == elem->positions[index].T) > 1) {
-			sprintf(alt, "N");
-			return (0);
-		}
-		return (max);
+		// most frequent other base: the reference count is left out of the comparison
+		// (unsigned 16-bit max through the signed one, with the sign bit flipped)
+		x[0] = _mm_andnot_si128(isA, x[0]);
+		x[1] = _mm_andnot_si128(isC, x[1]);
+		x[2] = _mm_andnot_si128(isG, x[2]);
+		x[3] = _mm_andnot_si128(isT, x[3]);
+		max = _mm_max_epi16(_mm_max_epi16(_mm_xor_si128(x[0], bias), _mm_xor_si128(x[1], bias)),
+		                    _mm_max_epi16(_mm_xor_si128(x[2], bias), _mm_xor_si128(x[3], bias)));
+		max = _mm_xor_si128(max, bias);
+		eq[0] = _mm_andnot_si128(isA, _mm_cmpeq_epi16(x[0], max));
+		eq[1] = _mm_andnot_si128(isC, _mm_cmpeq_epi16(x[1], max));
+		eq[2] = _mm_andnot_si128(isG, _mm_cmpeq_epi16(x[2], max));
+		eq[3] = _mm_andnot_si128(isT, _mm_cmpeq_epi16(x[3], max));
+		// ties (or no reference base) give N
+		ties = _mm_sub_epi16(zero, _mm_add_epi16(_mm_add_epi16(eq[0], eq[1]), _mm_add_epi16(eq[2], eq[3])));
+		ties = _mm_or_si128(_mm_cmpgt_epi16(ties, one), _mm_cmpeq_epi16(acgt, zero));
+		base = _mm_or_si128(_mm_or_si128(_mm_and_si128(eq[0], _mm_set1_epi16('A')), _mm_and_si128(eq[1], _mm_set1_epi16('C'))),
+		                    _mm_or_si128(_mm_and_si128(eq[2], _mm_set1_epi16('G')), _mm_and_si128(eq[3], _mm_set1_epi16('T'))));
+		base = _mm_or_si128(_mm_andnot_si128(ties, base), _mm_and_si128(ties, _mm_set1_epi16('N')));
+		max = _mm_andnot_si128(ties, max);
+		_mm_storeu_si128((__m128i *)(stats->alt + k), _mm_unpacklo_epi16(max, zero));
+		_mm_storeu_si128((__m128i *)(stats->alt + k + 4), _mm_unpackhi_epi16(max, zero));
+		_mm_storel_epi64((__m128i *)(stats->alt_base + k), _mm_packus_epi16(base, zero));
 	}
+	return (k);
+}
 
-	if (strncmp(s, "T", 1) == 0) {
-		sprintf(alt, "C");
-		max = elem->positions[index].C;
-		if (max < elem->positions[index].G) {
-			max = elem->positions[index].G;
-			sprintf(alt, "G");
-		}
-		if (max < elem->positions[index].A) {
-			max = elem->positions[index].A;
-			sprintf(alt, "A");
-		}
-		if ((max == elem->positions[index].C) + (max == elem->positions[index].G) + (max == elem->positions[index].A) > 1) {
-			sprintf(alt, "N");
-			return (0);
-		}
-		return (max);
-	}
+#else
 
+static int setPosStatsVector(const struct pos_counts *c, const char *sequence, int n, int fractions, struct pos_stats *stats)
+{
 	return (0);
 }
 
+#endif
+
+// Computes the statistics of the n (at most POS_STATS_BLOCK) positions of a computed
+// region from index from on, decoding their reference bases in stats->bases. The mode 6
+// fractions are computed only if fractions is set.
+void computePosStats(const struct region_data *rdata, const ref_packed_t *reference, int from, int n, int fractions, struct pos_stats *stats)
+{
+	const struct pos_counts *c = &(rdata->positions);
+	struct pos_counts block;
+	struct pos_pileup counts;
+	int k, vector;
+
+	ref_unpack(reference, from, n, stats->bases);
+	slicePosCounts(&block, c, from);
+	vector = setPosStatsVector(&block, stats->bases, n, fractions, stats);
+	for (k = vector; k < n; k++) {
+		getPosCounts(rdata, from + k, &counts);
+		setPosStats(stats, k, &counts, stats->bases[k], fractions);
+	}
+	// positions with their counts in the overflow table
+	for (k = 0; k < vector; k++) {
+		if (block.del[k] == POS_COUNT_OVERFLOW) {
+			getPosCounts(rdata, from + k, &counts);
+			setPosStats(stats, k, &counts, stats->bases[k], fractions);
+		}
+	}
+}
+
 
 ///////////////////////////////////////////////////////////
 // Samtools pileup function definition
@@ -886,95 +1530,274 @@ int32_t interpret_cigar(int32_t pos, uint32_t *cigar, int n_cigar)
 	return (pos);
 }
 
-void getKey(dedup_struct_t* value, char *key)
+// 64-bit FNV-1a hash of a read name
+static inline uint64_t hashReadName(const char *name)
 {
-	int32_t p1, p2, c1, c2;
-	if (value->paired == 1) {
+	uint64_t h = 14695981039346656037ULL;
+	for (; *name; name++) {
+		h = (h ^ (unsigned char)*name) * 1099511628211ULL;
+	}
+	return h;
+}
 
-		if (value->chr1 == value->chr2) {
-			c1 = c2 = value->chr1;
-			if (value->pos_r1 <= value->pos_r2) {
-				p1 = value->pos_r1;
-				p2 = value->pos_r2;
-			} else {
-				p1 = value->pos_r2;
-				p2 = value->pos_r1;
-			}
-		} else {
-			if (value->chr1 < value->chr2) {
-				p1 = value->pos_r1;
-				c1 = value->chr1;
-				p2 = value->pos_r2;
-				c2 = value->chr2;
-			} else {
-				p1 = value->pos_r2;
-				c1 = value->chr2;
-				p2 = value->pos_r1;
-				c2 = value->chr1;
-			}
-		}
+// Slot of a 64-bit key in a table of capacity slots
+static inline int getDedupSlot(uint64_t key, int capacity)
+{
+	key ^= key >> 33;
+	key *= 0xFF51AFD7ED558CCDULL;
+	key ^= key >> 33;
+	return (int)(key & (uint64_t)(capacity - 1));
+}
 
-		snprintf(key, KEY_MAX_LENGTH, "%d-%d:%d-%d", c1, c2, p1, p2);
-	} else {
-		if (value->pos_r1 < 0) {
-			p1 = value->pos_r2;
-			c1 = value->chr2;
-		} else {
-			p1 = value->pos_r1;
-			c1 = value->chr1;
-		}
+void initDedupTable(struct dedup_table *table)
+{
+	table->length = 0;
+	table->size = 1024;
+	table->reads = (struct dedup_read *)malloc(table->size * sizeof(struct dedup_read));
+	table->capacity = 2048;
+	table->names = (int32_t *)calloc(table->capacity, sizeof(int32_t));
+	table->signatures = (struct dedup_signature *)malloc(table->capacity * sizeof(struct dedup_signature));
+}
 
-		snprintf(key, KEY_MAX_LENGTH, "%d:%d", c1, p1);
-	}
+void destroyDedupTable(struct dedup_table *table)
+{
+	free(table->reads);
+	free(table->names);
+	free(table->signatures);
 }
 
+void clearDedupTable(struct dedup_table *table)
+{
+	table->length = 0;
+	memset(table->names, 0, table->capacity * sizeof(int32_t));
+}
 
-// callback for bam_fetch()
-static int fetch_func_dup(const bam1_t *b, void *data)
+// Place again the reads of the table in the name slots, from their name hashes
+static void indexDedupReads(struct dedup_table *table)
 {
-	map_t *hmap = (map_t *)data;
-	uint32_t *cigar;
-	char *name;
-	int32_t pos;
-	int res, strand, op, ol, error;
-	dedup_struct_t* value;
+	int i, slot;
 
-	name = bam1_qname(b);
-	cigar = bam1_cigar(b);
-	strand = bam1_strand(b);
+	memset(table->names, 0, table->capacity * sizeof(int32_t));
+	for (i = 0; i < table->length; i++) {
+		slot = getDedupSlot(table->reads[i].name, table->capacity);
+		while (table->names[slot] != 0) {
+			slot = (slot + 1) & (table->capacity - 1);
+		}
+		table->names[slot] = i + 1;
+	}
+}
 
-	res = hashmap_get(hmap, name, (void**)(&value));
-	if (res == MAP_MISSING) {
-		value = malloc(sizeof(dedup_struct_t));
-		snprintf(value->key_string, KEY_MAX_LENGTH, "%s", name);
-		value->pos_r1 = value->pos_r2 = -1;
-		value->chr1 = value->chr2 = -1;
-		value->paired = 0;
-		value->isize = abs(b->core.isize);
-		if (b->core.flag & BAM_FPAIRED) {
-			value->paired = 1;
+// Find the read with the given name and name hash, NULL if missing
+struct dedup_read *findDedupRead(struct dedup_table *table, uint64_t name, const char *qname)
+{
+	struct dedup_read *read;
+	int slot = getDedupSlot(name, table->capacity);
+	while (table->names[slot] != 0) {
+		read = &(table->reads[table->names[slot] - 1]);
+		if (read->name == name && strcmp(read->qname, qname) == 0) {
+			return read;
 		}
-		if (b->core.flag & BAM_FMUNMAP) {
-			value->paired = 0;
+		slot = (slot + 1) & (table->capacity - 1);
+	}
+	return NULL;
+}
+
+// Find the read with the given name and name hash, adding it if missing (*added set to 1).
+// qname must stay valid as long as the table is used.
+struct dedup_read *getDedupRead(struct dedup_table *table, uint64_t name, const char *qname, int *added)
+{
+	int slot;
+	struct dedup_read *read;
+
+	*added = 0;
+	if ((read = findDedupRead(table, name, qname)) != NULL) {
+		return read;
+	}
+	if (table->length == table->size) {
+		table->size *= 2;
+		table->reads = (struct dedup_read *)realloc(table->reads, table->size * sizeof(struct dedup_read));
+	}
+	// keep the load factor of the tables at most 1/2
+	if (2 * (table->length + 1) > table->capacity) {
+		table->capacity *= 2;
+		table->names = (int32_t *)realloc(table->names, table->capacity * sizeof(int32_t));
+		table->signatures = (struct dedup_signature *)realloc(table->signatures, table->capacity * sizeof(struct dedup_signature));
+		indexDedupReads(table);
+	}
+	slot = getDedupSlot(name, table->capacity);
+	while (table->names[slot] != 0) {
+		slot = (slot + 1) & (table->capacity - 1);
+	}
+	table->names[slot] = table->length + 1;
+	read = &(table->reads[table->length++]);
+	read->name = name;
+	read->qname = qname;
+	read->evicted = 0;
+	*added = 1;
+	return read;
+}
+
+// Fragment coordinates of a read: chromosomes and outer positions of the two ends
+// for pairs, sorted, or of the only end seen otherwise
+void getReadSignature(struct dedup_read *read, struct dedup_signature *signature)
+{
+	int32_t p1, p2, c1, c2;
+	if (read->paired == 1) {
+		if (read->chr1 == read->chr2) {
+			c1 = c2 = read->chr1;
+			if (read->pos_r1 <= read->pos_r2) {
+				p1 = read->pos_r1;
+				p2 = read->pos_r2;
+			} else {
+				p1 = read->pos_r2;
+				p2 = read->pos_r1;
+			}
+		} else {
+			if (read->chr1 < read->chr2) {
+				p1 = read->pos_r1;
+				c1 = read->chr1;
+				p2 = read->pos_r2;
+				c2 = read->chr2;
+			} else {
+				p1 = read->pos_r2;
+				c1 = read->chr2;
+				p2 = read->pos_r1;
+				c2 = read->chr1;
+			}
 		}
+		signature->second = ((uint64_t)(uint32_t)c2 << 32) | (uint32_t)p2;
+	} else {
+		if (read->pos_r1 < 0) {
+			p1 = read->pos_r2;
+			c1 = read->chr2;
+		} else {
+			p1 = read->pos_r1;
+			c1 = read->chr1;
+		}
+		signature->second = 0;
+	}
+	signature->first = ((uint64_t)(uint32_t)c1 << 32) | (uint32_t)p1;
+	signature->paired = read->paired;
+}
+
+// Keep, for each signature, the read covering more bases, on ties the one whose first read
+// was fetched first
+void markDuplicates(struct dedup_table *table)
+{
+	int i, slot;
+	struct dedup_signature signature, *entry;
+
+	for (slot = 0; slot < table->capacity; slot++) {
+		table->signatures[slot].read = -1;
+	}
+	for (i = 0; i < table->length; i++) {
+		getReadSignature(&(table->reads[i]), &signature);
+		slot = getDedupSlot(signature.first * 31 + signature.second + signature.paired, table->capacity);
+		for (entry = &(table->signatures[slot]); entry->read >= 0; entry = &(table->signatures[slot])) {
+			if (entry->first == signature.first && entry->second == signature.second && entry->paired == signature.paired) {
+				break;
+			}
+			slot = (slot + 1) & (table->capacity - 1);
+		}
+		if (entry->read < 0) {
+			signature.read = i;
+			*entry = signature;
+			table->reads[i].kept = 1;
+		} else if (table->reads[i].bp > table->reads[entry->read].bp) {
+			table->reads[entry->read].kept = 0;
+			entry->read = i;
+			table->reads[i].kept = 1;
+		} else {
+			table->reads[i].kept = 0;
+		}
+	}
+}
+
+// Same test as bam_fetch() for reads overlapping the 0-based interval [beg,end)
+static inline int isRecordOverlapping(const struct dedup_record *record, int beg, int end)
+{
+	return ((uint32_t)record->end > (uint32_t)beg && (uint32_t)record->beg < (uint32_t)end);
+}
+
+// Copy a read at the end of the arena, returning its offset
+static size_t keepRead(struct read_arena *reads, const bam1_t *b)
+{
+	size_t offset = reads->length;
+	size_t length = (sizeof(bam1_t) + b->data_len + 7) & ~(size_t)7;
+
+	if (reads->length + length > reads->size) {
+		reads->size = (reads->size + length) * 2;
+		reads->data = (uint8_t *)realloc(reads->data, reads->size);
+	}
+	memcpy(reads->data + offset, b, sizeof(bam1_t));
+	memcpy(reads->data + offset + sizeof(bam1_t), b->data, b->data_len);
+	reads->length += length;
+	return offset;
+}
+
+// Name of the read at offset in the arena, the first field of its data
+static inline const char *getArenaReadName(const struct read_arena *reads, size_t offset)
+{
+	return ((const char *)(reads->data + offset + sizeof(bam1_t)));
+}
+
+void initDedupWindow(struct dedup_window *window)
+{
+	window->length = 0;
+	window->size = 1024;
+	window->records = (struct dedup_record *)malloc(window->size * sizeof(struct dedup_record));
+	window->fresh = 0;
+	window->reads.data = NULL;
+	window->reads.length = 0;
+	window->reads.size = 0;
+	initDedupTable(&(window->table));
+	window->moved = NULL;
+	window->moved_size = 0;
+	window->tid = -1;
+}
+
+void destroyDedupWindow(struct dedup_window *window)
+{
+	free(window->records);
+	free(window->reads.data);
+	destroyDedupTable(&(window->table));
+	free(window->moved);
+}
+
+// callback for bam_fetch()
+static int fetch_func_dup(const bam1_t *b, void *data)
+{
+	struct dedup_window *window = (struct dedup_window *)data;
+	struct dedup_record *record;
+	uint32_t *cigar;
+	int32_t pos;
+	int op, ol;
+
+	// already in the window
+	if (b->core.pos < window->min_beg) {
+		return 0;
+	}
+	if (window->length == window->size) {
+		window->size *= 2;
+		window->records = (struct dedup_record *)realloc(window->records, window->size * sizeof(struct dedup_record));
 	}
+	record = &(window->records[window->length++]);
 
-	if (strand == 0) {
+	cigar = bam1_cigar(b);
+	record->name = hashReadName(bam1_qname(b));
+	record->beg = b->core.pos;
+	record->end = b->core.n_cigar ? bam_calend(&b->core, cigar) : b->core.pos + 1;
+	record->tid = b->core.tid;
+	record->flag = b->core.flag;
+	record->strand = bam1_strand(b);
+	if (record->strand == 0) {
 		pos = b->core.pos;
 		op = bam_cigar_op(cigar[0]);
 		ol = bam_cigar_oplen(cigar[0]);
 		if (op == BAM_CSOFT_CLIP) {
 			pos = pos - ol;
 		}
-		if (value->pos_r1 < 0) {
-			value->pos_r1 = pos;
-			value->chr1 = b->core.tid;
-		} else {
-			value->pos_r2 = pos;
-			value->chr2 = b->core.tid;
-		}
-		value->bp = interpret_cigar(pos, cigar, b->core.n_cigar) - pos;
-		//fprintf(stderr,"%d %d %d\n",interpret_cigar(pos,cigar,b->core.n_cigar),pos,value->bp);
+		record->bp = interpret_cigar(pos, cigar, b->core.n_cigar) - pos;
 	} else {
 		pos = interpret_cigar(b->core.pos, cigar, b->core.n_cigar);
 		op = bam_cigar_op(cigar[b->core.n_cigar - 1]);
@@ -982,245 +1805,920 @@ static int fetch_func_dup(const bam1_t *b, void *data)
 		if (op == BAM_CSOFT_CLIP) {
 			pos = pos + ol;
 		}
-		if (value->pos_r2 < 0) {
-			value->pos_r2 = pos;
-			value->chr2 = b->core.tid;
-		} else {
-			value->pos_r1 = pos;
-			value->chr1 = b->core.tid;
-		}
-		value->bp += (pos - b->core.pos);
-		//fprintf(stderr,"%d %d %d\n",interpret_cigar(pos,cigar,b->core.n_cigar),pos,value->bp);
-	}
-
-	if (res == MAP_MISSING) {
-		error = hashmap_put(hmap, value->key_string, value);
-		assert(error == MAP_OK);
+		record->bp = pos - b->core.pos;
 	}
+	record->pos = pos;
+	record->offset = keepRead(&(window->reads), b);
 
 	return 0;
 }
 
-// callback for bam_fetch()
-static int fetch_func_dedup(const bam1_t *b, void *data)
+// Drop the reads of the window not overlapping [beg,end), compacting the arena, and
+// flag their entries in the table
+static void slideDedupWindow(struct dedup_window *window, int beg, int end)
 {
-	fetch_reads_t *buf_data = (fetch_reads_t *)data;
-	dedup_struct_t* value;
-	char *name = bam1_qname(b);
-	int res;
-	res = hashmap_get(buf_data->hmap, name, (void**)(&value));
-
-	if (res == MAP_OK) {
-		//fprintf(stderr,"USED: %s\n",value->key_string);
-		bam_plbuf_push(b, buf_data->buf);
+	int i, length = 0;
+	size_t offset = 0, size;
+	struct dedup_record *record;
+
+	for (i = 0; i < window->length; i++) {
+		record = &(window->records[i]);
+		if (!isRecordOverlapping(record, beg, end)) {
+			window->table.reads[record->read].evicted = 1;
+			continue;
+		}
+		size = (sizeof(bam1_t) + ((bam1_t *)(window->reads.data + record->offset))->data_len + 7) & ~(size_t)7;
+		if (offset != record->offset) {
+			memmove(window->reads.data + offset, window->reads.data + record->offset, size);
+		}
+		record->offset = offset;
+		offset += size;
+		window->records[length++] = *record;
 	}
-	return 0;
+	window->length = length;
+	window->reads.length = offset;
 }
 
-// callback for bam_fetch()
-static int fetch_func(const bam1_t *b, void *data)
+// Fetch the reads of reference tid overlapping [beg,end), reusing the reads of the
+// previous window when the two overlap
+void fetchDedupWindow(struct dedup_window *window, bamr_t *in, bai_t *idx, int tid, int beg, int end)
 {
-	bam_plbuf_t *buf = (bam_plbuf_t * *)data;
-	bam_plbuf_push(b, buf);
-	return 0;
+	if (beg < 0) {
+		beg = 0;
+	}
+	if (window->tid == tid && beg >= window->beg && beg < window->end && end >= window->end) {
+		slideDedupWindow(window, beg, end);
+		window->min_beg = window->end;
+	} else {
+		window->length = 0;
+		window->reads.length = 0;
+		clearDedupTable(&(window->table));
+		window->min_beg = 0;
+		window->tid = tid;
+	}
+	window->fresh = window->length;
+	if (window->min_beg < end) {
+		bamr_fetch(in, idx, tid, window->min_beg > beg ? window->min_beg : beg, end, window, fetch_func_dup);
+	}
+	window->beg = beg;
+	window->end = end;
 }
 
-
-// callback for bam_plbuf_init()
-static int pileup_func(uint32_t tid, uint32_t pos, int n, const bam_pileup1_t *pl, void *data)
+// Add a record of the window to the entry of its name, initializing the entry if it was
+// just added
+static void addDedupRecord(struct dedup_read *value, const struct dedup_record *record, int added)
 {
-	int i;
-	struct region_data *tmp = (struct region_data*)data;
-	unsigned char *qual;
-	int read_init;
-	uint32_t *cigar, lcigar;
-	uint8_t *md;
-	int thr_cov_A, thr_cov_C, thr_cov_G, thr_cov_T, op, ol, pos_c;
-	Dlist *dup[4];
-	int *dup_counts[4];
-	/*if (tmp->arguments->duptablename != NULL)
-	{
-		dup[0] = dup[1] = dup[2] = dup[3] = NULL;
-		dup_counts[0] = (int *)malloc(sizeof(int)*MAX_DUP);
-		dup_counts[1] = (int *)malloc(sizeof(int)*MAX_DUP);
-		dup_counts[2] = (int *)malloc(sizeof(int)*MAX_DUP);
-		dup_counts[3] = (int *)malloc(sizeof(int)*MAX_DUP);
-		for(i=0;i<MAX_DUP;i++)
-		{
-			dup_counts[0][i] = dup_counts[1][i] = dup_counts[2][i] = dup_counts[3][i] = 0;
-		}
-	}*/
+	if (added) {
+		value->pos_r1 = value->pos_r2 = -1;
+		value->chr1 = value->chr2 = -1;
+		value->paired = 0;
+		value->bp = 0;
+		if (record->flag & BAM_FPAIRED) {
+			value->paired = 1;
+		}
+		if (record->flag & BAM_FMUNMAP) {
+			value->paired = 0;
+		}
+	}
+	if (record->strand == 0) {
+		if (value->pos_r1 < 0) {
+			value->pos_r1 = record->pos;
+			value->chr1 = record->tid;
+		} else {
+			value->pos_r2 = record->pos;
+			value->chr2 = record->tid;
+		}
+		value->bp = record->bp;
+	} else {
+		if (value->pos_r2 < 0) {
+			value->pos_r2 = record->pos;
+			value->chr2 = record->tid;
+		} else {
+			value->pos_r1 = record->pos;
+			value->chr1 = record->tid;
+		}
+		value->bp += record->bp;
+	}
+}
 
-	if ((int)pos >= tmp->beg && (int)pos < tmp->end) {
-		for (i = 0; i < n; i++) {
-			qual = bam1_qual(pl[i].b);
-			if (!(
-			            qual[pl[i].qpos] < tmp->arguments->mbq ||
-			            pl[i].b->core.qual < tmp->arguments->mrq ||
-			            pl[i].is_del != 0 ||
-			            //pl[i].indel != 0)
-			            pl[i].is_refskip != 0 ||
-			            (pl[i].b->core.flag & BAM_DEF_MASK))) {
-				incBase(&(tmp->positions[pos - tmp->beg]), bam1_seqi(bam1_seq(pl[i].b), pl[i].qpos));
-				if (tmp->arguments->strand_bias == 1) {
-					incBaseStrand(&(tmp->positions[pos - tmp->beg]), bam1_seqi(bam1_seq(pl[i].b), pl[i].qpos), bam1_strand(pl[i].b));
-				}
-				/*if (tmp->arguments->duptablename != NULL)
-				{
-					cigar = bam1_cigar(pl[i].b);
-					op = bam_cigar_op(cigar[0]);
-					ol = bam_cigar_oplen(cigar[0]);
-					pos_c = pl[i].b->core.pos;
-					if(op==BAM_CSOFT_CLIP)
-						pos_c = pos_c-ol;
-					incBaseDup(&dup,&dup_counts,bam1_seqi(bam1_seq(pl[i].b),pl[i].qpos),pos_c+1,(pl[i].b->core.mpos)+1,pl[i].b->core.mtid,bam1_strand(pl[i].b));
-				}*/
-			} else if (pl[i].is_del) {
-				tmp->positions[pos - tmp->beg].del++;
+// Keep the entries of the reads still in the window after a slide, in the order of
+// their first record as if the window had been read from scratch. The entries that
+// lost records are built again from the remaining ones, and the names are pointed to
+// the arena, which may have moved.
+static void retainDedupReads(struct dedup_window *window)
+{
+	int i, length = 0;
+	struct dedup_table *table = &(window->table);
+	struct dedup_record *record;
+	struct dedup_read *read, *moved;
+
+	if (window->moved_size < table->size) {
+		window->moved_size = table->size;
+		window->moved = (struct dedup_read *)realloc(window->moved, window->moved_size * sizeof(struct dedup_read));
+	}
+	for (i = 0; i < table->length; i++) {
+		table->reads[i].moved = -1;
+	}
+	for (i = 0; i < window->fresh; i++) {
+		record = &(window->records[i]);
+		read = &(table->reads[record->read]);
+		if (read->moved < 0) {
+			read->moved = length++;
+			moved = &(window->moved[read->moved]);
+			*moved = *read;
+			moved->qname = getArenaReadName(&(window->reads), record->offset);
+			moved->evicted = 0;
+			if (read->evicted) {
+				addDedupRecord(moved, record, 1);
 			}
+		} else if (read->evicted) {
+			addDedupRecord(&(window->moved[read->moved]), record, 0);
 		}
-
-
-		/*if (tmp->arguments->duptablename != NULL)
-		{
-			// find duplicates threshdold for all bases coverage
-			thr_cov_A = getThrDupLookup(tmp->duptable,tmp->positions[pos-tmp->beg].A);
-			thr_cov_C = getThrDupLookup(tmp->duptable,tmp->positions[pos-tmp->beg].C);
-			thr_cov_G = getThrDupLookup(tmp->duptable,tmp->positions[pos-tmp->beg].G);
-			thr_cov_T = getThrDupLookup(tmp->duptable,tmp->positions[pos-tmp->beg].T);
-
-			// recompute base coverage after lifting
-			countAndFreeDlist(dup[0],dup_counts[0]);
-			countAndFreeDlist(dup[1],dup_counts[1]);
-			countAndFreeDlist(dup[2],dup_counts[2]);
-			countAndFreeDlist(dup[3],dup_counts[3]);
-
-			computeCovBaseDup(&dup_counts,&(tmp->positions[pos-tmp->beg]),thr_cov_A,thr_cov_C,thr_cov_G,thr_cov_T);
-			free(dup_counts[0]);free(dup_counts[1]);free(dup_counts[2]);free(dup_counts[3]);
-		}*/
-
+		record->read = read->moved;
 	}
-
-	return 0;
+	moved = table->reads;
+	table->reads = window->moved;
+	window->moved = moved;
+	i = table->size;
+	table->size = window->moved_size;
+	window->moved_size = i;
+	table->length = length;
+	indexDedupReads(table);
 }
 
+// Add the reads fetched with the window to the table by name, in fetch order, and mark
+// the duplicates. Only the names of the newly fetched reads are looked up.
+void markWindowDuplicates(struct dedup_window *window)
+{
+	int i, added;
+	struct dedup_record *record;
+	struct dedup_read *value;
+
+	retainDedupReads(window);
+	for (i = window->fresh; i < window->length; i++) {
+		record = &(window->records[i]);
+		value = getDedupRead(&(window->table), record->name, getArenaReadName(&(window->reads), record->offset), &added);
+		addDedupRecord(value, record, added);
+		record->read = (int32_t)(value - window->table.reads);
+	}
+	window->fresh = window->length;
+	markDuplicates(&(window->table));
+}
 
+// Push to the pileup the reads of the window overlapping [beg,end) not filtered as
+// duplicates, in fetch order
+void pushDedupReads(struct dedup_window *window, uint32_t beg, uint32_t end, bam_plbuf_t *buf)
+{
+	int i;
+	bam1_t b;
+	struct dedup_record *record;
+
+	for (i = 0; i < window->length; i++) {
+		record = &(window->records[i]);
+		if (window->table.reads[record->read].kept && isRecordOverlapping(record, beg, end)) {
+			memcpy(&b, window->reads.data + record->offset, sizeof(bam1_t));
+			b.data = window->reads.data + record->offset + sizeof(bam1_t);
+			bam_plbuf_push(&b, buf);
+		}
+	}
+}
 
+static inline uint64_t mixStreamKey(uint64_t key)
+{
+	key ^= key >> 30;
+	key *= 0xBF58476D1CE4E5B9ULL;
+	key ^= key >> 27;
+	key *= 0x94D049BB133111EBULL;
+	return (key ^ (key >> 31));
+}
 
+static void initStreamIndex(struct stream_index *index, int capacity)
+{
+	int i;
+	index->capacity = capacity;
+	index->length = 0;
+	index->slots = (struct stream_slot *)malloc(capacity * sizeof(struct stream_slot));
+	for (i = 0; i < capacity; i++) {
+		index->slots[i].entry = -1;
+	}
+}
 
-///////////////////////////////////////////////////////////
-// Regions RC processing
-///////////////////////////////////////////////////////////
-
-float computeGC(char *sequence, int init, int end)
+static void clearStreamIndex(struct stream_index *index)
 {
 	int i;
-	int count = 0;
-	for (i = init; i <= end; i++) {
-		if (sequence[i] == 'G' || sequence[i] == 'C') {
-			count++;
+	for (i = 0; i < index->capacity; i++) {
+		index->slots[i].entry = -1;
+	}
+	index->length = 0;
+}
+
+// Entry of a key, -1 if missing
+static int findStreamEntry(struct stream_index *index, uint64_t key)
+{
+	int slot = getDedupSlot(key, index->capacity);
+	while (index->slots[slot].entry >= 0) {
+		if (index->slots[slot].key == key) {
+			return (index->slots[slot].entry);
 		}
+		slot = (slot + 1) & (index->capacity - 1);
 	}
-	return (((float)count) / ((float)(end - init + 1)));
+	return (-1);
 }
 
-void computeRC(float perc, struct target_t *region)
+static void addStreamEntry(struct stream_index *index, uint64_t key, int32_t entry)
 {
-	int positions = (int)(floor((float)(region->to - region->from) * perc));
-	int init = 0;
-	int end = positions - 1;
-	float max = 0;
-	int i, sum, sumt;
+	int i, slot;
+	struct stream_slot *old = index->slots;
+	int old_capacity = index->capacity;
+
+	// keep the load factor at most 1/2
+	if (2 * (index->length + 1) > index->capacity) {
+		initStreamIndex(index, 2 * old_capacity);
+		for (i = 0; i < old_capacity; i++)
+			if (old[i].entry >= 0) {
+				addStreamEntry(index, old[i].key, old[i].entry);
+			}
+		free(old);
+	}
+	slot = getDedupSlot(key, index->capacity);
+	while (index->slots[slot].entry >= 0) {
+		slot = (slot + 1) & (index->capacity - 1);
+	}
+	index->slots[slot].key = key;
+	index->slots[slot].entry = entry;
+	index->length++;
+}
 
+// Remove the entry of a key, moving back the following keys of the cluster instead of
+// leaving a tombstone
+static void removeStreamEntry(struct stream_index *index, uint64_t key, int32_t entry)
+{
+	int home, next, mask = index->capacity - 1;
+	int slot = getDedupSlot(key, index->capacity);
 
-	if (positions == 0) {
-		sum = region->rdata->positions[init].A +
-		      region->rdata->positions[init].C +
-		      region->rdata->positions[init].G +
-		      region->rdata->positions[init].T;
-		region->read_count = region->read_count_global = sum;
-		region->gc = computeGC(region->sequence, 0, 0);
-		region->from_sel = region->from;
-		region->to_sel = region->to;
+	while (index->slots[slot].entry >= 0 && (index->slots[slot].key != key || index->slots[slot].entry != entry)) {
+		slot = (slot + 1) & mask;
+	}
+	if (index->slots[slot].entry < 0) {
 		return;
 	}
-	region->from_sel = init + region->from;
-	region->to_sel = end + region->from;
-	sumt = 0;
-
-	while (end < (region->to - region->from) && end >= 0) {
-		sum = 0;
-		sumt += region->rdata->positions[init].A +
-		        region->rdata->positions[init].C +
-		        region->rdata->positions[init].G +
-		        region->rdata->positions[init].T;
-		for (i = init; i <= end; i++)
-			sum += region->rdata->positions[i].A +
-			       region->rdata->positions[i].C +
-			       region->rdata->positions[i].G +
-			       region->rdata->positions[i].T;
-		if ((float)sum > max) {
-			region->from_sel = init + region->from;
-			region->to_sel = end + region->from;
-			max = (float)sum;
-
+	for (next = (slot + 1) & mask; index->slots[next].entry >= 0; next = (next + 1) & mask) {
+		home = getDedupSlot(index->slots[next].key, index->capacity);
+		// the key can fill the hole if the hole is between its home slot and its slot
+		if (((next - home) & mask) >= ((next - slot) & mask)) {
+			index->slots[slot] = index->slots[next];
+			slot = next;
 		}
-		init++;
-		end++;
 	}
+	index->slots[slot].entry = -1;
+	index->length--;
+}
 
-	for (i = init; i <= (region->to - region->from); i++)
-		sumt += region->rdata->positions[i].A +
-		        region->rdata->positions[i].C +
-		        region->rdata->positions[i].G +
-		        region->rdata->positions[i].T;
+void initDedupStream(struct dedup_stream *stream)
+{
+	int i;
+	initStreamIndex(&(stream->template_index), 1024);
+	stream->templates_size = 512;
+	stream->templates = (struct stream_template *)calloc(stream->templates_size, sizeof(struct stream_template));
+	initStreamIndex(&(stream->group_index), 1024);
+	stream->groups_size = 512;
+	stream->groups = (struct stream_group *)malloc(stream->groups_size * sizeof(struct stream_group));
+	stream->ring_size = 1024;
+	stream->buckets = (int32_t *)malloc(stream->ring_size * sizeof(int32_t));
+	for (i = 0; i < stream->ring_size; i++) {
+		stream->buckets[i] = -1;
+	}
+	stream->waits_size = 1024;
+	stream->waits = (struct stream_wait *)malloc(stream->waits_size * sizeof(struct stream_wait));
+	stream->queue_size = 1024;
+	stream->queue = (struct stream_read *)malloc(stream->queue_size * sizeof(struct stream_read));
+	stream->reads.data = NULL;
+	stream->reads.length = 0;
+	stream->reads.size = 0;
+}
 
-	region->read_count = (float)max / (float)positions;
-	region->read_count_global = (float)sumt / ((float)(region->to - region->from));
+void destroyDedupStream(struct dedup_stream *stream)
+{
+	int i;
+	for (i = 0; i < stream->templates_size; i++) {
+		free(stream->templates[i].qname);
+	}
+	free(stream->template_index.slots);
+	free(stream->templates);
+	free(stream->group_index.slots);
+	free(stream->groups);
+	free(stream->buckets);
+	free(stream->waits);
+	free(stream->queue);
+	free(stream->reads.data);
 }
 
-void computeGCRegion(float perc, struct target_t *region)
+// Get ready to stream the reads of a window, piling up those overlapping the tile [beg,end)
+void startDedupStream(struct dedup_stream *stream, uint32_t beg, uint32_t end, bam_plbuf_t *buf)
 {
-	int positions = (int)(floor((float)(region->to - region->from)));
-	if (positions == 0) {
-		positions = 1;
+	int i;
+	clearStreamIndex(&(stream->template_index));
+	clearStreamIndex(&(stream->group_index));
+	// all the pool entries are free, chained in order
+	for (i = 0; i < stream->templates_size; i++) {
+		stream->templates[i].next = i + 1 < stream->templates_size ? i + 1 : -1;
 	}
-	if (region->sequence != NULL) {
-		region->gc = computeGC(region->sequence, 0, positions - 1);
+	stream->free_template = 0;
+	stream->first_template = stream->last_template = -1;
+	stream->templates_created = 0;
+	for (i = 0; i < stream->groups_size; i++) {
+		stream->groups[i].next = i + 1 < stream->groups_size ? i + 1 : -1;
 	}
+	stream->free_group = 0;
+	for (i = 0; i < stream->ring_size; i++) {
+		stream->buckets[i] = -1;
+	}
+	stream->span = 0;
+	stream->final_pos = INT32_MIN; // set by the first read
+	stream->waits_head = stream->waits_length = 0;
+	stream->queue_head = stream->queue_length = 0;
+	stream->reads.length = 0;
+	stream->beg = beg;
+	stream->end = end;
+	stream->buf = buf;
 }
 
+// Template of a name, with hash name, -1 if missing
+static int findStreamTemplate(struct dedup_stream *stream, uint64_t name, const char *qname)
+{
+	struct stream_index *index = &(stream->template_index);
+	int slot = getDedupSlot(name, index->capacity);
+	while (index->slots[slot].entry >= 0) {
+		if (index->slots[slot].key == name && strcmp(stream->templates[index->slots[slot].entry].qname, qname) == 0) {
+			return (index->slots[slot].entry);
+		}
+		slot = (slot + 1) & (index->capacity - 1);
+	}
+	return (-1);
+}
 
-///////////////////////////////////////////////////////////
-// Load Target BED file
-///////////////////////////////////////////////////////////
-
-struct lookup_dup* loadDUPLookupTable(char *file_name)
+static int newStreamTemplate(struct dedup_stream *stream, uint64_t name, const char *qname, int32_t evict)
 {
-	FILE *file = fopen(file_name, "r");
-	char *seq, *tmp_seq, s[200], stmp[200];
-	int i, len;
+	int i, t, length;
+	if (stream->free_template < 0) {
+		stream->templates = (struct stream_template *)realloc(stream->templates, 2 * stream->templates_size * sizeof(struct stream_template));
+		for (i = stream->templates_size; i < 2 * stream->templates_size; i++) {
+			stream->templates[i].qname = NULL;
+			stream->templates[i].qname_size = 0;
+			stream->templates[i].next = i + 1 < 2 * stream->templates_size ? i + 1 : -1;
+		}
+		stream->free_template = stream->templates_size;
+		stream->templates_size *= 2;
+	}
+	t = stream->free_template;
+	stream->free_template = stream->templates[t].next;
+	stream->templates[t].name = name;
+	length = strlen(qname) + 1;
+	if (length > stream->templates[t].qname_size) {
+		stream->templates[t].qname_size = length;
+		stream->templates[t].qname = (char *)realloc(stream->templates[t].qname, length);
+	}
+	memcpy(stream->templates[t].qname, qname, length);
+	stream->templates[t].evict = evict;
+	stream->templates[t].order = stream->templates_created++;
+	stream->templates[t].state = STREAM_PENDING;
+	stream->templates[t].next = -1;
+	if (stream->last_template >= 0) {
+		stream->templates[stream->last_template].next = t;
+	} else {
+		stream->first_template = t;
+	}
+	stream->last_template = t;
+	addStreamEntry(&(stream->template_index), name, t);
+	return (t);
+}
 
-	if (file == NULL) {
-		fprintf(stderr, "\nFile %s not present!!!\n", file_name);
-		exit(1);
+static int newStreamGroup(struct dedup_stream *stream)
+{
+	int i, g;
+	if (stream->free_group < 0) {
+		stream->groups = (struct stream_group *)realloc(stream->groups, 2 * stream->groups_size * sizeof(struct stream_group));
+		for (i = stream->groups_size; i < 2 * stream->groups_size; i++) {
+			stream->groups[i].next = i + 1 < 2 * stream->groups_size ? i + 1 : -1;
+		}
+		stream->free_group = stream->groups_size;
+		stream->groups_size *= 2;
 	}
+	g = stream->free_group;
+	stream->free_group = stream->groups[g].next;
+	return (g);
+}
 
-	// get number of lines
-	int number_of_lines = 0;
+// Enlarge the ring so that it spans positions [final_pos,pos]
+static void growStreamRing(struct dedup_stream *stream, int32_t pos)
+{
+	int i, g, next, size = stream->ring_size;
+	int32_t *buckets;
 
-	char line [MAX_READ_BUFF];
-	while (fgets(line, sizeof(line), file) != NULL) {
-		int i = 0;
-		while (isspace(line[i])) {
-			i++;
-		}
-		if (line[i] != '#') {
-			number_of_lines++;
+	while ((int64_t)pos - stream->final_pos >= size) {
+		size *= 2;
+	}
+	buckets = (int32_t *)malloc(size * sizeof(int32_t));
+	for (i = 0; i < size; i++) {
+		buckets[i] = -1;
+	}
+	for (i = 0; i < stream->ring_size; i++) {
+		for (g = stream->buckets[i]; g >= 0; g = next) {
+			next = stream->groups[g].next;
+			stream->groups[g].next = buckets[stream->groups[g].pos & (size - 1)];
+			buckets[stream->groups[g].pos & (size - 1)] = g;
 		}
 	}
+	free(stream->buckets);
+	stream->buckets = buckets;
+	stream->ring_size = size;
+}
 
-	rewind(file);
+// Keep the best template of the groups of bucket i
+static void finalizeStreamBucket(struct dedup_stream *stream, int i)
+{
+	int g, next;
+	for (g = stream->buckets[i]; g >= 0; g = next) {
+		next = stream->groups[g].next;
+		stream->templates[stream->groups[g].best].state = STREAM_KEPT;
+		removeStreamEntry(&(stream->group_index), stream->groups[g].key, g);
+		stream->groups[g].next = stream->free_group;
+		stream->free_group = g;
+	}
+	stream->buckets[i] = -1;
+}
+
+// Make final the buckets of the positions before pos
+static void finalizeStream(struct dedup_stream *stream, int32_t pos)
+{
+	int32_t p;
+	int i;
+	if (pos <= stream->final_pos) {
+		return;
+	}
+	if ((int64_t)pos - stream->final_pos >= stream->ring_size) {
+		for (i = 0; i < stream->ring_size; i++) {
+			finalizeStreamBucket(stream, i);
+		}
+	} else {
+		for (p = stream->final_pos; p < pos; p++) {
+			finalizeStreamBucket(stream, p & (stream->ring_size - 1));
+		}
+	}
+	stream->final_pos = pos;
+}
+
+// Add template t, with fragment signature as getReadSignature(), to the group of the
+// signature in the bucket of position pos
+static void addStreamTemplate(struct dedup_stream *stream, int t, uint64_t first, uint64_t second, int paired, int32_t pos)
+{
+	struct stream_template *template = &(stream->templates[t]);
+	struct stream_group *group;
+	uint64_t key;
+	int g;
+
+	if (pos < stream->final_pos) {
+		// its bucket is already final
+		template->state = STREAM_KEPT;
+		return;
+	}
+	key = mixStreamKey(mixStreamKey(first) ^ second) ^ paired;
+	g = findStreamEntry(&(stream->group_index), key);
+	if (g < 0) {
+		if ((int64_t)pos - stream->final_pos >= stream->ring_size) {
+			growStreamRing(stream, pos);
+		}
+		g = newStreamGroup(stream);
+		group = &(stream->groups[g]);
+		group->key = key;
+		group->best = t;
+		group->bp = template->bp;
+		group->order = template->order;
+		group->pos = pos;
+		group->next = stream->buckets[pos & (stream->ring_size - 1)];
+		stream->buckets[pos & (stream->ring_size - 1)] = g;
+		addStreamEntry(&(stream->group_index), key, g);
+		return;
+	}
+	group = &(stream->groups[g]);
+	if (template->bp > group->bp || (template->bp == group->bp && template->order < group->order)) {
+		stream->templates[group->best].state = STREAM_DUPLICATE;
+		group->best = t;
+		group->bp = template->bp;
+		group->order = template->order;
+	} else {
+		template->state = STREAM_DUPLICATE;
+	}
+}
+
+// Group template t by the only end seen: a single read, or a pair whose mate is missing
+static void addStreamSingle(struct dedup_stream *stream, int t)
+{
+	struct stream_template *template = &(stream->templates[t]);
+	uint64_t end = ((uint64_t)(uint32_t)template->tid << 32) | (uint32_t)template->pos;
+
+	if ((template->flag & BAM_FPAIRED) && !(template->flag & BAM_FMUNMAP)) {
+		addStreamTemplate(stream, t, ~(uint64_t)0, end, 1, template->pos);
+	} else {
+		addStreamTemplate(stream, t, end, 0, 0, template->pos);
+	}
+}
+
+// Group template t by the 5' ends of its first read and of the mate, at 5' end pos
+static void addStreamPair(struct dedup_stream *stream, int t, int32_t pos)
+{
+	struct stream_template *template = &(stream->templates[t]);
+	uint64_t tid = (uint64_t)(uint32_t)template->tid << 32;
+
+	if (template->pos <= pos) {
+		addStreamTemplate(stream, t, tid | (uint32_t)template->pos, tid | (uint32_t)pos, 1, pos);
+	} else {
+		addStreamTemplate(stream, t, tid | (uint32_t)pos, tid | (uint32_t)template->pos, 1, template->pos);
+	}
+}
+
+// Stop waiting for the mate of template t if the scan is past pos without it
+static void resolveStreamMate(struct dedup_stream *stream, int t, int32_t pos)
+{
+	if (stream->templates[t].mate >= 0 && stream->templates[t].mate < pos) {
+		stream->templates[t].mate = -1;
+		addStreamSingle(stream, t);
+	}
+}
+
+// Stop waiting for the mates the scan is past, at pos, from the oldest template waiting.
+// Returns the position of the first read of the oldest template still waiting, pos if none.
+static int32_t resolveStreamWaits(struct dedup_stream *stream, int32_t pos)
+{
+	struct stream_wait *wait;
+
+	while (stream->waits_head < stream->waits_length) {
+		wait = &(stream->waits[stream->waits_head]);
+		if (stream->templates[wait->template].order == wait->order) {
+			resolveStreamMate(stream, wait->template, pos);
+			if (stream->templates[wait->template].mate >= 0) {
+				return (wait->pos < pos ? wait->pos : pos);
+			}
+		}
+		stream->waits_head++;
+	}
+	stream->waits_head = stream->waits_length = 0;
+	return (pos);
+}
+
+static void addStreamWait(struct dedup_stream *stream, int t, int32_t pos)
+{
+	if (stream->waits_length == stream->waits_size) {
+		if (stream->waits_head > 0) {
+			memmove(stream->waits, stream->waits + stream->waits_head, (stream->waits_length - stream->waits_head) * sizeof(struct stream_wait));
+			stream->waits_length -= stream->waits_head;
+			stream->waits_head = 0;
+		} else {
+			stream->waits_size *= 2;
+			stream->waits = (struct stream_wait *)realloc(stream->waits, stream->waits_size * sizeof(struct stream_wait));
+		}
+	}
+	stream->waits[stream->waits_length].template = t;
+	stream->waits[stream->waits_length].order = stream->templates[t].order;
+	stream->waits[stream->waits_length].pos = pos;
+	stream->waits_length++;
+}
+
+// Pile up the reads at the head of the queue whose template is decided, the scan being at pos
+static void pushStreamReads(struct dedup_stream *stream, int32_t pos)
+{
+	int t;
+	bam1_t b;
+	size_t base;
+	struct stream_read *read;
+
+	while (stream->queue_head < stream->queue_length) {
+		read = &(stream->queue[stream->queue_head]);
+		t = read->template;
+		resolveStreamMate(stream, t, pos);
+		if (stream->templates[t].state == STREAM_PENDING) {
+			break;
+		}
+		if (stream->templates[t].state == STREAM_KEPT) {
+			memcpy(&b, stream->reads.data + read->offset, sizeof(bam1_t));
+			b.data = stream->reads.data + read->offset + sizeof(bam1_t);
+			bam_plbuf_push(&b, stream->buf);
+		}
+		stream->queue_head++;
+	}
+	// move the waiting reads to the start of the queue and of the arena
+	if (stream->queue_head == stream->queue_length) {
+		stream->queue_head = stream->queue_length = 0;
+		stream->reads.length = 0;
+	} else if (stream->queue_head >= 1024 && 2 * stream->queue_head >= stream->queue_length) {
+		base = stream->queue[stream->queue_head].offset;
+		memmove(stream->reads.data, stream->reads.data + base, stream->reads.length - base);
+		stream->reads.length -= base;
+		memmove(stream->queue, stream->queue + stream->queue_head, (stream->queue_length - stream->queue_head) * sizeof(struct stream_read));
+		stream->queue_length -= stream->queue_head;
+		stream->queue_head = 0;
+		for (t = 0; t < stream->queue_length; t++) {
+			stream->queue[t].offset -= base;
+		}
+	}
+}
+
+// Drop the decided templates that no read still expected or waiting belongs to, the
+// scan being at pos
+static void evictStreamTemplates(struct dedup_stream *stream, int32_t pos)
+{
+	int t;
+	int32_t waiting = pos;
+	struct stream_template *template;
+
+	if (stream->queue_head < stream->queue_length) {
+		waiting = stream->queue[stream->queue_head].pos;
+	}
+	while ((t = stream->first_template) >= 0) {
+		resolveStreamMate(stream, t, pos);
+		template = &(stream->templates[t]);
+		if (template->state == STREAM_PENDING || template->evict >= waiting) {
+			break;
+		}
+		removeStreamEntry(&(stream->template_index), template->name, t);
+		stream->first_template = template->next;
+		if (stream->first_template < 0) {
+			stream->last_template = -1;
+		}
+		template->next = stream->free_template;
+		stream->free_template = t;
+	}
+}
+
+// callback for bam_fetch()
+static int fetch_func_stream(const bam1_t *b, void *data)
+{
+	struct dedup_stream *stream = (struct dedup_stream *)data;
+	uint32_t *cigar = bam1_cigar(b);
+	uint64_t name;
+	int32_t pos, end, bp, lclip = 0, rclip = 0;
+	int t, paired, wait;
+	struct stream_template *template;
+	struct stream_read *read;
+
+	name = hashReadName(bam1_qname(b));
+	end = b->core.n_cigar ? bam_calend(&b->core, cigar) : b->core.pos + 1;
+	if (b->core.n_cigar > 0) {
+		if (bam_cigar_op(cigar[0]) == BAM_CSOFT_CLIP) {
+			lclip = bam_cigar_oplen(cigar[0]);
+		}
+		if (bam_cigar_op(cigar[b->core.n_cigar - 1]) == BAM_CSOFT_CLIP) {
+			rclip = bam_cigar_oplen(cigar[b->core.n_cigar - 1]);
+		}
+	}
+	// 5' end and covered bases, as in the window dedup
+	if (bam1_strand(b) == 0) {
+		pos = b->core.pos - lclip;
+		bp = end - b->core.pos;
+	} else {
+		pos = end + rclip;
+		bp = pos - b->core.pos;
+	}
+	if (end + rclip - (b->core.pos - lclip) > stream->span) {
+		stream->span = end + rclip - (b->core.pos - lclip);
+	}
+	if (stream->final_pos == INT32_MIN) {
+		stream->final_pos = b->core.pos - stream->span;
+	}
+
+	// reads starting from here cannot have a 5' end before b->core.pos - span, nor
+	// the templates still waiting for their mate, grouped by their first read if the
+	// mate is missing
+	finalizeStream(stream, resolveStreamWaits(stream, b->core.pos) - stream->span);
+	pushStreamReads(stream, b->core.pos);
+	evictStreamTemplates(stream, b->core.pos);
+
+	t = findStreamTemplate(stream, name, bam1_qname(b));
+	if (t >= 0) {
+		template = &(stream->templates[t]);
+		if (template->evict < b->core.pos) {
+			// a read of the template further than expected
+			template->evict = b->core.pos;
+		}
+		if (template->mate >= 0 && !(b->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) &&
+		        (b->core.flag & (BAM_FREAD1 | BAM_FREAD2)) != (template->flag & (BAM_FREAD1 | BAM_FREAD2))) {
+			// the mate waited for: the pair is grouped by both 5' ends, in the
+			// bucket of the last one
+			template->mate = -1;
+			if (bam1_strand(b) == 0) {
+				template->bp = bp;
+			} else {
+				template->bp += bp;
+			}
+			addStreamPair(stream, t, pos);
+		}
+	} else {
+		paired = (b->core.flag & BAM_FPAIRED) && !(b->core.flag & BAM_FMUNMAP);
+		wait = paired && b->core.mtid == b->core.tid && b->core.mpos >= b->core.pos && b->core.mpos < b->core.pos + STREAM_MATE_DISTANCE;
+		t = newStreamTemplate(stream, name, bam1_qname(b), (wait ? b->core.mpos : b->core.pos) + stream->span);
+		template = &(stream->templates[t]);
+		template->tid = b->core.tid;
+		template->pos = pos;
+		template->bp = bp;
+		template->flag = b->core.flag;
+		template->mate = -1;
+		if (wait) {
+			// the mate is close ahead: decide with it
+			template->mate = b->core.mpos;
+			addStreamWait(stream, t, b->core.pos);
+		} else {
+			addStreamSingle(stream, t);
+		}
+	}
+
+	if ((uint32_t)end > stream->beg && (uint32_t)b->core.pos < stream->end) {
+		if (stream->queue_length == stream->queue_size) {
+			stream->queue_size *= 2;
+			stream->queue = (struct stream_read *)realloc(stream->queue, stream->queue_size * sizeof(struct stream_read));
+		}
+		read = &(stream->queue[stream->queue_length++]);
+		read->template = t;
+		read->pos = b->core.pos;
+		read->offset = keepRead(&(stream->reads), b);
+	}
+	return 0;
+}
+
+// Make final all the buckets and pile up the reads left
+void finishDedupStream(struct dedup_stream *stream)
+{
+	int i;
+	resolveStreamWaits(stream, INT32_MAX);
+	for (i = 0; i < stream->ring_size; i++) {
+		finalizeStreamBucket(stream, i);
+	}
+	pushStreamReads(stream, INT32_MAX);
+}
+
+// callback for bam_fetch()
+static int fetch_func(const bam1_t *b, void *data)
+{
+	bam_plbuf_t *buf = (bam_plbuf_t * *)data;
+	bam_plbuf_push(b, buf);
+	return 0;
+}
+
+
+// callback for bam_plbuf_init()
+static int pileup_func(uint32_t tid, uint32_t pos, int n, const bam_pileup1_t *pl, void *data)
+{
+	int i, val, pos_c;
+	struct region_data *tmp = (struct region_data*)data;
+	struct pos_pileup counts;
+	unsigned char *qual;
+	uint32_t *cigar;
+
+	if ((int)pos >= tmp->beg && (int)pos < tmp->end) {
+		memset(&counts, 0, sizeof(struct pos_pileup));
+		if (tmp->duptable != NULL) {
+			resetDupSignatures(tmp->signatures, n);
+		}
+		for (i = 0; i < n; i++) {
+			qual = bam1_qual(pl[i].b);
+			if (!(
+			            qual[pl[i].qpos] < tmp->arguments->mbq ||
+			            pl[i].b->core.qual < tmp->arguments->mrq ||
+			            pl[i].is_del != 0 ||
+			            //pl[i].indel != 0)
+			            pl[i].is_refskip != 0 ||
+			            (pl[i].b->core.flag & BAM_DEF_MASK))) {
+				val = bam1_seqi(bam1_seq(pl[i].b), pl[i].qpos);
+				incBase(&counts, val);
+				if (tmp->arguments->strand_bias == 1) {
+					incBaseStrand(&counts, val, bam1_strand(pl[i].b));
+				}
+				if (tmp->duptable != NULL && nt16_base_index[val] >= 0) {
+					// reads are told apart by their unclipped start and the position of their mate
+					cigar = bam1_cigar(pl[i].b);
+					pos_c = pl[i].b->core.pos;
+					if (pl[i].b->core.n_cigar > 0 && bam_cigar_op(cigar[0]) == BAM_CSOFT_CLIP) {
+						pos_c -= bam_cigar_oplen(cigar[0]);
+					}
+					addDupSignature(tmp->signatures, nt16_base_index[val], bam1_strand(pl[i].b), pos_c + 1, pl[i].b->core.mpos + 1, pl[i].b->core.mtid);
+				}
+			} else if (pl[i].is_del) {
+				counts.del++;
+			}
+		}
+
+		if (tmp->duptable != NULL) {
+			// recompute base coverage after lifting
+			capBaseDup(tmp->signatures, tmp->duptable, &counts, tmp->arguments->strand_bias);
+		}
+		setPosCounts(tmp, pos, &counts);
+	}
+
+	return 0;
+}
+
+
+
+
+
+///////////////////////////////////////////////////////////
+// Regions RC processing
+///////////////////////////////////////////////////////////
+
+float computeGC(const ref_packed_t *reference, int init, int end)
+{
+	return (((float)ref_count_gc(reference, init, end + 1)) / ((float)(end - init + 1)));
+}
+
+void computeRC(float perc, struct target_t *region)
+{
+	int positions = (int)(floor((float)(region->to - region->from) * perc));
+	int init = 0;
+	int end = positions - 1;
+	float max = 0;
+	int i, sum, sumt;
+
+
+	if (positions == 0) {
+		sum = getPosCoverage(region->rdata, init);
+		region->read_count = region->read_count_global = sum;
+		region->gc = computeGC(region->reference, 0, 0);
+		region->from_sel = region->from;
+		region->to_sel = region->to;
+		return;
+	}
+	region->from_sel = init + region->from;
+	region->to_sel = end + region->from;
+	sumt = 0;
+
+	while (end < (region->to - region->from) && end >= 0) {
+		sum = 0;
+		sumt += getPosCoverage(region->rdata, init);
+		for (i = init; i <= end; i++)
+			sum += getPosCoverage(region->rdata, i);
+		if ((float)sum > max) {
+			region->from_sel = init + region->from;
+			region->to_sel = end + region->from;
+			max = (float)sum;
+
+		}
+		init++;
+		end++;
+	}
+
+	for (i = init; i <= (region->to - region->from); i++)
+		sumt += getPosCoverage(region->rdata, i);
+
+	region->read_count = (float)max / (float)positions;
+	region->read_count_global = (float)sumt / ((float)(region->to - region->from));
+}
+
+void computeGCRegion(float perc, struct target_t *region)
+{
+	int positions = (int)(floor((float)(region->to - region->from)));
+	if (positions == 0) {
+		positions = 1;
+	}
+	if (region->reference != NULL) {
+		region->gc = computeGC(region->reference, 0, positions - 1);
+	}
+}
+
+
+///////////////////////////////////////////////////////////
+// Load Target BED file
+///////////////////////////////////////////////////////////
+
+struct lookup_dup* loadDUPLookupTable(char *file_name)
+{
+	FILE *file = fopen(file_name, "r");
+	char *seq, *tmp_seq, s[200], stmp[200];
+	int i, len;
+
+	if (file == NULL) {
+		fprintf(stderr, "\nFile %s not present!!!\n", file_name);
+		exit(1);
+	}
+
+	// get number of lines
+	int number_of_lines = 0;
+
+	char line [MAX_READ_BUFF];
+	while (fgets(line, sizeof(line), file) != NULL) {
+		int i = 0;
+		while (isspace(line[i])) {
+			i++;
+		}
+		if (line[i] != '#') {
+			number_of_lines++;
+		}
+	}
+
+	rewind(file);
+
+	if (number_of_lines == 0) {
+		fprintf(stderr, "ERROR: the duplicates table %s has no lines.\n", file_name);
+		exit(1);
+	}
 
 	struct lookup_dup *table = (struct lookup_dup *)malloc(sizeof(struct lookup_dup));
 	table->covs_down = malloc(sizeof(int) * number_of_lines);
@@ -1236,6 +2734,13 @@ struct lookup_dup* loadDUPLookupTable(char *file_name)
 	int line_numb = 1;
 
 	while (fgets(line, sizeof(line), file) != NULL) {
+		i = 0;
+		while (isspace(line[i])) {
+			i++;
+		}
+		if (line[i] == '#') {
+			continue;
+		}
 		if (control == 0) {
 			// count the number of columns
 			for (i = 0; i < strlen(line); i++) {
@@ -1281,7 +2786,9 @@ struct lookup_dup* loadDUPLookupTable(char *file_name)
 		index++;
 		line_numb++;
 	}
+	fclose(file);
 
+	indexDUPLookupTable(table);
 	return (table);
 }
 
@@ -1422,14 +2929,22 @@ struct target_info* loadTargetBed(char *file_name)
 			size = strlen(str_tokens[3]);
 		}
 
-		current_elem->sequence = NULL;
+		current_elem->reference = NULL;
 		current_elem->rdata = NULL;
-		current_elem->sequence = NULL;
 		current_elem->from_sel = 0;
 		current_elem->to_sel = 0;
 		current_elem->gc = 0;
 		current_elem->read_count = 0;
 		current_elem->read_count_global = 0;
+		current_elem->cost = 1;
+		current_elem->elapsed = 0;
+		current_elem->tid = -1;
+		current_elem->tiles = 1;
+		current_elem->tiles_done = 0;
+		current_elem->ready = 0;
+		current_elem->snp_index = 0;
+		current_elem->output = NULL;
+		current_elem->memory = 0;
 
 		target->info[index] = current_elem;
 
@@ -1496,117 +3011,1302 @@ struct snps_info* loadSNPs(char *file_name)
 	sprintf(prev_chr, "init");
 	idx_chr = 0;
 
-	while (fgets(line, sizeof(line), file) != NULL) {
-		if (isspace(line[0]) || line[0] == '#') {
-			continue;
+	while (fgets(line, sizeof(line), file) != NULL) {
+		if (isspace(line[0]) || line[0] == '#') {
+			continue;
+		}
+
+		if (control == 0) {
+			// count the number of columns
+			for (i = 0; i < strlen(line); i++) {
+				if (strncmp(&line[i], sep, 1) == 0) {
+					columns++;
+				}
+			}
+			columns++;
+			control = 1;
+		}
+
+		// tokenize a line
+		char *str_tokens[columns];
+		char *pch;
+		pch = strtok(line, "\t");
+		i = 0;
+		while (pch != NULL) {
+			str_tokens[i++] = pch;
+			pch = strtok(NULL, "\t");
+		}
+
+		if (i < 5) {
+			fprintf(stderr, "ERROR: at line %d the number of columns is not correct (at least 3 columns required).\n", line_numb);
+			exit(1);
+		}
+
+		struct snps_t *current_elem = (struct snps_t *)malloc(sizeof(struct snps_t));
+		int size;
+		current_elem->chr = (char*)malloc(strlen(str_tokens[0]) + 1);
+		strcpy(current_elem->chr, str_tokens[0]);
+		current_elem->pos = strtol(str_tokens[1], &pch, 10);
+		// check correct conversion
+		sprintf(stmp, "%u", current_elem->pos);
+		if (strncmp(stmp, str_tokens[1], strlen(stmp)) != 0) {
+			fprintf(stderr, "ERROR: genomic position at line %d is not valid.\n", line_numb);
+			exit(1);
+		}
+
+		current_elem->rsid = (char*)malloc(strlen(str_tokens[2]) + 1);
+		strcpy(current_elem->rsid, str_tokens[2]);
+		current_elem->ref = (char*)malloc(strlen(str_tokens[3]) + 1);
+		strcpy(current_elem->ref, str_tokens[3]);
+		current_elem->alt = (char*)malloc(strlen(str_tokens[4]) + 1);
+		strcpy(current_elem->alt, str_tokens[4]);
+
+		// check ordering
+		if (strcmp(current_elem->chr, prev_chr) != 0) {
+			i = 0;
+			while (VCF_CHR[i] != NULL) {
+				if (strcmp(VCF_CHR[i], current_elem->chr) == 0) {
+					fprintf(stderr, "ERROR: chromosomes are not ordered (line %d).\n", line_numb);
+					exit(1);
+				}
+				i++;
+			}
+			sprintf(prev_chr, "%s", current_elem->chr);
+			VCF_CHR[idx_chr] = (char *)malloc(sizeof(char) * strlen(current_elem->chr) + 1);
+			strcpy(VCF_CHR[idx_chr], current_elem->chr);
+			subSlash(VCF_CHR[idx_chr]);
+			idx_chr++;
+			prev_pos = 0;
+		} else {
+			if (current_elem->pos <= prev_pos) {
+				fprintf(stderr, "ERROR: entries are not positionally ordered (line %d).\n", line_numb);
+				exit(1);
+			}
+
+			prev_pos = current_elem->pos;
+		}
+
+		if (current_elem->pos < 0) {
+			fprintf(stderr, "ERROR: position at line %d should be positive.\n", line_numb);
+			exit(1);
+		}
+		if (strcmp(current_elem->ref, strA) != 0 && strcmp(current_elem->ref, strC) != 0 && strcmp(current_elem->ref, strG) != 0 && strcmp(current_elem->ref, strT) != 0) {
+			fprintf(stderr, "ERROR: reference position at line %d is not a single base equal to A, C, G or T.\n", line_numb);
+			exit(1);
+		}
+		if (strcmp(current_elem->alt, strA) != 0 && strcmp(current_elem->alt, strC) != 0 && strcmp(current_elem->alt, strG) != 0 && strcmp(current_elem->alt, strT) != 0) {
+			fprintf(stderr, "ERROR: alternative position at line %d is not a single base equal to A, C, G or T.\n", line_numb);
+			exit(1);
+		}
+
+		snps->info[index] = current_elem;
+		index++;
+		line_numb++;
+	}
+
+	return (snps);
+}
+
+
+///////////////////////////////////////////////////////////
+// Print functions
+///////////////////////////////////////////////////////////
+
+// Growing text buffer where output rows are formatted
+struct text_buffer {
+	char *data;
+	size_t length;
+	size_t size;
+};
+
+// Output rows of a region, one buffer for each output file
+struct region_output {
+	struct text_buffer snps;
+	struct text_buffer snvs;
+	struct text_buffer all;
+	struct pileup_columns *columns;    // rows of the binary pileup being formatted, NULL for the text one
+	struct pileup_block_info *blocks;  // blocks of the binary pileup in all
+	int blocks_length;
+	int blocks_size;
+	struct pileup_segment *segments;   // rows of the compressed pileup in all, for its index
+	int segments_length;
+	int segments_size;
+};
+
+void bufferPrintf(struct text_buffer *buffer, const char *format, ...)
+{
+	va_list ap;
+	int n;
+
+	if (buffer->size - buffer->length < 256) {
+		buffer->size = (buffer->size == 0) ? CHUNK_SIZE : buffer->size * 2;
+		buffer->data = (char *)realloc(buffer->data, buffer->size);
+	}
+	va_start(ap, format);
+	n = vsnprintf(buffer->data + buffer->length, buffer->size - buffer->length, format, ap);
+	va_end(ap);
+	if ((size_t)n >= buffer->size - buffer->length) {
+		// the row did not fit, grow the buffer and format it again
+		while ((size_t)n >= buffer->size - buffer->length) {
+			buffer->size *= 2;
+		}
+		buffer->data = (char *)realloc(buffer->data, buffer->size);
+		va_start(ap, format);
+		vsnprintf(buffer->data + buffer->length, buffer->size - buffer->length, format, ap);
+		va_end(ap);
+	}
+	buffer->length += n;
+}
+
+void writeBuffer(struct text_buffer *buffer, FILE *outfile)
+{
+	if (outfile != NULL && buffer->length > 0) {
+		fwrite(buffer->data, 1, buffer->length, outfile);
+	}
+	free(buffer->data);
+	buffer->data = NULL;
+	buffer->length = buffer->size = 0;
+}
+
+///////////////////////////////////////////////////////////
+// Row formatting
+///////////////////////////////////////////////////////////
+
+// Longest "%.*f" of a double (DBL_MAX with 6 decimals), and longest row after the chromosome
+#define FIXED_MAX_LENGTH 320
+#define ROW_MAX_LENGTH (16 * FIXED_MAX_LENGTH)
+
+static const uint64_t pow10_table[] = {1, 10, 100, 1000, 10000, 100000, 1000000};
+
+static const char digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Room for n more characters at the end of the buffer
+char *bufferReserve(struct text_buffer *buffer, size_t n)
+{
+	if (buffer->size - buffer->length < n) {
+		if (buffer->size == 0) {
+			buffer->size = CHUNK_SIZE;
+		}
+		while (buffer->size - buffer->length < n) {
+			buffer->size *= 2;
+		}
+		buffer->data = (char *)realloc(buffer->data, buffer->size);
+	}
+	return (buffer->data + buffer->length);
+}
+
+// Writes v in decimal as "%llu" does, returns the end of the written characters
+static inline char *putUInt(char *p, uint64_t v)
+{
+	char tmp[20];
+	char *t = tmp + sizeof(tmp);
+	size_t n;
+
+	while (v >= 100) {
+		t -= 2;
+		memcpy(t, digit_pairs + 2 * (v % 100), 2);
+		v /= 100;
+	}
+	if (v >= 10) {
+		t -= 2;
+		memcpy(t, digit_pairs + 2 * v, 2);
+	} else {
+		*--t = (char)('0' + v);
+	}
+	n = tmp + sizeof(tmp) - t;
+	memcpy(p, t, n);
+	return (p + n);
+}
+
+// As putUInt(), as "%d" does
+static inline char *putInt(char *p, int v)
+{
+	if (v < 0) {
+		*p++ = '-';
+		return (putUInt(p, -(int64_t)v));
+	}
+	return (putUInt(p, (uint64_t)v));
+}
+
+// Writes x as "%.*f" does with digits (at most 6) decimals. The value is rounded from its
+// exact binary expansion, to the nearest and ties to even as printf does, so that the
+// output is byte-identical. Negative, large and non finite values are left to snprintf.
+static inline char *putFixed(char *p, double x, int digits)
+{
+#ifdef __SIZEOF_INT128__
+	union {
+		double d;
+		uint64_t u;
+	} bits;
+	unsigned __int128 v, rem, half;
+	uint64_t m, n, q;
+	int exponent, shift, i;
+
+	bits.d = x;
+	exponent = (int)((bits.u >> 52) & 0x7FF);
+	// below 2^32, x is m / 2^shift with shift >= 21
+	if ((bits.u >> 63) == 0 && exponent < 1023 + 32) {
+		m = bits.u & ((1ULL << 52) - 1);
+		if (exponent == 0) {
+			shift = 1074;
+		} else {
+			m |= 1ULL << 52;
+			shift = 1075 - exponent;
+		}
+		n = 0;
+		// m * 10^digits is below 2^73, and rounds to 0 past a shift of 74
+		if (shift < 80) {
+			v = (unsigned __int128)m * pow10_table[digits];
+			n = (uint64_t)(v >> shift);
+			rem = v - ((unsigned __int128)n << shift);
+			half = (unsigned __int128)1 << (shift - 1);
+			if (rem > half || (rem == half && (n & 1))) {
+				n++;
+			}
+		}
+		q = n / pow10_table[digits];
+		p = putUInt(p, q);
+		if (digits > 0) {
+			n -= q * pow10_table[digits];
+			*p++ = '.';
+			for (i = digits - 1; i >= 0; i--) {
+				p[i] = (char)('0' + n % 10);
+				n /= 10;
+			}
+			p += digits;
+		}
+		return (p);
+	}
+#endif
+	return (p + snprintf(p, FIXED_MAX_LENGTH, "%.*f", digits, x));
+}
+
+// Writes chr, pos, end (if not 0) and ref, the start of every pileup row
+static inline char *putRowPosition(char *p, const char *chr, int chr_length, uint32_t pos, uint32_t end, char ref)
+{
+	memcpy(p, chr, chr_length);
+	p += chr_length;
+	*p++ = '\t';
+	p = putUInt(p, pos);
+	if (end != 0) {
+		*p++ = '\t';
+		p = putUInt(p, end);
+	}
+	*p++ = '\t';
+	*p++ = ref;
+	return (p);
+}
+
+// Appends "chr pos [end] ref [alt] A C G T af cov [Ars Crs Grs Trs]" and the end character,
+// end and alt being omitted if 0 and the reverse strand counts if strand_bias is not set
+void emitCountsRow(struct text_buffer *buffer, const char *chr, int chr_length, uint32_t pos, uint32_t end_pos, char ref, char alt,
+                   const struct pos_pileup *counts, float af, int cov, int strand_bias, char end)
+{
+	char *p = bufferReserve(buffer, chr_length + ROW_MAX_LENGTH);
+	int b;
+
+	p = putRowPosition(p, chr, chr_length, pos, end_pos, ref);
+	if (alt != 0) {
+		*p++ = '\t';
+		*p++ = alt;
+	}
+	for (b = 0; b < 4; b++) {
+		*p++ = '\t';
+		p = putInt(p, counts->base[b]);
+	}
+	*p++ = '\t';
+	p = putFixed(p, af, 6);
+	*p++ = '\t';
+	p = putInt(p, cov);
+	if (strand_bias == 1) {
+		for (b = 0; b < 4; b++) {
+			*p++ = '\t';
+			p = putInt(p, counts->base_rev[b]);
+		}
+	}
+	*p++ = end;
+	buffer->length = p - buffer->data;
+}
+
+// Emitters of the rows of the pileup file, one for each mode writing one at every position,
+// with the end column (equal to pos) if end_column is set
+typedef void (*pileup_emitter)(struct region_output *output, const char *chr, int chr_length, uint32_t pos, int end_column,
+                               const struct pos_pileup *counts, const struct pos_stats *stats, int k, int strand_bias);
+
+// Modes 1 and 4: "chr pos [end] ref A C G T af cov [Ars Crs Grs Trs]"
+void emitPileupRow(struct region_output *output, const char *chr, int chr_length, uint32_t pos, int end_column,
+                   const struct pos_pileup *counts, const struct pos_stats *stats, int k, int strand_bias)
+{
+	float af = 0;
+	if (stats->cov[k] > 0) {
+		af = ((float)stats->alt_sum[k]) / ((float)stats->cov[k]);
+	}
+	emitCountsRow(&(output->all), chr, chr_length, pos, end_column ? pos : 0, stats->bases[k], 0, counts, af, stats->cov[k],
+	              strand_bias, '\n');
+}
+
+// Mode 6: "chr pos [end] ref cov CountA FracA StrandA ... CountT FracT StrandT"
+void emitFractionsRow(struct region_output *output, const char *chr, int chr_length, uint32_t pos, int end_column,
+                      const struct pos_pileup *counts, const struct pos_stats *stats, int k, int strand_bias)
+{
+	struct text_buffer *buffer = &(output->all);
+	char *p = bufferReserve(buffer, chr_length + ROW_MAX_LENGTH);
+	int b;
+
+	p = putRowPosition(p, chr, chr_length, pos, end_column ? pos : 0, stats->bases[k]);
+	*p++ = '\t';
+	p = putInt(p, stats->cov[k] + counts->del);
+	for (b = 0; b < 4; b++) {
+		*p++ = '\t';
+		p = putInt(p, counts->base[b]);
+		*p++ = '\t';
+		p = putFixed(p, stats->frac[b][k], 4);
+		*p++ = '\t';
+		p = putFixed(p, stats->strand[b][k], 2);
+	}
+	*p++ = '\n';
+	buffer->length = p - buffer->data;
+}
+
+///////////////////////////////////////////////////////////
+// Reference blocks
+///////////////////////////////////////////////////////////
+
+// With the refblock option, each run of consecutive positions of the pileup without
+// alternative bases (nor deletions in mode 6), whose depth stays within the band (in %)
+// above the minimum depth of the run, is written as one row from pos to end, with the
+// minimum depth as coverage and '.' as reference and counts, like the reference blocks
+// of a gVCF. Runs of a single position are written as full rows, with end equal to pos.
+struct ref_block {
+	uint32_t beg;   // first position, 0 if no run is open
+	uint32_t end;   // last position
+	int min_cov;
+	int max_cov;
+};
+
+// Whether position k of stats, with counts, can be part of a reference block
+static inline int isRefBlockPosition(const struct pos_stats *stats, int k, const struct pos_pileup *counts, int mode)
+{
+	return (stats->alt_sum[k] == 0 && char_base_index[(unsigned char)stats->bases[k]] > 0 && (mode != 6 || counts->del == 0));
+}
+
+// Modes 1 and 4: "chr pos end . . . . . 0.000000 cov [. . . .]", mode 6: "chr pos end . cov"
+// followed by 12 '.'
+void emitRefBlockRow(struct region_output *output, const char *chr, int chr_length, const struct ref_block *block,
+                     int mode, int strand_bias)
+{
+	struct text_buffer *buffer = &(output->all);
+	char *p = bufferReserve(buffer, chr_length + ROW_MAX_LENGTH);
+	int b;
+
+	p = putRowPosition(p, chr, chr_length, block->beg, block->end, '.');
+	if (mode == 6) {
+		*p++ = '\t';
+		p = putInt(p, block->min_cov);
+		for (b = 0; b < 12; b++) {
+			*p++ = '\t';
+			*p++ = '.';
+		}
+	} else {
+		for (b = 0; b < 4; b++) {
+			*p++ = '\t';
+			*p++ = '.';
+		}
+		memcpy(p, "\t0.000000\t", 10);
+		p = putInt(p + 10, block->min_cov);
+		if (strand_bias == 1) {
+			for (b = 0; b < 4; b++) {
+				*p++ = '\t';
+				*p++ = '.';
+			}
+		}
+	}
+	*p++ = '\n';
+	buffer->length = p - buffer->data;
+}
+
+// Writes the open run of block, if any, of region: a block row if it spans several
+// positions, else the full row of its position, taking its statistics from stats, the
+// block of statistics from index stats_from of the region, or computing them in single
+void flushRefBlock(struct ref_block *block, struct region_output *output, struct target_t *region, int chr_length,
+                   pileup_emitter emit_pileup, struct pos_stats *stats, int stats_from, struct pos_stats *single,
+                   struct input_args *arguments)
+{
+	struct pos_pileup counts;
+	int i;
+
+	if (block->beg == 0) {
+		return;
+	}
+	if (block->end > block->beg) {
+		emitRefBlockRow(output, region->chr, chr_length, block, arguments->mode, arguments->strand_bias);
+	} else {
+		i = block->beg - region->from;
+		getPosCounts(region->rdata, i, &counts);
+		if (i >= stats_from && i < stats_from + POS_STATS_BLOCK) {
+			emit_pileup(output, region->chr, chr_length, block->beg, 1, &counts, stats, i - stats_from, arguments->strand_bias);
+		} else {
+			computePosStats(region->rdata, region->reference, i, 1, arguments->mode == 6, single);
+			emit_pileup(output, region->chr, chr_length, block->beg, 1, &counts, single, 0, arguments->strand_bias);
+		}
+	}
+	block->beg = 0;
+}
+
+// Adds position pos of depth cov to the open run of block, first writing the run if pos
+// does not extend it within the depth band
+void addRefBlockPosition(struct ref_block *block, uint32_t pos, int cov, struct region_output *output, struct target_t *region,
+                         int chr_length, pileup_emitter emit_pileup, struct pos_stats *stats, int stats_from,
+                         struct pos_stats *single, struct input_args *arguments)
+{
+	int min_cov, max_cov;
+
+	if (block->beg != 0 && block->end + 1 == pos) {
+		min_cov = (cov < block->min_cov ? cov : block->min_cov);
+		max_cov = (cov > block->max_cov ? cov : block->max_cov);
+		if ((int64_t)max_cov * 100 <= (int64_t)min_cov * (100 + arguments->ref_block)) {
+			block->end = pos;
+			block->min_cov = min_cov;
+			block->max_cov = max_cov;
+			return;
+		}
+	}
+	flushRefBlock(block, output, region, chr_length, emit_pileup, stats, stats_from, single, arguments);
+	block->beg = block->end = pos;
+	block->min_cov = block->max_cov = cov;
+}
+
+///////////////////////////////////////////////////////////
+// Binary pileup
+///////////////////////////////////////////////////////////
+
+// With the binary option the pileup file of modes 1, 4 and 6 is written as blocks of at
+// most PILEUP_BLOCK_ROWS rows of a region, each one with the columns of its rows deflated
+// together, followed by an index of the blocks:
+//
+//   header:  magic, byte order mark, mode, strand bias
+//   blocks:  block header, deflated columns
+//   index:   chromosome names (count, then length and characters of each name), then an
+//            entry for each block
+//   trailer: index offset, number of blocks, index magic
+//
+// The columns are, for each row, the distance from the position of the previous row (0
+// for the first row of a block), the counts of A, C, G and T, with strand bias the counts
+// on the reverse strand, in mode 6 the deletions, and last the reference base. Numbers are
+// 32-bit, in the byte order of the host that wrote the file.
+#define PILEUP_BLOCK_ROWS 65536
+#define PILEUP_MAGIC "PBP\1"
+#define PILEUP_INDEX_MAGIC "PBPI"
+#define PILEUP_BYTE_ORDER 0x01020304
+
+struct pileup_file_header {
+	char magic[4];
+	uint32_t byte_order;
+	int32_t mode;
+	int32_t strand_bias;
+};
+
+struct pileup_block_header {
+	uint32_t rows;
+	uint32_t first;           // position of the first row
+	uint32_t counters;        // count columns
+	uint32_t raw_size;
+	uint32_t compressed_size;
+};
+
+struct pileup_index_entry {
+	uint32_t chr;             // index of the chromosome name
+	uint32_t first;           // position of the first row
+	uint32_t last;            // position of the last row
+	uint32_t rows;
+	uint64_t offset;          // offset of the block header in the file
+};
+
+struct pileup_index_trailer {
+	uint64_t offset;          // offset of the index in the file
+	uint32_t blocks;
+	char magic[4];
+};
+
+// Block formatted in the output of a region, offset being relative to its buffer
+struct pileup_block_info {
+	uint32_t first;
+	uint32_t last;
+	uint32_t rows;
+	size_t offset;
+};
+
+// Rows of the binary pileup being formatted by a thread, compressed in a block every
+// PILEUP_BLOCK_ROWS rows and at the end of each region
+struct pileup_columns {
+	uint32_t *gaps;
+	uint32_t *counts[POS_COUNTERS]; // A, C, G, T, [Ars, Crs, Grs, Trs], [del]
+	char *bases;
+	int counters;
+	int rows;
+	uint32_t first;
+	uint32_t last;
+	z_stream stream;
+	int stream_ready;
+};
+
+void initPileupColumns(struct pileup_columns *columns)
+{
+	memset(columns, 0, sizeof(struct pileup_columns));
+}
+
+void destroyPileupColumns(struct pileup_columns *columns)
+{
+	int c;
+	free(columns->gaps);
+	for (c = 0; c < POS_COUNTERS; c++) {
+		free(columns->counts[c]);
+	}
+	free(columns->bases);
+	if (columns->stream_ready) {
+		deflateEnd(&(columns->stream));
+	}
+	initPileupColumns(columns);
+}
+
+// Number of count columns written in mode with strand_bias
+int getPileupCounters(int mode, int strand_bias)
+{
+	return (4 + (strand_bias == 1 ? 4 : 0) + (mode == 6 ? 1 : 0));
+}
+
+// Prepares the columns for the rows of a region
+void resetPileupColumns(struct pileup_columns *columns, int counters)
+{
+	int c;
+	if (columns->gaps == NULL) {
+		columns->gaps = (uint32_t *)malloc(sizeof(uint32_t) * PILEUP_BLOCK_ROWS);
+		columns->bases = (char *)malloc(PILEUP_BLOCK_ROWS);
+	}
+	for (c = 0; c < counters; c++) {
+		if (columns->counts[c] == NULL) {
+			columns->counts[c] = (uint32_t *)malloc(sizeof(uint32_t) * PILEUP_BLOCK_ROWS);
+		}
+	}
+	if (!columns->stream_ready) {
+		if (deflateInit(&(columns->stream), Z_BEST_SPEED) != Z_OK) {
+			fprintf(stderr, "ERROR: memory not available to compress the binary pileup.\n");
+			exit(1);
+		}
+		columns->stream_ready = 1;
+	}
+	columns->counters = counters;
+	columns->rows = 0;
+}
+
+// Deflates the rows of the columns in a block appended to the output of the region
+void flushPileupColumns(struct region_output *output)
+{
+	struct pileup_columns *columns = output->columns;
+	struct text_buffer *buffer = &(output->all);
+	struct pileup_block_header header;
+	struct pileup_block_info *block;
+	z_stream *stream = &(columns->stream);
+	size_t offset, bound;
+	int c, ret;
+
+	if (columns->rows == 0) {
+		return;
+	}
+	header.rows = columns->rows;
+	header.first = columns->first;
+	header.counters = columns->counters;
+	header.raw_size = columns->rows * (sizeof(uint32_t) * (1 + columns->counters) + 1);
+
+	offset = buffer->length;
+	bound = deflateBound(stream, header.raw_size);
+	bufferReserve(buffer, sizeof(header) + bound);
+	deflateReset(stream);
+	stream->next_out = (Bytef *)(buffer->data + offset + sizeof(header));
+	stream->avail_out = bound;
+	for (c = -1; c <= columns->counters; c++) {
+		if (c == -1) {
+			stream->next_in = (Bytef *)columns->gaps;
+			stream->avail_in = sizeof(uint32_t) * columns->rows;
+		} else if (c < columns->counters) {
+			stream->next_in = (Bytef *)columns->counts[c];
+			stream->avail_in = sizeof(uint32_t) * columns->rows;
+		} else {
+			stream->next_in = (Bytef *)columns->bases;
+			stream->avail_in = columns->rows;
+		}
+		ret = deflate(stream, c == columns->counters ? Z_FINISH : Z_NO_FLUSH);
+		if (ret == Z_STREAM_ERROR || (c == columns->counters && ret != Z_STREAM_END)) {
+			fprintf(stderr, "ERROR: binary pileup compression failed.\n");
+			exit(1);
+		}
+	}
+	header.compressed_size = stream->total_out;
+	memcpy(buffer->data + offset, &header, sizeof(header));
+	buffer->length = offset + sizeof(header) + header.compressed_size;
+
+	if (output->blocks_length == output->blocks_size) {
+		output->blocks_size = output->blocks_size ? output->blocks_size * 2 : 4;
+		output->blocks = (struct pileup_block_info *)realloc(output->blocks, sizeof(struct pileup_block_info) * output->blocks_size);
+	}
+	block = &(output->blocks[output->blocks_length++]);
+	block->first = columns->first;
+	block->last = columns->last;
+	block->rows = columns->rows;
+	block->offset = offset;
+	columns->rows = 0;
+}
+
+// Binary pileup (modes 1, 4 and 6): the row is appended to the columns
+void emitBinaryRow(struct region_output *output, const char *chr, int chr_length, uint32_t pos, int end_column,
+                   const struct pos_pileup *counts, const struct pos_stats *stats, int k, int strand_bias)
+{
+	struct pileup_columns *columns = output->columns;
+	int b, n;
+
+	if (columns->rows == PILEUP_BLOCK_ROWS) {
+		flushPileupColumns(output);
+	}
+	n = columns->rows++;
+	columns->gaps[n] = (n == 0 ? 0 : pos - columns->last);
+	if (n == 0) {
+		columns->first = pos;
+	}
+	columns->last = pos;
+	for (b = 0; b < 4; b++) {
+		columns->counts[b][n] = counts->base[b];
+	}
+	b = 4;
+	if (strand_bias == 1) {
+		for (; b < 8; b++) {
+			columns->counts[b][n] = counts->base_rev[b - 4];
+		}
+	}
+	if (b < columns->counters) {
+		columns->counts[b][n] = counts->del;
+	}
+	columns->bases[n] = stats->bases[k];
+}
+
+// Blocks written in the binary pileup, and the names of their chromosomes
+struct pileup_index {
+	char **chrs;
+	int chrs_length;
+	int chrs_size;
+	struct pileup_index_entry *entries;
+	int length;
+	int size;
+};
+
+void initPileupIndex(struct pileup_index *index)
+{
+	memset(index, 0, sizeof(struct pileup_index));
+}
+
+void destroyPileupIndex(struct pileup_index *index)
+{
+	int i;
+	for (i = 0; i < index->chrs_length; i++) {
+		free(index->chrs[i]);
+	}
+	free(index->chrs);
+	free(index->entries);
+	initPileupIndex(index);
+}
+
+void writePileupFileHeader(FILE *outfile, struct input_args *arguments)
+{
+	struct pileup_file_header header;
+	memcpy(header.magic, PILEUP_MAGIC, 4);
+	header.byte_order = PILEUP_BYTE_ORDER;
+	header.mode = arguments->mode;
+	header.strand_bias = arguments->strand_bias;
+	fwrite(&header, sizeof(header), 1, outfile);
+}
+
+// Adds to the index the blocks of the output of a region on chr, written at offset
+void addPileupIndexBlocks(struct pileup_index *index, char *chr, struct region_output *output, uint64_t offset)
+{
+	struct pileup_index_entry *entry;
+	int i, c;
+
+	if (output->blocks_length == 0) {
+		return;
+	}
+	for (c = index->chrs_length - 1; c >= 0 && strcmp(index->chrs[c], chr) != 0; c--);
+	if (c < 0) {
+		if (index->chrs_length == index->chrs_size) {
+			index->chrs_size = index->chrs_size ? index->chrs_size * 2 : 64;
+			index->chrs = (char **)realloc(index->chrs, sizeof(char *) * index->chrs_size);
+		}
+		c = index->chrs_length++;
+		index->chrs[c] = (char *)malloc(strlen(chr) + 1);
+		strcpy(index->chrs[c], chr);
+	}
+	for (i = 0; i < output->blocks_length; i++) {
+		if (index->length == index->size) {
+			index->size = index->size ? index->size * 2 : 1024;
+			index->entries = (struct pileup_index_entry *)realloc(index->entries, sizeof(struct pileup_index_entry) * index->size);
+		}
+		entry = &(index->entries[index->length++]);
+		entry->chr = c;
+		entry->first = output->blocks[i].first;
+		entry->last = output->blocks[i].last;
+		entry->rows = output->blocks[i].rows;
+		entry->offset = offset + output->blocks[i].offset;
+	}
+}
+
+// Writes the index and the trailer at offset, the end of the last block
+void writePileupIndex(FILE *outfile, struct pileup_index *index, uint64_t offset)
+{
+	struct pileup_index_trailer trailer;
+	uint32_t length;
+	int i;
+
+	length = index->chrs_length;
+	fwrite(&length, sizeof(length), 1, outfile);
+	for (i = 0; i < index->chrs_length; i++) {
+		length = strlen(index->chrs[i]);
+		fwrite(&length, sizeof(length), 1, outfile);
+		fwrite(index->chrs[i], 1, length, outfile);
+	}
+	fwrite(index->entries, sizeof(struct pileup_index_entry), index->length, outfile);
+	trailer.offset = offset;
+	trailer.blocks = index->length;
+	memcpy(trailer.magic, PILEUP_INDEX_MAGIC, 4);
+	fwrite(&trailer, sizeof(trailer), 1, outfile);
+}
+
+// Seeks to offset from the start of the file, in steps that fit in a long
+int seekFile(FILE *file, uint64_t offset)
+{
+	long step;
+	if (fseek(file, 0, SEEK_SET) != 0) {
+		return (-1);
+	}
+	while (offset > 0) {
+		step = (offset > LONG_MAX ? LONG_MAX : (long)offset);
+		if (fseek(file, step, SEEK_CUR) != 0) {
+			return (-1);
+		}
+		offset -= step;
+	}
+	return (0);
+}
+
+// Reads the index of a binary pileup file, returns 0 if the file is not valid
+int readPileupIndex(FILE *file, struct pileup_index *index)
+{
+	struct pileup_index_trailer trailer;
+	uint32_t length;
+	int i;
+
+	if (fseek(file, -(long)sizeof(trailer), SEEK_END) != 0 || fread(&trailer, sizeof(trailer), 1, file) != 1 ||
+	        memcmp(trailer.magic, PILEUP_INDEX_MAGIC, 4) != 0 || seekFile(file, trailer.offset) != 0) {
+		return (0);
+	}
+	if (fread(&length, sizeof(length), 1, file) != 1) {
+		return (0);
+	}
+	index->chrs_length = index->chrs_size = length;
+	index->chrs = (char **)calloc(length + 1, sizeof(char *));
+	for (i = 0; i < index->chrs_length; i++) {
+		if (fread(&length, sizeof(length), 1, file) != 1) {
+			return (0);
+		}
+		index->chrs[i] = (char *)malloc(length + 1);
+		if (fread(index->chrs[i], 1, length, file) != length) {
+			return (0);
+		}
+		index->chrs[i][length] = '\0';
+	}
+	index->length = index->size = trailer.blocks;
+	index->entries = (struct pileup_index_entry *)malloc(sizeof(struct pileup_index_entry) * (index->length + 1));
+	if (fread(index->entries, sizeof(struct pileup_index_entry), index->length, file) != (size_t)index->length) {
+		return (0);
+	}
+	for (i = 0; i < index->length; i++) {
+		if (index->entries[i].chr >= (uint32_t)index->chrs_length) {
+			return (0);
+		}
+	}
+	return (1);
+}
+
+///////////////////////////////////////////////////////////
+// Compressed pileup
+///////////////////////////////////////////////////////////
+
+// With the bgzip option the pileup file of modes 1, 4 and 6 is written in BGZF blocks, as
+// bgzip does, each thread compressing the rows of the regions it computes. A tabix index
+// of the rows (sequence column 1, position columns 2 and 2, or 2 and 3 with the end column
+// of the refblock option, 1 header line) is written alongside, built from the runs of rows
+// in the same bin recorded for each region.
+#define BGZF_BLOCK_SIZE 0xff00
+#define BGZF_MAX_BLOCK_SIZE 0x10000
+#define BGZF_HEADER_SIZE 18
+#define TABIX_WINDOW_SHIFT 14
+#define TABIX_MAX_POSITION (1 << 29)
+#define TABIX_WINDOW_BIN 4681  // bin of the first 16 kb window, the bins below span several windows
+
+static const uint8_t bgzf_header[BGZF_HEADER_SIZE] = {31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, 0, 0};
+static const uint8_t bgzf_eof[28] = {31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, 27, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+// Consecutive rows of a region in the same bin, with their virtual offsets relative to the
+// start of the compressed output of the region
+struct pileup_segment {
+	uint32_t bin;
+	uint32_t beg;           // 0-based position of the first row
+	uint32_t end;           // 0-based position past the last row
+	uint64_t voffset_beg;
+	uint64_t voffset_end;
+};
+
+// Deflate stream of a thread, for raw deflate blocks
+struct bgzf_compressor {
+	z_stream stream;
+	int ready;
+};
+
+void initBGZFCompressor(struct bgzf_compressor *compressor)
+{
+	memset(compressor, 0, sizeof(struct bgzf_compressor));
+}
+
+void destroyBGZFCompressor(struct bgzf_compressor *compressor)
+{
+	if (compressor->ready) {
+		deflateEnd(&(compressor->stream));
+	}
+	initBGZFCompressor(compressor);
+}
+
+static inline void putLE32(uint8_t *p, uint32_t v)
+{
+	p[0] = v & 0xFF;
+	p[1] = (v >> 8) & 0xFF;
+	p[2] = (v >> 16) & 0xFF;
+	p[3] = (v >> 24) & 0xFF;
+}
+
+// Appends to buffer the BGZF block of the n (at most BGZF_BLOCK_SIZE) characters of data
+void compressBGZFBlock(struct text_buffer *buffer, const char *data, size_t n, struct bgzf_compressor *compressor)
+{
+	z_stream *stream = &(compressor->stream);
+	uint8_t *block;
+	size_t size;
+
+	if (!compressor->ready) {
+		if (deflateInit2(stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			fprintf(stderr, "ERROR: memory not available to compress the pileup.\n");
+			exit(1);
+		}
+		compressor->ready = 1;
+	} else {
+		deflateReset(stream);
+	}
+	block = (uint8_t *)bufferReserve(buffer, BGZF_MAX_BLOCK_SIZE);
+	stream->next_in = (Bytef *)data;
+	stream->avail_in = n;
+	stream->next_out = block + BGZF_HEADER_SIZE;
+	stream->avail_out = BGZF_MAX_BLOCK_SIZE - BGZF_HEADER_SIZE - 8;
+	if (deflate(stream, Z_FINISH) != Z_STREAM_END) {
+		fprintf(stderr, "ERROR: pileup compression failed.\n");
+		exit(1);
+	}
+	size = BGZF_HEADER_SIZE + stream->total_out + 8;
+	memcpy(block, bgzf_header, BGZF_HEADER_SIZE);
+	block[16] = (size - 1) & 0xFF;
+	block[17] = (size - 1) >> 8;
+	putLE32(block + size - 8, crc32(crc32(0L, NULL, 0), (const Bytef *)data, n));
+	putLE32(block + size - 4, n);
+	buffer->length += size;
+}
+
+// Appends to buffer the BGZF blocks of the length characters of data, saving the offset
+// of each block in offsets if not NULL
+void compressBGZF(struct text_buffer *buffer, const char *data, size_t length, size_t *offsets, struct bgzf_compressor *compressor)
+{
+	size_t i;
+	for (i = 0; i < length; i += BGZF_BLOCK_SIZE) {
+		if (offsets != NULL) {
+			offsets[i / BGZF_BLOCK_SIZE] = buffer->length;
+		}
+		compressBGZFBlock(buffer, data + i, (length - i < BGZF_BLOCK_SIZE ? length - i : BGZF_BLOCK_SIZE), compressor);
+	}
+}
+
+// Virtual offset of character i of a text compressed with the block offsets, length
+// being the size of the compressed text
+static inline uint64_t getVirtualOffset(const size_t *offsets, size_t i, size_t text_length, size_t length)
+{
+	if (i == text_length) {
+		return ((uint64_t)length << 16);
+	}
+	return (((uint64_t)offsets[i / BGZF_BLOCK_SIZE] << 16) | (i % BGZF_BLOCK_SIZE));
+}
+
+// Smallest bin of the binning index containing the 0-based positions [beg,end)
+static inline uint32_t getTabixBin(uint32_t beg, uint32_t end)
+{
+	int shift, offset;
+	end--;
+	for (shift = TABIX_WINDOW_SHIFT, offset = TABIX_WINDOW_BIN; shift < 29; shift += 3, offset = (offset - 1) >> 3) {
+		if ((beg >> shift) == (end >> shift)) {
+			return (offset + (beg >> shift));
+		}
+	}
+	return (0);
+}
+
+static inline uint32_t parseUInt(const char **p)
+{
+	uint32_t v = 0;
+	for (; **p >= '0' && **p <= '9'; (*p)++) {
+		v = v * 10 + (**p - '0');
+	}
+	return (v);
+}
+
+// Compresses the pileup rows of the output of a region, on a chromosome name of chr_length
+// characters, and records their segments for the index, the rows having the end column
+// after pos if end_column is set
+void compressPileupOutput(struct region_output *output, int chr_length, int end_column, struct bgzf_compressor *compressor)
+{
+	struct text_buffer compressed = {NULL, 0, 0};
+	struct pileup_segment *segment = NULL;
+	const char *text = output->all.data;
+	const char *p, *line_end;
+	size_t *offsets, i, next;
+	uint32_t pos, end, bin;
+
+	if (output->all.length == 0) {
+		return;
+	}
+	offsets = (size_t *)malloc(sizeof(size_t) * (output->all.length / BGZF_BLOCK_SIZE + 1));
+	compressBGZF(&compressed, text, output->all.length, offsets, compressor);
+
+	for (i = 0; i < output->all.length; i = next) {
+		line_end = memchr(text + i, '\n', output->all.length - i);
+		next = (line_end != NULL ? line_end - text + 1 : output->all.length);
+		p = text + i + chr_length + 1;
+		pos = parseUInt(&p);
+		end = pos;
+		if (end_column) {
+			p++;
+			end = parseUInt(&p);
+		}
+		bin = getTabixBin(pos - 1, end);
+		if (segment == NULL || bin != segment->bin) {
+			if (output->segments_length == output->segments_size) {
+				output->segments_size = output->segments_size ? output->segments_size * 2 : 16;
+				output->segments = (struct pileup_segment *)realloc(output->segments, sizeof(struct pileup_segment) * output->segments_size);
+			}
+			segment = &(output->segments[output->segments_length++]);
+			segment->bin = bin;
+			segment->beg = pos - 1;
+			segment->voffset_beg = getVirtualOffset(offsets, i, output->all.length, compressed.length);
+		}
+		segment->end = end;
+		segment->voffset_end = getVirtualOffset(offsets, next, output->all.length, compressed.length);
+	}
+
+	free(offsets);
+	free(output->all.data);
+	output->all = compressed;
+}
+
+// Rows of the compressed pileup in a bin of a sequence
+struct tabix_bin {
+	uint64_t *chunks;       // pairs of virtual offsets of the start and end of the rows
+	int chunks_length;
+	int chunks_size;
+};
+
+// 16 kb window of a sequence, with the bin of the rows within it
+struct tabix_window {
+	struct tabix_bin bin;
+	uint64_t offset;        // virtual offset of the first row overlapping the window, 0 if none
+};
+
+struct tabix_ref {
+	char *name;
+	struct tabix_window *windows;
+	int windows_length;
+	int windows_size;
+	struct tabix_bin *wide_bins;   // bins of the rows spanning several windows, NULL if none
+	uint32_t beg;           // start of the last row
+};
+
+// Tabix index of the compressed pileup, valid only if the rows are sorted by position
+struct tabix_index {
+	struct tabix_ref *refs;
+	int length;
+	int size;
+	int sorted;
+};
+
+void initTabixIndex(struct tabix_index *index)
+{
+	memset(index, 0, sizeof(struct tabix_index));
+	index->sorted = 1;
+}
+
+void destroyTabixIndex(struct tabix_index *index)
+{
+	int i, w;
+	for (i = 0; i < index->length; i++) {
+		for (w = 0; w < index->refs[i].windows_length; w++) {
+			free(index->refs[i].windows[w].bin.chunks);
 		}
-
-		if (control == 0) {
-			// count the number of columns
-			for (i = 0; i < strlen(line); i++) {
-				if (strncmp(&line[i], sep, 1) == 0) {
-					columns++;
-				}
+		if (index->refs[i].wide_bins != NULL) {
+			for (w = 0; w < TABIX_WINDOW_BIN; w++) {
+				free(index->refs[i].wide_bins[w].chunks);
 			}
-			columns++;
-			control = 1;
+			free(index->refs[i].wide_bins);
 		}
+		free(index->refs[i].windows);
+		free(index->refs[i].name);
+	}
+	free(index->refs);
+	initTabixIndex(index);
+}
 
-		// tokenize a line
-		char *str_tokens[columns];
-		char *pch;
-		pch = strtok(line, "\t");
-		i = 0;
-		while (pch != NULL) {
-			str_tokens[i++] = pch;
-			pch = strtok(NULL, "\t");
+// Adds the chunk [beg,end) to bin, chunks ending in the block where the next one starts
+// being merged, as tabix does
+void addTabixChunk(struct tabix_bin *bin, uint64_t beg, uint64_t end)
+{
+	if (bin->chunks_length > 0 && (bin->chunks[2 * bin->chunks_length - 1] >> 16) == (beg >> 16)) {
+		bin->chunks[2 * bin->chunks_length - 1] = end;
+	} else {
+		if (bin->chunks_length == bin->chunks_size) {
+			bin->chunks_size = bin->chunks_size ? bin->chunks_size * 2 : 4;
+			bin->chunks = (uint64_t *)realloc(bin->chunks, sizeof(uint64_t) * 2 * bin->chunks_size);
 		}
+		bin->chunks[2 * bin->chunks_length] = beg;
+		bin->chunks[2 * bin->chunks_length + 1] = end;
+		bin->chunks_length++;
+	}
+}
 
-		if (i < 5) {
-			fprintf(stderr, "ERROR: at line %d the number of columns is not correct (at least 3 columns required).\n", line_numb);
-			exit(1);
-		}
+// Adds the segments of the output of a region on chr, written at offset
+void addTabixSegments(struct tabix_index *index, char *chr, struct region_output *output, uint64_t offset)
+{
+	struct tabix_ref *ref;
+	struct tabix_bin *bin;
+	struct pileup_segment *segment;
+	uint64_t beg, end;
+	int i, w, last;
 
-		struct snps_t *current_elem = (struct snps_t *)malloc(sizeof(struct snps_t));
-		int size;
-		current_elem->chr = (char*)malloc(strlen(str_tokens[0]) + 1);
-		strcpy(current_elem->chr, str_tokens[0]);
-		current_elem->pos = strtol(str_tokens[1], &pch, 10);
-		// check correct conversion
-		sprintf(stmp, "%u", current_elem->pos);
-		if (strncmp(stmp, str_tokens[1], strlen(stmp)) != 0) {
-			fprintf(stderr, "ERROR: genomic position at line %d is not valid.\n", line_numb);
-			exit(1);
+	if (output->segments_length == 0) {
+		return;
+	}
+	if (index->length == 0 || strcmp(index->refs[index->length - 1].name, chr) != 0) {
+		for (i = 0; i < index->length; i++) {
+			if (strcmp(index->refs[i].name, chr) == 0) {
+				index->sorted = 0;
+			}
 		}
+		if (index->length == index->size) {
+			index->size = index->size ? index->size * 2 : 64;
+			index->refs = (struct tabix_ref *)realloc(index->refs, sizeof(struct tabix_ref) * index->size);
+		}
+		ref = &(index->refs[index->length++]);
+		memset(ref, 0, sizeof(struct tabix_ref));
+		ref->name = (char *)malloc(strlen(chr) + 1);
+		strcpy(ref->name, chr);
+	}
+	ref = &(index->refs[index->length - 1]);
 
-		current_elem->rsid = (char*)malloc(strlen(str_tokens[2]) + 1);
-		strcpy(current_elem->rsid, str_tokens[2]);
-		current_elem->ref = (char*)malloc(strlen(str_tokens[3]) + 1);
-		strcpy(current_elem->ref, str_tokens[3]);
-		current_elem->alt = (char*)malloc(strlen(str_tokens[4]) + 1);
-		strcpy(current_elem->alt, str_tokens[4]);
-
-		// check ordering
-		if (strcmp(current_elem->chr, prev_chr) != 0) {
-			i = 0;
-			while (VCF_CHR[i] != NULL) {
-				if (strcmp(VCF_CHR[i], current_elem->chr) == 0) {
-					fprintf(stderr, "ERROR: chromosomes are not ordered (line %d).\n", line_numb);
-					exit(1);
-				}
-				i++;
+	for (i = 0; i < output->segments_length; i++) {
+		segment = &(output->segments[i]);
+		if (segment->beg < ref->beg || segment->end > TABIX_MAX_POSITION) {
+			index->sorted = 0;
+			return;
+		}
+		ref->beg = segment->beg;
+		last = (segment->end - 1) >> TABIX_WINDOW_SHIFT;
+		if (last >= ref->windows_size) {
+			ref->windows_size = (last + 1 > 2 * ref->windows_size ? last + 1 : 2 * ref->windows_size);
+			ref->windows = (struct tabix_window *)realloc(ref->windows, sizeof(struct tabix_window) * ref->windows_size);
+		}
+		for (; ref->windows_length <= last; ref->windows_length++) {
+			memset(&(ref->windows[ref->windows_length]), 0, sizeof(struct tabix_window));
+		}
+		beg = segment->voffset_beg + (offset << 16);
+		end = segment->voffset_end + (offset << 16);
+		for (w = segment->beg >> TABIX_WINDOW_SHIFT; w <= last; w++) {
+			if (ref->windows[w].offset == 0) {
+				ref->windows[w].offset = beg;
 			}
-			sprintf(prev_chr, "%s", current_elem->chr);
-			VCF_CHR[idx_chr] = (char *)malloc(sizeof(char) * strlen(current_elem->chr) + 1);
-			strcpy(VCF_CHR[idx_chr], current_elem->chr);
-			subSlash(VCF_CHR[idx_chr]);
-			idx_chr++;
-			prev_pos = 0;
+		}
+		if (segment->bin >= TABIX_WINDOW_BIN) {
+			bin = &(ref->windows[segment->bin - TABIX_WINDOW_BIN].bin);
 		} else {
-			if (current_elem->pos <= prev_pos) {
-				fprintf(stderr, "ERROR: entries are not positionally ordered (line %d).\n", line_numb);
-				exit(1);
+			if (ref->wide_bins == NULL) {
+				ref->wide_bins = (struct tabix_bin *)calloc(TABIX_WINDOW_BIN, sizeof(struct tabix_bin));
 			}
-
-			prev_pos = current_elem->pos;
+			bin = &(ref->wide_bins[segment->bin]);
 		}
+		addTabixChunk(bin, beg, end);
+	}
+}
 
-		if (current_elem->pos < 0) {
-			fprintf(stderr, "ERROR: position at line %d should be positive.\n", line_numb);
-			exit(1);
+static inline void bufferPutInt32(struct text_buffer *buffer, int32_t v)
+{
+	putLE32((uint8_t *)bufferReserve(buffer, 4), (uint32_t)v);
+	buffer->length += 4;
+}
+
+static inline void bufferPutUInt64(struct text_buffer *buffer, uint64_t v)
+{
+	uint8_t *p = (uint8_t *)bufferReserve(buffer, 8);
+	putLE32(p, (uint32_t)v);
+	putLE32(p + 4, (uint32_t)(v >> 32));
+	buffer->length += 8;
+}
+
+void bufferPutTabixBin(struct text_buffer *buffer, uint32_t id, const struct tabix_bin *bin)
+{
+	int c;
+	bufferPutInt32(buffer, id);
+	bufferPutInt32(buffer, bin->chunks_length);
+	for (c = 0; c < 2 * bin->chunks_length; c++) {
+		bufferPutUInt64(buffer, bin->chunks[c]);
+	}
+}
+
+// Writes the index in tabix format, the end of the rows being in column 3 if end_column
+// is set, returns 0 if the file cannot be written
+int writeTabixIndex(char *file_name, struct tabix_index *index, int end_column, struct bgzf_compressor *compressor)
+{
+	struct text_buffer raw = {NULL, 0, 0};
+	struct text_buffer compressed = {NULL, 0, 0};
+	struct tabix_ref *ref;
+	uint64_t offset;
+	int i, w, n;
+	FILE *file;
+
+	memcpy(bufferReserve(&raw, 4), "TBI\1", 4);
+	raw.length += 4;
+	bufferPutInt32(&raw, index->length);
+	bufferPutInt32(&raw, 0);   // generic format
+	bufferPutInt32(&raw, 1);   // sequence column
+	bufferPutInt32(&raw, 2);   // start column
+	bufferPutInt32(&raw, end_column ? 3 : 2);   // end column
+	bufferPutInt32(&raw, '#'); // comment lines
+	bufferPutInt32(&raw, 1);   // header lines
+	for (i = n = 0; i < index->length; i++) {
+		n += strlen(index->refs[i].name) + 1;
+	}
+	bufferPutInt32(&raw, n);
+	for (i = 0; i < index->length; i++) {
+		n = strlen(index->refs[i].name) + 1;
+		memcpy(bufferReserve(&raw, n), index->refs[i].name, n);
+		raw.length += n;
+	}
+	for (i = 0; i < index->length; i++) {
+		ref = &(index->refs[i]);
+		for (w = n = 0; w < ref->windows_length; w++) {
+			n += (ref->windows[w].bin.chunks_length > 0);
 		}
-		if (strcmp(current_elem->ref, strA) != 0 && strcmp(current_elem->ref, strC) != 0 && strcmp(current_elem->ref, strG) != 0 && strcmp(current_elem->ref, strT) != 0) {
-			fprintf(stderr, "ERROR: reference position at line %d is not a single base equal to A, C, G or T.\n", line_numb);
-			exit(1);
+		for (w = 0; ref->wide_bins != NULL && w < TABIX_WINDOW_BIN; w++) {
+			n += (ref->wide_bins[w].chunks_length > 0);
 		}
-		if (strcmp(current_elem->alt, strA) != 0 && strcmp(current_elem->alt, strC) != 0 && strcmp(current_elem->alt, strG) != 0 && strcmp(current_elem->alt, strT) != 0) {
-			fprintf(stderr, "ERROR: alternative position at line %d is not a single base equal to A, C, G or T.\n", line_numb);
-			exit(1);
+		bufferPutInt32(&raw, n);
+		for (w = 0; w < ref->windows_length; w++) {
+			if (ref->windows[w].bin.chunks_length > 0) {
+				bufferPutTabixBin(&raw, TABIX_WINDOW_BIN + w, &(ref->windows[w].bin));
+			}
+		}
+		for (w = 0; ref->wide_bins != NULL && w < TABIX_WINDOW_BIN; w++) {
+			if (ref->wide_bins[w].chunks_length > 0) {
+				bufferPutTabixBin(&raw, w, &(ref->wide_bins[w]));
+			}
+		}
+		// linear index, windows without rows taking the offset of the previous one
+		bufferPutInt32(&raw, ref->windows_length);
+		for (w = 0, offset = 0; w < ref->windows_length; w++) {
+			if (ref->windows[w].offset != 0) {
+				offset = ref->windows[w].offset;
+			}
+			bufferPutUInt64(&raw, offset);
 		}
+	}
 
-		snps->info[index] = current_elem;
-		index++;
-		line_numb++;
+	compressBGZF(&compressed, raw.data, raw.length, NULL, compressor);
+	free(raw.data);
+	file = fopen(file_name, "wb");
+	if (file == NULL) {
+		free(compressed.data);
+		return (0);
 	}
+	fwrite(compressed.data, 1, compressed.length, file);
+	fwrite(bgzf_eof, 1, sizeof(bgzf_eof), file);
+	fclose(file);
+	free(compressed.data);
+	return (1);
+}
 
-	return (snps);
+// Index of the first SNP to check for a region, advancing from the index of the
+// previous region exactly as the cursor of printTargetRegionSNVsPileup does
+int getRegionSNPIndex(struct snps_info *snps, struct target_t *region, int j)
+{
+	if (j < (snps->length - 1)) {
+		while (getChrPos(region->chr) > getChrPos(snps->info[j]->chr) ||
+		        (strcmp(region->chr, snps->info[j]->chr) == 0 && region->from > snps->info[j]->pos)) {
+			j++;
+			if (j == (snps->length) - 1) {
+				break;
+			}
+		}
+	}
+	return (j);
 }
 
+// Columns of the pileup file after chr, pos and end
+const char *getPileupColumnsALL(int mode, int strand_bias)
+{
+	if (mode == 1 || mode == 4)
+		if (strand_bias == 1) {
+			return ("ref\tA\tC\tG\tT\taf\tcov\tArs\tCrs\tGrs\tTrs\n");
+		} else {
+			return ("ref\tA\tC\tG\tT\taf\tcov\n");
+		}
 
-///////////////////////////////////////////////////////////
-// Print functions
-///////////////////////////////////////////////////////////
+	if (mode == 5) {
+		return ("ref\tA\tC\tG\tT\taf\tcov\trsid\n");
+	}
+
+	if (mode == 6) {
+		return ("ref\tcov\tCountA\tFracA\tStrandA\tCountC\tFracC\tStrandC\tCountG\tFracG\tStrandG\tCountT\tFracT\tStrandT\n");
+	}
+	return (NULL);
+}
 
-void printTargetRegionSNVsPileup(FILE *outfileSNPs, FILE *outfileSNVs, FILE *outfileALL, FILE *outfileDUP, struct target_info *target_regions,
-                                 struct snps_info *snps, struct input_args *arguments, int indexInit, int indexEnd)
+// Appends the header line of the pileup file to buffer, with the end column if end_column is set
+void getPileupHeaderALL(struct text_buffer *buffer, int mode, int strand_bias, int end_column)
 {
-	int i, r, c, alt, altG, ref, cov, covG, printID, postmp, ctrl;
-	float af, afG;
-	int j = 0;
-	char *alt_base = (char*)malloc(2 * sizeof(char));
-	char genotype[5];
-	double z, pval;
+	const char *columns = getPileupColumnsALL(mode, strand_bias);
+	if (columns != NULL) {
+		bufferPrintf(buffer, "chr\tpos\t%s%s", end_column ? "end\t" : "", columns);
+	}
+}
+
+void printPileupHeaderALL(FILE *outfileALL, int mode, int strand_bias, int end_column)
+{
+	struct text_buffer header = {NULL, 0, 0};
+	getPileupHeaderALL(&header, mode, strand_bias, end_column);
+	writeBuffer(&header, outfileALL);
+}
 
+// Headers of the output files, the one of the pileup file only if outfileALL is not NULL
+void printPileupHeaders(FILE *outfileSNPs, FILE *outfileSNVs, FILE *outfileALL, struct input_args *arguments)
+{
 	if (arguments->mode == 0 || arguments->mode == 1 || arguments->mode == 2) {
 		if (arguments->genotype == 0) {
 			fprintf(outfileSNPs, "chr\tpos\trsid\tref\talt\tA\tC\tG\tT\taf\tcov\n");
@@ -1630,53 +4330,75 @@ void printTargetRegionSNVsPileup(FILE *outfileSNPs, FILE *outfileSNVs, FILE *out
 		}
 	}
 
-	if (arguments->mode == 1 || arguments->mode == 4)
-		if (arguments->strand_bias == 1) {
-			fprintf(outfileALL, "chr\tpos\tref\tA\tC\tG\tT\taf\tcov\tArs\tCrs\tGrs\tTrs\n");
-		} else {
-			fprintf(outfileALL, "chr\tpos\tref\tA\tC\tG\tT\taf\tcov\n");
-		}
-
-	if (arguments->mode == 5) {
-		fprintf(outfileALL, "chr\tpos\tref\tA\tC\tG\tT\taf\tcov\trsid\n");
+	if (outfileALL != NULL) {
+		printPileupHeaderALL(outfileALL, arguments->mode, arguments->strand_bias, arguments->ref_block >= 0);
 	}
+}
 
-	if (arguments->mode == 6) {
-		fprintf(outfileALL, "chr\tpos\tref\tcov\tCountA\tFracA\tStrandA\tCountC\tFracC\tStrandC\tCountG\tFracG\tStrandG\tCountT\tFracT\tStrandT\n");
-	}
+// Prints the rows of regions [indexInit,indexEnd) in the output buffers. snp_index is the
+// position in the SNPs list, carried across calls on consecutive regions. The statistics
+// of the positions are computed a block at a time in stats.
+void printTargetRegionSNVsPileup(struct region_output *output, struct target_info *target_regions,
+                                 struct snps_info *snps, struct input_args *arguments, int indexInit, int indexEnd, int *snp_index,
+                                 struct pos_stats *stats)
+{
+	int i, k, r, c, alt, altG, ref, cov, covG, printID, postmp, ctrl, length, chr_length;
+	float af, afG;
+	struct pos_pileup counts;
+	int j = *snp_index;
+	char genotype[5];
+	char *chr;
+	double z, pval;
+	pileup_emitter emit_pileup = NULL;
+	struct ref_block block = {0, 0, 0, 0};
+	struct pos_stats *single = NULL;
+	int end_column = (arguments->ref_block >= 0);
 
 	printID = 0;
+	if (output->columns != NULL) {
+		emit_pileup = emitBinaryRow;
+	} else if (arguments->mode == 1 || arguments->mode == 4) {
+		emit_pileup = emitPileupRow;
+	} else if (arguments->mode == 6) {
+		emit_pileup = emitFractionsRow;
+	}
+	if (emit_pileup != NULL && end_column) {
+		single = (struct pos_stats *)malloc(sizeof(struct pos_stats));
+	}
 
 
-	// Buffer for pileup writing
-	char file_buffer[CHUNK_SIZE + 1024] ;
-	int buffer_count = 0 ;
 	c = 0;
 
 	for (r = indexInit; r < indexEnd; r++) {
 		i = 0;
-		while (i < target_regions->info[r]->to - target_regions->info[r]->from + 1) {
+		length = target_regions->info[r]->to - target_regions->info[r]->from + 1;
+		chr = target_regions->info[r]->chr;
+		chr_length = strlen(chr);
+		if (output->columns != NULL) {
+			resetPileupColumns(output->columns, getPileupCounters(arguments->mode, arguments->strand_bias));
+		}
+		while (i < length) {
+			k = i % POS_STATS_BLOCK;
+			if (k == 0) {
+				computePosStats(target_regions->info[r]->rdata, target_regions->info[r]->reference, i,
+				                (length - i < POS_STATS_BLOCK ? length - i : POS_STATS_BLOCK), arguments->mode == 6, stats);
+			}
+			getPosCounts(target_regions->info[r]->rdata, i, &counts);
 			if (arguments->mode == 5) {
-				covG = getSum(target_regions->info[r]->rdata, i);
-				altG = getAlternativeSum(target_regions->info[r]->rdata, &(target_regions->info[r]->sequence[i]), i);
+				covG = stats->cov[k];
+				altG = stats->alt_sum[k];
 				afG = 0;
 				if (covG > 0) {
 					afG = ((float)altG) / ((float)covG);
 				}
 
-				fprintf(outfileALL, "%s\t%u\t%c\t%d\t%d\t%d\t%d\t%.6f\t%d\t",
-				        target_regions->info[r]->chr,
-				        target_regions->info[r]->from + i,
-				        target_regions->info[r]->sequence[i],
-				        target_regions->info[r]->rdata->positions[i].A,
-				        target_regions->info[r]->rdata->positions[i].C,
-				        target_regions->info[r]->rdata->positions[i].G,
-				        target_regions->info[r]->rdata->positions[i].T, afG, covG);
+				emitCountsRow(&(output->all), chr, chr_length, target_regions->info[r]->from + i, 0, stats->bases[k], 0,
+				              &counts, afG, covG, 0, '\t');
 
 				printID = 0;
-				if (CheckAlt(target_regions->info[r], i) > 0) {
-					ref = getBaseCount(target_regions->info[r]->rdata, &(target_regions->info[r]->sequence[i]), i);
-					alt = FindAlternative(target_regions->info[r]->rdata, &(target_regions->info[r]->sequence[i]), i, alt_base);
+				if (stats->alt_sum[k] > 0) {
+					ref = stats->ref[k];
+					alt = stats->alt[k];
 					cov = alt + ref;
 					af = 0;
 
@@ -1686,23 +4408,8 @@ void printTargetRegionSNVsPileup(FILE *outfileSNPs, FILE *outfileSNVs, FILE *out
 
 					if (cov >= arguments->mdc) {
 						printID = 1;
-						fprintf(outfileSNVs, "%s\t%u\t%c\t%s\t%d\t%d\t%d\t%d\t%.6f\t%d\t",
-						        target_regions->info[r]->chr,
-						        target_regions->info[r]->from + i,
-						        target_regions->info[r]->sequence[i],
-						        alt_base,
-						        target_regions->info[r]->rdata->positions[i].A,
-						        target_regions->info[r]->rdata->positions[i].C,
-						        target_regions->info[r]->rdata->positions[i].G,
-						        target_regions->info[r]->rdata->positions[i].T,
-						        af, cov);
-						if (arguments->strand_bias == 1) {
-							fprintf(outfileSNVs, "%d\t%d\t%d\t%d\t",
-							        target_regions->info[r]->rdata->positions[i].Asb,
-							        target_regions->info[r]->rdata->positions[i].Csb,
-							        target_regions->info[r]->rdata->positions[i].Gsb,
-							        target_regions->info[r]->rdata->positions[i].Tsb);
-						}
+						emitCountsRow(&(output->snvs), chr, chr_length, target_regions->info[r]->from + i, 0, stats->bases[k],
+						              stats->alt_base[k], &counts, af, cov, arguments->strand_bias, '\t');
 					}
 				}
 			}
@@ -1724,14 +4431,14 @@ void printTargetRegionSNVsPileup(FILE *outfileSNPs, FILE *outfileSNVs, FILE *out
 				if (strcmp(target_regions->info[r]->chr, snps->info[j]->chr) == 0 &&
 				        (i + target_regions->info[r]->from) == snps->info[j]->pos) {
 					if (arguments->mode == 5) {
-						fprintf(outfileALL, "%s\n", snps->info[j]->rsid);
+						bufferPrintf(&(output->all), "%s\n", snps->info[j]->rsid);
 						if (printID == 1) {
-							fprintf(outfileSNVs, "%s\n", snps->info[j]->rsid);
+							bufferPrintf(&(output->snvs), "%s\n", snps->info[j]->rsid);
 						}
 					}
 
-					alt = getBaseCount(target_regions->info[r]->rdata, snps->info[j]->alt, i);
-					ref = getBaseCount(target_regions->info[r]->rdata, snps->info[j]->ref, i);
+					alt = getBaseCount(&counts, snps->info[j]->alt);
+					ref = getBaseCount(&counts, snps->info[j]->ref);
 					cov = alt + ref;
 
 					af = 0;
@@ -1766,21 +4473,21 @@ void printTargetRegionSNVsPileup(FILE *outfileSNPs, FILE *outfileSNVs, FILE *out
 								sprintf(genotype, "0/1");
 							}
 						}
-						fprintf(outfileSNPs, "%s\t%u\t%s\t%s\t%s\t%d\t%d\t%d\t%d\t%.6f\t%d",
+						bufferPrintf(&(output->snps), "%s\t%u\t%s\t%s\t%s\t%d\t%d\t%d\t%d\t%.6f\t%d",
 						        target_regions->info[r]->chr,
 						        target_regions->info[r]->from + i,
 						        snps->info[j]->rsid,
 						        snps->info[j]->ref,
 						        snps->info[j]->alt,
-						        target_regions->info[r]->rdata->positions[i].A,
-						        target_regions->info[r]->rdata->positions[i].C,
-						        target_regions->info[r]->rdata->positions[i].G,
-						        target_regions->info[r]->rdata->positions[i].T,
+						        counts.A,
+						        counts.C,
+						        counts.G,
+						        counts.T,
 						        af, cov);
 						if (arguments->genotype > 0) {
-							fprintf(outfileSNPs, "\t%s\n", genotype);
+							bufferPrintf(&(output->snps), "\t%s\n", genotype);
 						} else {
-							fprintf(outfileSNPs, "\n");
+							bufferPrintf(&(output->snps), "\n");
 						}
 					}
 					j++;
@@ -1797,204 +4504,548 @@ void printTargetRegionSNVsPileup(FILE *outfileSNPs, FILE *outfileSNVs, FILE *out
 
 			if (ctrl == 1) {
 				if (arguments->mode == 5) {
-					fprintf(outfileALL, "\n");
+					bufferPrintf(&(output->all), "\n");
 					if (printID == 1) {
-						fprintf(outfileSNVs, "\n");
+						bufferPrintf(&(output->snvs), "\n");
 					}
 				}
 
-				if (arguments->mode == 1 || arguments->mode == 4) {
-					covG = getSum(target_regions->info[r]->rdata, i);
-					altG = getAlternativeSum(target_regions->info[r]->rdata, &(target_regions->info[r]->sequence[i]), i);
-					afG = 0;
-					if (covG > 0) {
-						afG = ((float)altG) / ((float)covG);
-					}
-
-					buffer_count += sprintf(&file_buffer[buffer_count], "%s\t%u\t%c\t%d\t%d\t%d\t%d\t%.6f\t%d",
-					                        target_regions->info[r]->chr,
-					                        target_regions->info[r]->from + i,
-					                        target_regions->info[r]->sequence[i],
-					                        target_regions->info[r]->rdata->positions[i].A,
-					                        target_regions->info[r]->rdata->positions[i].C,
-					                        target_regions->info[r]->rdata->positions[i].G,
-					                        target_regions->info[r]->rdata->positions[i].T, afG, covG);
-
-					if (arguments->strand_bias == 1) {
-						buffer_count += sprintf(&file_buffer[buffer_count], "\t%d\t%d\t%d\t%d\n",
-						                        target_regions->info[r]->rdata->positions[i].Asb,
-						                        target_regions->info[r]->rdata->positions[i].Csb,
-						                        target_regions->info[r]->rdata->positions[i].Gsb,
-						                        target_regions->info[r]->rdata->positions[i].Tsb);
+				if (single != NULL) {
+					if (isRefBlockPosition(stats, k, &counts, arguments->mode)) {
+						addRefBlockPosition(&block, target_regions->info[r]->from + i, stats->cov[k], output, target_regions->info[r],
+						                    chr_length, emit_pileup, stats, i - k, single, arguments);
 					} else {
-						buffer_count += sprintf(&file_buffer[buffer_count], "\n");
-					}
-					// if the chunk is big enough, write it.
-					if (buffer_count >= CHUNK_SIZE) {
-						fwrite(file_buffer, CHUNK_SIZE, 1, outfileALL);
-						buffer_count -= CHUNK_SIZE;
-						memcpy(file_buffer, &file_buffer[CHUNK_SIZE], buffer_count);
+						flushRefBlock(&block, output, target_regions->info[r], chr_length, emit_pileup, stats, i - k, single, arguments);
+						emit_pileup(output, chr, chr_length, target_regions->info[r]->from + i, 1, &counts, stats, k,
+						            arguments->strand_bias);
 					}
+				} else if (emit_pileup != NULL) {
+					emit_pileup(output, chr, chr_length, target_regions->info[r]->from + i, 0, &counts, stats, k,
+					            arguments->strand_bias);
 				}
 
-				if (arguments->mode == 6) {
-					covG = getSum(target_regions->info[r]->rdata, i);
-					int del = target_regions->info[r]->rdata->positions[i].del;
-					altG = getAlternativeSum(target_regions->info[r]->rdata, &(target_regions->info[r]->sequence[i]), i);
-					afG = 0;
-					if (covG > 0) {
-						afG = ((float)altG) / ((float)covG);
-					}
+				if (arguments->mode == 0 || arguments->mode == 1) {
+					if (stats->alt_sum[k] > 0) {
+						ref = stats->ref[k];
+						alt = stats->alt[k];
+						cov = alt + ref;
+						af = 0;
 
-					double FracA, StrandA;
-					if (target_regions->info[r]->rdata->positions[i].A) {
-						StrandA = (target_regions->info[r]->rdata->positions[i].A - target_regions->info[r]->rdata->positions[i].Asb) / (double) target_regions->info[r]->rdata->positions[i].A;
-					} else {
-						StrandA = 0.0;
-					}
+						if (cov > 0) {
+							af = ((float)alt) / ((float)cov);
+						}
 
-					if (covG) {
-						FracA = target_regions->info[r]->rdata->positions[i].A / (double) covG;
-					} else {
-						FracA = 0.0;
-					}
+						if (cov >= arguments->mdc) {
+							emitCountsRow(&(output->snvs), chr, chr_length, target_regions->info[r]->from + i, 0, stats->bases[k],
+							              stats->alt_base[k], &counts, af, cov, arguments->strand_bias, '\n');
+						}
 
-					double FracC, StrandC;
-					if (target_regions->info[r]->rdata->positions[i].C) {
-						StrandC = (target_regions->info[r]->rdata->positions[i].C - target_regions->info[r]->rdata->positions[i].Csb) / (double) target_regions->info[r]->rdata->positions[i].C;
-					} else {
-						StrandC = 0.0;
 					}
+				}
+			}
+
+
+			i++;
+		}
+		if (single != NULL) {
+			flushRefBlock(&block, output, target_regions->info[r], chr_length, emit_pileup, stats,
+			              (length - 1) - (length - 1) % POS_STATS_BLOCK, single, arguments);
+		}
+		if (output->columns != NULL) {
+			flushPileupColumns(output);
+		}
+	}
+
+	free(single);
+	*snp_index = j;
+}
+
+void printTargetRegionRC(FILE *outfile, struct target_t *elem)
+{
+	fprintf(outfile, "%s\t%u\t%u\t%d\t%d\t%.2f\t%.2f\t%.2f\n", elem->chr, elem->from, elem->to, elem->from_sel, elem->to_sel, elem->read_count_global, elem->read_count, elem->gc);
+}
+
+void printDUPLookupTable(struct lookup_dup *table)
+{
+	int i;
+	for (i = 0; i < table->length; i++) {
+		fprintf(stdout, "%d\t%d\t%d\n", table->covs_down[i], table->covs_up[i], table->thresholds[i]);
+	}
+}
+
+///////////////////////////////////////////////////////////
+// Regions cost model
+///////////////////////////////////////////////////////////
+
+// Estimates the cost of each region as the compressed size of the BAM chunks
+// that have to be fetched for it plus the region length
+void estimateRegionsCost(struct target_info *target_regions, bai_t *idx, int window)
+{
+	int r, n;
+	bai_chunk_t *chunks;
+	struct target_t *region;
+
+	for (r = 0; r < target_regions->length; r++) {
+		region = target_regions->info[r];
+		region->cost = (double)COST_BYTES_PER_BASE * (region->to - region->from + 1);
+		n = bai_query(idx, region->tid, (int)region->from - 1 - window, (int)region->to + window, &chunks);
+		if (n > 0) {
+			region->cost += (double)bai_chunks_size(chunks, n);
+			free(chunks);
+		}
+	}
+}
+
+// Loads the per-region computation times saved by a previous run as regions cost.
+// Returns 1 if the file matches the target regions, 0 otherwise.
+int loadRegionsTimings(char *file_name, struct target_info *target_regions)
+{
+	FILE *file = fopen(file_name, "r");
+	char line[MAX_READ_BUFF];
+	char chr[MAX_READ_BUFF];
+	uint32_t from, to;
+	double elapsed;
+	int r = 0;
+	double *times;
+
+	if (file == NULL) {
+		return (0);
+	}
+	times = (double *)malloc(sizeof(double) * target_regions->length);
+	while (fgets(line, sizeof(line), file) != NULL) {
+		if (line[0] == '#' || strncmp(line, "chr\tfrom", 8) == 0) {
+			continue;
+		}
+		if (r >= target_regions->length ||
+		        sscanf(line, "%s\t%u\t%u\t%lf", chr, &from, &to, &elapsed) != 4 ||
+		        strcmp(chr, target_regions->info[r]->chr) != 0 ||
+		        from != target_regions->info[r]->from || to != target_regions->info[r]->to) {
+			break;
+		}
+		times[r++] = elapsed;
+	}
+	fclose(file);
+	if (r != target_regions->length) {
+		free(times);
+		return (0);
+	}
+	for (r = 0; r < target_regions->length; r++) {
+		target_regions->info[r]->cost = times[r];
+	}
+	free(times);
+	return (1);
+}
+
+void saveRegionsTimings(char *file_name, struct target_info *target_regions)
+{
+	int r;
+	FILE *file = fopen(file_name, "w");
+	if (file == NULL) {
+		fprintf(stderr, "WARNING: cannot write timings file %s.\n", file_name);
+		return;
+	}
+	fprintf(file, "chr\tfrom\tto\ttime\n");
+	for (r = 0; r < target_regions->length; r++) {
+		fprintf(file, "%s\t%u\t%u\t%.6f\n", target_regions->info[r]->chr, target_regions->info[r]->from, target_regions->info[r]->to,
+		        target_regions->info[r]->elapsed);
+	}
+	fclose(file);
+}
+
+double getTime()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec + tv.tv_usec / 1000000.0);
+}
+
+
+///////////////////////////////////////////////////////////
+// Multi-threaded pileup functions
+///////////////////////////////////////////////////////////
+
+// Shared queue handing out regions to the pileup threads in small batches,
+// so that threads hitting high depth regions do not delay the others.
+// Long regions are split in tiles, which are piled up independently on
+// disjoint slices of the region positions.
+struct region_tile {
+	int region;
+	uint32_t beg; // 0-based interval [beg,end) of the tile
+	uint32_t end;
+	double cost;
+	int run;         // first tile of the run handed out with it, in BED order
+	double run_cost; // cost of the run
+};
+
+struct region_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t region_ready; // signaled when a region is completely computed
+	pthread_cond_t memory_free;  // signaled when the memory of a region is released
+	int next;
+	int length;
+	struct region_tile *tiles; // tiles in processing order
+	double batch_cost;         // target cost of a batch
+	size_t memory;             // bytes held by regions not yet written
+	size_t memory_limit;       // 0 for no limit
+	int admitted;              // regions allocated within the memory budget, in BED order
+	int written;               // regions written, i.e. index of the next region to write
+};
+
+// Tiles being sorted by compareTilesCost
+struct region_tile *SORT_TILES;
+
+// Sorts tile indexes by decreasing cost of their run, keeping the tiles of a run
+// together and in BED order
+int compareTilesCost(const void *a, const void *b)
+{
+	int x = *(const int *)a;
+	int y = *(const int *)b;
+	if (SORT_TILES[x].run_cost != SORT_TILES[y].run_cost) {
+		return (SORT_TILES[x].run_cost < SORT_TILES[y].run_cost) ? 1 : -1;
+	}
+	if (SORT_TILES[x].run != SORT_TILES[y].run) {
+		return (SORT_TILES[x].run - SORT_TILES[y].run);
+	}
+	return (x - y);
+}
+
+// Whether the dedup window of next, flanked by window bases, slides from the one of prev
+static int isTileFollowing(struct target_info *target_regions, const struct region_tile *prev, const struct region_tile *next, int window)
+{
+	return (target_regions->info[prev->region]->tid == target_regions->info[next->region]->tid &&
+	        next->beg >= prev->beg && (int64_t)next->beg < (int64_t)prev->end + 2 * window && next->end >= prev->end);
+}
 
-					if (covG) {
-						FracC = target_regions->info[r]->rdata->positions[i].C / (double) covG;
-					} else {
-						FracC = 0.0;
-					}
+// Initializes the queue. Regions longer than tile_length are split in tiles.
+// When sort is set, most expensive tiles are handed out first. With a dedup window
+// (dedup_window >= 0), tiles following each other are grouped in runs of about a batch,
+// handed out whole so that the window of a thread slides along them.
+void initRegionQueue(struct region_queue *queue, struct target_info *target_regions, int cores, int tile_length, int sort, size_t memory_limit, int dedup_window)
+{
+	int i, r, n, run;
+	uint32_t beg, end, length;
+	double total = 0;
+	struct target_t *region;
+	struct region_tile *tiles;
+
+	n = 0;
+	for (r = 0; r < target_regions->length; r++) {
+		region = target_regions->info[r];
+		length = region->to - region->from + 1;
+		region->tiles = 1;
+		if (tile_length > 0 && length > tile_length) {
+			region->tiles = (length + tile_length - 1) / tile_length;
+		}
+		region->tiles_done = 0;
+		region->ready = 0;
+		n += region->tiles;
+	}
 
-					double FracG, StrandG;
-					if (target_regions->info[r]->rdata->positions[i].G) {
-						StrandG = (target_regions->info[r]->rdata->positions[i].G - target_regions->info[r]->rdata->positions[i].Gsb) / (double) target_regions->info[r]->rdata->positions[i].G;
-					} else {
-						StrandG = 0.0;
-					}
+	tiles = (struct region_tile *)malloc(sizeof(struct region_tile) * n);
+	n = 0;
+	for (r = 0; r < target_regions->length; r++) {
+		region = target_regions->info[r];
+		length = region->to - region->from + 1;
+		beg = region->from - 1;
+		while (beg < region->to) {
+			end = (region->tiles == 1 || beg + tile_length > region->to) ? region->to : beg + tile_length;
+			tiles[n].region = r;
+			tiles[n].beg = beg;
+			tiles[n].end = end;
+			tiles[n].cost = region->cost * (end - beg) / length;
+			total += tiles[n].cost;
+			beg = end;
+			n++;
+		}
+	}
+	// small batches keep the threads balanced, but not so small that
+	// the queue lock becomes a point of contention on large BED files
+	queue->batch_cost = total / (cores * REGION_BATCH_DIV);
+	for (i = 0, run = 0; i < n; i++) {
+		if (dedup_window < 0 || i == 0 || i - run >= MAX_REGION_BATCH || tiles[run].run_cost + tiles[i].cost > queue->batch_cost ||
+		        !isTileFollowing(target_regions, &(tiles[i - 1]), &(tiles[i]), dedup_window)) {
+			run = i;
+			tiles[run].run_cost = 0;
+		}
+		tiles[i].run = run;
+		tiles[run].run_cost += tiles[i].cost;
+	}
+	for (i = 0; i < n; i++) {
+		tiles[i].run_cost = tiles[tiles[i].run].run_cost;
+	}
 
-					if (covG) {
-						FracG = target_regions->info[r]->rdata->positions[i].G / (double) covG;
-					} else {
-						FracG = 0.0;
-					}
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->region_ready, NULL);
+	pthread_cond_init(&queue->memory_free, NULL);
+	queue->memory = 0;
+	queue->memory_limit = memory_limit;
+	queue->admitted = 0;
+	queue->written = 0;
+	queue->next = 0;
+	queue->length = n;
+	queue->tiles = tiles;
+	if (sort) {
+		int *order = (int *)malloc(sizeof(int) * n);
+		for (i = 0; i < n; i++) {
+			order[i] = i;
+		}
+		SORT_TILES = tiles;
+		qsort(order, n, sizeof(int), compareTilesCost);
+		queue->tiles = (struct region_tile *)malloc(sizeof(struct region_tile) * n);
+		for (i = 0; i < n; i++) {
+			queue->tiles[i] = tiles[order[i]];
+		}
+		free(order);
+		free(tiles);
+	}
+}
 
-					double FracT, StrandT;
-					if (target_regions->info[r]->rdata->positions[i].T) {
-						StrandT = (target_regions->info[r]->rdata->positions[i].T - target_regions->info[r]->rdata->positions[i].Tsb) / (double) target_regions->info[r]->rdata->positions[i].T;
-					} else {
-						StrandT = 0.0;
-					}
+void destroyRegionQueue(struct region_queue *queue)
+{
+	pthread_mutex_destroy(&queue->lock);
+	pthread_cond_destroy(&queue->region_ready);
+	pthread_cond_destroy(&queue->memory_free);
+	free(queue->tiles);
+}
 
-					if (covG) {
-						FracT = target_regions->info[r]->rdata->positions[i].T / (double) covG;
-					} else {
-						FracT = 0.0;
-					}
-					// chr\tpos\tref\tcov\tCountA\tFracA\tStrandA\tCountC\tFracC\tStrandC\tCountG\tFracG\tStrandG\tCountT\tFracT\tStrandT
-					
-					buffer_count += sprintf(&file_buffer[buffer_count], "%s\t%u\t%c\t%d\t%d\t%.4f\t%.2f\t%d\t%.4f\t%.2f\t%d\t%.4f\t%.2f\t%d\t%.4f\t%.2f\n",
-					                        target_regions->info[r]->chr,
-					                        target_regions->info[r]->from + i,
-					                        target_regions->info[r]->sequence[i],
-					                        covG + del,
-					                        target_regions->info[r]->rdata->positions[i].A,
-					                        FracA,
-					                        StrandA,
-					                        target_regions->info[r]->rdata->positions[i].C,
-					                        FracC,
-					                        StrandC,
-					                        target_regions->info[r]->rdata->positions[i].G,
-					                        FracG,
-					                        StrandG,
-					                        target_regions->info[r]->rdata->positions[i].T,
-					                        FracT,
-					                        StrandT);
-
-					// if the chunk is big enough, write it.
-					if (buffer_count >= CHUNK_SIZE) {
-						fwrite(file_buffer, CHUNK_SIZE, 1, outfileALL);
-						buffer_count -= CHUNK_SIZE;
-						memcpy(file_buffer, &file_buffer[CHUNK_SIZE], buffer_count);
-					}
-				}
+// Gets the next batch of tiles, queue->tiles[start..end], to process: whole runs up to the
+// cost of a batch. Returns 0 when the queue is empty.
+int getRegionBatch(struct region_queue *queue, int *start, int *end)
+{
+	int res = 0, run;
+	double cost = 0;
+	pthread_mutex_lock(&queue->lock);
+	if (queue->next < queue->length) {
+		*start = queue->next;
+		do {
+			run = queue->tiles[queue->next].run;
+			while (queue->next < queue->length && queue->tiles[queue->next].run == run) {
+				cost += queue->tiles[queue->next++].cost;
+			}
+		} while (queue->next < queue->length && queue->next - *start < MAX_REGION_BATCH &&
+		         cost + queue->tiles[queue->next].run_cost <= queue->batch_cost);
+		*end = queue->next - 1;
+		res = 1;
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return (res);
+}
 
-				if (arguments->mode == 0 || arguments->mode == 1) {
-					if (CheckAlt(target_regions->info[r], i) > 0) {
-						ref = getBaseCount(target_regions->info[r]->rdata, &(target_regions->info[r]->sequence[i]), i);
-						alt = FindAlternative(target_regions->info[r]->rdata, &(target_regions->info[r]->sequence[i]), i, alt_base);
-						cov = alt + ref;
-						af = 0;
+// Memory reused by a thread for all the regions it computes
+struct thread_arena {
+	bam_plbuf_t *buf;             // pileup buffer, reset for each tile
+	uint16_t *counts;             // counts block of a region released by the thread, NULL if none
+	size_t counts_length;         // positions of the block
+	ref_packed_t reference;       // reference of the region being formatted
+	struct dedup_window dedup;    // reads of the dedup window
+	struct dedup_stream stream;   // reads of the streaming dedup
+	struct dup_signatures signatures; // reads of a position, for the duplicates lookup table
+	struct pos_stats *stats;      // statistics of the positions being formatted
+	struct pileup_columns columns; // rows of the binary pileup being formatted
+	struct bgzf_compressor compressor; // deflate stream of the compressed pileup
+};
 
-						if (cov > 0) {
-							af = ((float)alt) / ((float)cov);
-						}
+void initThreadArena(struct thread_arena *arena, bam_pileup_f func, void *data)
+{
+	arena->buf = bam_plbuf_init(func, data);
+	arena->counts = NULL;
+	arena->counts_length = 0;
+	ref_packed_init(&(arena->reference));
+	initDedupWindow(&(arena->dedup));
+	initDedupStream(&(arena->stream));
+	initDupSignatures(&(arena->signatures));
+	arena->stats = (struct pos_stats *)malloc(sizeof(struct pos_stats));
+	initPileupColumns(&(arena->columns));
+	initBGZFCompressor(&(arena->compressor));
+}
 
-						if (cov >= arguments->mdc) {
-							fprintf(outfileSNVs, "%s\t%u\t%c\t%s\t%d\t%d\t%d\t%d\t%.6f\t%d",
-							        target_regions->info[r]->chr,
-							        target_regions->info[r]->from + i,
-							        target_regions->info[r]->sequence[i],
-							        alt_base,
-							        target_regions->info[r]->rdata->positions[i].A,
-							        target_regions->info[r]->rdata->positions[i].C,
-							        target_regions->info[r]->rdata->positions[i].G,
-							        target_regions->info[r]->rdata->positions[i].T,
-							        af, cov);
-							if (arguments->strand_bias == 1) {
-								fprintf(outfileSNVs, "\t%d\t%d\t%d\t%d\n",
-								        target_regions->info[r]->rdata->positions[i].Asb,
-								        target_regions->info[r]->rdata->positions[i].Csb,
-								        target_regions->info[r]->rdata->positions[i].Gsb,
-								        target_regions->info[r]->rdata->positions[i].Tsb);
-							} else {
-								fprintf(outfileSNVs, "\n");
-							}
-						}
+void destroyThreadArena(struct thread_arena *arena)
+{
+	bam_plbuf_destroy(arena->buf);
+	free(arena->counts);
+	ref_packed_destroy(&(arena->reference));
+	destroyDedupWindow(&(arena->dedup));
+	destroyDedupStream(&(arena->stream));
+	destroyDupSignatures(&(arena->signatures));
+	free(arena->stats);
+	destroyPileupColumns(&(arena->columns));
+	destroyBGZFCompressor(&(arena->compressor));
+}
 
-					}
-				}
-			}
+// Allocates the pileup data of the 0-based interval [beg,end), reusing the counts block
+// released by the thread if it is large enough
+struct region_data *newRegionData(uint32_t beg, uint32_t end, struct thread_arena *arena)
+{
+	struct region_data *rdata = (struct region_data*)malloc(sizeof(struct region_data));
+	rdata->beg = beg;
+	rdata->end = end;
+	if (arena->counts != NULL && arena->counts_length >= end - beg) {
+		rdata->counts = arena->counts;
+		memset(rdata->counts, 0, (size_t)(end - beg) * POS_COUNTERS * sizeof(uint16_t));
+		arena->counts = NULL;
+	} else {
+		rdata->counts = (uint16_t *)calloc((size_t)(end - beg) * POS_COUNTERS, sizeof(uint16_t));
+	}
+	setPosCountsArrays(&(rdata->positions), rdata->counts, end - beg);
+	rdata->overflow = (struct pos_overflow *)calloc(1, sizeof(struct pos_overflow));
+	pthread_mutex_init(&(rdata->overflow->lock), NULL);
+	rdata->in = NULL;
+	rdata->duptable = NULL;
+	rdata->signatures = NULL;
+	rdata->arguments = NULL;
+	return (rdata);
+}
+
+// Frees the pileup data, keeping its counts block in the thread arena for the next
+// regions (only for untiled regions, so that the arena stays small)
+void releaseRegionData(struct region_data *rdata, struct thread_arena *arena)
+{
+	size_t length = rdata->end - rdata->beg;
+	if (length <= TILE_LENGTH && length > arena->counts_length) {
+		free(arena->counts);
+		arena->counts = rdata->counts;
+		arena->counts_length = length;
+	} else {
+		free(rdata->counts);
+	}
+	pthread_mutex_destroy(&(rdata->overflow->lock));
+	free(rdata->overflow->entries);
+	free(rdata->overflow);
+	free(rdata);
+}
 
+// Memory needed to compute a region: positions counts and packed reference sequence
+size_t getRegionMemory(struct target_t *region)
+{
+	size_t length = (size_t)(region->to - region->from + 1);
+	return (length * POS_COUNTERS * sizeof(uint16_t) + length / 4);
+}
 
-			i++;
+// With a memory budget, regions are allocated in BED order and only when they fit in
+// the budget. The next region to write and a region arriving when nothing else is
+// held are always admitted, so that the output (and thus the release of memory) can
+// progress. Gets the pileup data of the region of a tile, allocating it for the first tile.
+struct region_data *startRegionTile(struct region_queue *queue, struct target_t *region, int index, struct thread_arena *arena)
+{
+	struct region_data *rdata;
+	size_t memory;
+	if (region->tiles == 1 && queue->memory_limit == 0) {
+		region->rdata = newRegionData(region->from - 1, region->to, arena);
+		return (region->rdata);
+	}
+	pthread_mutex_lock(&queue->lock);
+	if (region->rdata == NULL && queue->memory_limit > 0) {
+		memory = getRegionMemory(region);
+		while (region->rdata == NULL && (index != queue->admitted || (index != queue->written && queue->memory > 0 &&
+		                                  queue->memory + memory > queue->memory_limit))) {
+			pthread_cond_wait(&queue->memory_free, &queue->lock);
 		}
+		if (region->rdata == NULL) {
+			region->memory = memory;
+			queue->memory += memory;
+			queue->admitted++;
+			// the following region (or other tiles of this one) may be waiting
+			pthread_cond_broadcast(&queue->memory_free);
+		}
+	}
+	if (region->rdata == NULL) {
+		region->rdata = newRegionData(region->from - 1, region->to, arena);
 	}
+	rdata = region->rdata;
+	pthread_mutex_unlock(&queue->lock);
+	return (rdata);
+}
 
-	if (buffer_count > 0) {
-		fwrite(file_buffer, 1, buffer_count, outfileALL);
+// Accounts a computed tile of a region. Returns 1 if it was the last tile of the region.
+int finishRegionTile(struct region_queue *queue, struct target_t *region, double elapsed)
+{
+	int last;
+	if (region->tiles == 1) {
+		region->tiles_done = 1;
+		region->elapsed = elapsed;
+		return (1);
 	}
+	pthread_mutex_lock(&queue->lock);
+	region->tiles_done++;
+	region->elapsed += elapsed;
+	last = (region->tiles_done == region->tiles);
+	pthread_mutex_unlock(&queue->lock);
+	return (last);
+}
 
+// Marks a region as completely computed, ready to be printed
+// Update the memory held by a region (e.g. once its counts are replaced by the
+// formatted output), waking up the threads waiting for memory when it decreases
+void setRegionMemory(struct region_queue *queue, struct target_t *region, size_t memory)
+{
+	if (queue->memory_limit == 0) {
+		return;
+	}
+	pthread_mutex_lock(&queue->lock);
+	queue->memory = queue->memory - region->memory + memory;
+	if (memory < region->memory) {
+		pthread_cond_broadcast(&queue->memory_free);
+	}
+	region->memory = memory;
+	pthread_mutex_unlock(&queue->lock);
 }
 
-void printTargetRegionRC(FILE *outfile, struct target_t *elem)
+// Mark the regions before index as written
+void setRegionsWritten(struct region_queue *queue, int index)
 {
-	fprintf(outfile, "%s\t%u\t%u\t%d\t%d\t%.2f\t%.2f\t%.2f\n", elem->chr, elem->from, elem->to, elem->from_sel, elem->to_sel, elem->read_count_global, elem->read_count, elem->gc);
+	pthread_mutex_lock(&queue->lock);
+	queue->written = index;
+	pthread_cond_broadcast(&queue->memory_free);
+	pthread_mutex_unlock(&queue->lock);
 }
 
-void printDUPLookupTable(struct lookup_dup *table)
+void setRegionReady(struct region_queue *queue, struct target_t *region)
 {
-	int i;
-	for (i = 0; i < table->length; i++) {
-		fprintf(stdout, "%d\t%d\t%d\n", table->covs_down[i], table->covs_up[i], table->thresholds[i]);
+	pthread_mutex_lock(&queue->lock);
+	region->ready = 1;
+	pthread_cond_broadcast(&queue->region_ready);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+// Waits until a region is completely computed
+void waitRegionReady(struct region_queue *queue, struct target_t *region)
+{
+	pthread_mutex_lock(&queue->lock);
+	while (!region->ready) {
+		pthread_cond_wait(&queue->region_ready, &queue->lock);
 	}
+	pthread_mutex_unlock(&queue->lock);
 }
 
-///////////////////////////////////////////////////////////
-// Multi-threaded pileup functions
-///////////////////////////////////////////////////////////
+// Sets BAM reference ids of the regions, checking their compatibility with the BAM file
+int setRegionsBAMIds(struct target_info *target_regions, bam_header_t *header)
+{
+	int r, beg, end;
+	char s[1000];
+	struct target_t *region;
+
+	for (r = 0; r < target_regions->length; r++) {
+		region = target_regions->info[r];
+		snprintf(s, sizeof(s), "%s:%u-%u", region->chr, region->from, region->to);
+		bam_parse_region(header, s, &(region->tid), &beg, &end);
+		if (region->tid < 0 || end < 0 || beg < 0) {
+			fprintf(stderr, "ERROR: genomic region %s not compatible with BAM file.\n", s);
+			return (1);
+		}
+	}
+	return (0);
+}
 
 struct args_thread {
-	int start;
-	int end;
+	struct region_queue *queue;
 	struct lookup_dup *duptable;
 	struct target_info *target_regions;
+	struct snps_info *snps;
+	bai_t *idx;          // BAM index shared by all threads
+	bamr_pool_t *pool;   // helper threads inflating BGZF blocks, NULL if not used
+	bamr_prefetch_t *prefetch; // helper thread reading ahead the next tiles, NULL if not used
+	bamr_cache_t *cache; // inflated blocks shared by all threads, NULL if not used
+	ref_t *ref;       // reference shared by all threads, NULL to use faidx
 	char bam[1000];
 	char fasta[1000];
 	struct input_args *arguments;
@@ -2003,146 +5054,151 @@ struct args_thread {
 void *PileUp(void *args)
 {
 	struct args_thread *foo = (struct args_thread *)args;
-	int i, r, ref, len, length, count, iter, hash_res, hash_res1, error, ll;
+	int k, p, len, length, count, start, end, window;
+	double time_start;
 	char s[200];
-	char stmp[200];
-	struct region_data *tmp;
-	bam_plbuf_t *buf;
+	char *sequence;
+	struct region_data tile_data;
+	struct region_data *tmp = &tile_data;
+	struct region_data *rdata;
+	struct region_tile *tile;
+	struct target_t *region;
+	struct thread_arena arena;
 	faidx_t *fasta;
 
-	map_t *hmap;
-	map_t *hmap_dups;
-	dedup_struct_t* value;
-	dup_struct_t* dup_value;
-	char coords[KEY_MAX_LENGTH];
-	fetch_reads_t *buff_data;
-
-	samfile_t *in = samopen(foo->bam, "rb", 0);
-	bam_index_t *idx = bam_index_load(foo->bam);
-
-	fasta = fai_load(foo->fasta);
-
-	for (r = foo->start; r <= foo->end; r++) {
-		tmp = (struct region_data*)malloc(sizeof(struct region_data));
-		tmp->beg = 0;
-		tmp->end = 0x7fffffff;
-		tmp->in = in;
-		s[0] = '\0';
-		sprintf(stmp, "%s", foo->target_regions->info[r]->chr);
-		strcat(s, stmp);
-		strcat(s, ":");
-		sprintf(stmp, "%u", foo->target_regions->info[r]->from);
-		strcat(s, stmp);
-		strcat(s, "-");
-		sprintf(stmp, "%u", foo->target_regions->info[r]->to);
-		strcat(s, stmp);
-
-		//fprintf(stderr,"%s\n",s);
-
-		bam_parse_region(tmp->in->header, s, &ref, &(tmp->beg), &(tmp->end));
-
-		if (ref < 0 || tmp->end < 0 || tmp->beg < 0) {
-			fprintf(stderr, "ERROR: genomic region %s not compatible with BAM file.\n", s);
-			exit(1);
-		}
+	// each thread has its own handle of the BAM file, the index and the header are
+	// loaded once by the main thread (alignments are read only through the index)
+	bamr_t *in = bamr_open(foo->bam, foo->pool, foo->cache);
+	bai_t *idx = foo->idx;
+	if (in == NULL) {
+		fprintf(stderr, "ERROR: Fail to open BAM file.%s\n", foo->bam);
+		exit(1);
+	}
+
+	initThreadArena(&arena, pileup_func, tmp);
+	fasta = NULL;
+	if (foo->ref == NULL) {
+		fasta = fai_load(foo->fasta);
+	}
 
-		foo->target_regions->info[r]->sequence = fai_fetch(fasta, s, &len);
-		if (foo->target_regions->info[r]->sequence != NULL && len > 0) {
-			length = strlen(foo->target_regions->info[r]->sequence);
-			count = 0;
-			while (count < length) {
-				foo->target_regions->info[r]->sequence[count] = toupper(foo->target_regions->info[r]->sequence[count]);
-				count++;
+	while (getRegionBatch(foo->queue, &start, &end)) {
+		for (k = start; k <= end; k++) {
+			// read ahead the data of the next tiles of the batch
+			if (foo->prefetch != NULL) {
+				window = foo->arguments->dedup ? foo->arguments->dedup_window : 0;
+				for (p = (k == start) ? k + 1 : k + foo->arguments->prefetch; p <= end && p <= k + foo->arguments->prefetch; p++) {
+					tile = &(foo->queue->tiles[p]);
+					bamr_prefetch(foo->prefetch, foo->target_regions->info[tile->region]->tid, (int)tile->beg - window, tile->end + window);
+				}
 			}
-		} else {
-			fprintf(stderr, "ERROR: genomic region %s not compatible with FASTA file.\n", s);
-			exit(1);
-		}
 
-		tmp->positions = (struct pos_pileup*)malloc(sizeof(struct pos_pileup) * (tmp->end - tmp->beg));
-		for (i = 0; i < (tmp->end - tmp->beg); i++) {
-			tmp->positions[i].A = tmp->positions[i].C = tmp->positions[i].G = tmp->positions[i].T = 0;
-			tmp->positions[i].Asb = tmp->positions[i].Csb = tmp->positions[i].Gsb = tmp->positions[i].Tsb = 0;
-			tmp->positions[i].del = 0;
-		}
-		tmp->duptable = foo->duptable;
-		tmp->arguments = foo->arguments;
-
-		buf = bam_plbuf_init(pileup_func, tmp);
-
-		if (foo->arguments->dedup == 1) {
-			hmap = hashmap_new();
-			bam_fetch(tmp->in->x.bam, idx, ref, tmp->beg - tmp->arguments->dedup_window, tmp->end + tmp->arguments->dedup_window, hmap, fetch_func_dup);
-
-			ll = hashmap_length(hmap);
-			hmap_dups = hashmap_new();
-			iter = 0;
-			while ((hash_res = hashmap_iterate_external(hmap, iter, (void**)(&value))) != MAP_MISSING) {
-				if (hash_res == MAP_OK) {
-					getKey(value, coords);
-					//fprintf(stderr,"%s %d\n",coords,value->isize);
-					hash_res1 = hashmap_get(hmap_dups, coords, (void**)(&dup_value));
-					if (hash_res1 == MAP_MISSING) {
-						dup_value = malloc(sizeof(dup_struct_t));
-						snprintf(dup_value->key_string, KEY_MAX_LENGTH, "%s", coords);
-						dup_value->bp = value->bp;
-						snprintf(dup_value->name, KEY_MAX_LENGTH, "%s", value->key_string);
-						error = hashmap_put(hmap_dups, dup_value->key_string, dup_value);
-						assert(error == MAP_OK);
-					} else {
-						if (value->bp > dup_value->bp) {
-							dup_value->bp = value->bp;
-							hashmap_remove(hmap, dup_value->name);
-							snprintf(dup_value->name, KEY_MAX_LENGTH, "%s", value->key_string);
-						} else {
-							hashmap_remove(hmap, value->key_string);
-						}
-					}
+			tile = &(foo->queue->tiles[k]);
+			region = foo->target_regions->info[tile->region];
+			time_start = getTime();
+
+			// the tile piles up its own slice of the region positions
+			rdata = startRegionTile(foo->queue, region, tile->region, &arena);
+			tmp->beg = tile->beg;
+			tmp->end = tile->end;
+			slicePosCounts(&(tmp->positions), &(rdata->positions), tile->beg - rdata->beg);
+			tmp->overflow = rdata->overflow;
+			tmp->in = in;
+			tmp->duptable = foo->duptable;
+			tmp->signatures = &(arena.signatures);
+			tmp->arguments = foo->arguments;
+
+			bam_plbuf_reset(arena.buf);
+
+			if (foo->arguments->dedup_stream == 1) {
+				// duplicates are decided while scanning the flanked tile, and the
+				// reads of the tile piled up as soon as they are decided
+				startDedupStream(&(arena.stream), tmp->beg, tmp->end, arena.buf);
+				bamr_fetch(tmp->in, idx, region->tid, (int)tmp->beg - tmp->arguments->dedup_window, tmp->end + tmp->arguments->dedup_window, &(arena.stream), fetch_func_stream);
+				finishDedupStream(&(arena.stream));
+				bam_plbuf_push(0, arena.buf);
+			} else if (foo->arguments->dedup == 1) {
+				// a single fetch over the flanked tile (or the part of it not already
+				// fetched for the previous tile) collects the duplicates info and keeps
+				// the reads of the tile itself
+				fetchDedupWindow(&(arena.dedup), tmp->in, idx, region->tid, (int)tmp->beg - tmp->arguments->dedup_window, tmp->end + tmp->arguments->dedup_window);
+				markWindowDuplicates(&(arena.dedup));
+				pushDedupReads(&(arena.dedup), tmp->beg, tmp->end, arena.buf);
+				bam_plbuf_push(0, arena.buf);
+			} else {
+				bamr_fetch(tmp->in, idx, region->tid, tmp->beg, tmp->end, arena.buf, fetch_func);
+				bam_plbuf_push(0, arena.buf);
+			}
 
-				}
-				iter++;
+			if (!finishRegionTile(foo->queue, region, getTime() - time_start)) {
+				continue;
 			}
 
-			/*iter=0;
-			while((hash_res=hashmap_iterate_external(hmap,iter,(void**)(&value)))!=MAP_MISSING)
-			{
-				if(hash_res==MAP_OK)
-					fprintf(stderr,"ITER %s %d\n",value->key_string,value->isize);
-				iter++;
-			}*/
-			hashmap_destroy(hmap_dups);
-			buff_data = (fetch_reads_t *)malloc(sizeof(fetch_reads_t));
-			buff_data->buf = buf;
-			buff_data->hmap = hmap;
-			bam_fetch(tmp->in->x.bam, idx, ref, tmp->beg, tmp->end, buff_data, fetch_func_dedup);
-			bam_plbuf_push(0, buf);
-			hashmap_destroy(hmap);
-			free(buff_data);
-		} else {
-			bam_fetch(tmp->in->x.bam, idx, ref, tmp->beg, tmp->end, buf, fetch_func);
-			bam_plbuf_push(0, buf);
-		}
+			// all tiles of the region are computed
+			time_start = getTime();
+			sortPosOverflow(rdata);
+			sprintf(s, "%s:%u-%u", region->chr, region->from, region->to);
+			if (foo->ref != NULL) {
+				// the mapped reference returns the sequence already uppercase
+				len = ref_fetch_packed(foo->ref, region->chr, (int)region->from - 1, region->to, &(arena.reference));
+			} else {
+				sequence = fai_fetch(fasta, s, &len);
+				if (sequence != NULL) {
+					length = strlen(sequence);
+					count = 0;
+					while (count < length) {
+						sequence[count] = toupper(sequence[count]);
+						count++;
+					}
+					ref_pack(&(arena.reference), sequence, length);
+					free(sequence);
+				} else {
+					len = -1;
+				}
+			}
+			region->reference = &(arena.reference);
+			if (len <= 0) {
+				fprintf(stderr, "ERROR: genomic region %s not compatible with FASTA file.\n", s);
+				exit(1);
+			}
 
-		bam_plbuf_destroy(buf);
+			if (foo->arguments->mode == 0 || foo->arguments->mode == 1 || foo->arguments->mode == 3) {
+				computeRC(foo->arguments->region_perc, region);
+				computeGCRegion(foo->arguments->region_perc, region);
+			}
 
-		foo->target_regions->info[r]->rdata = tmp;
+			if (foo->arguments->mode != 3) {
+				// format the output rows here, the main thread only writes them
+				region->output = (struct region_output *)calloc(1, sizeof(struct region_output));
+				if (foo->arguments->binary == 1) {
+					region->output->columns = &(arena.columns);
+				}
+				printTargetRegionSNVsPileup(region->output, foo->target_regions, foo->snps, foo->arguments, tile->region, tile->region + 1, &(region->snp_index), arena.stats);
+				region->output->columns = NULL;
+				if (foo->arguments->bgzip == 1) {
+					compressPileupOutput(region->output, strlen(region->chr), foo->arguments->ref_block >= 0, &(arena.compressor));
+				}
+			}
 
-		if (foo->arguments->mode == 0 || foo->arguments->mode == 1 || foo->arguments->mode == 3) {
-			computeRC(foo->arguments->region_perc, foo->target_regions->info[r]);
-			computeGCRegion(foo->arguments->region_perc, foo->target_regions->info[r]);
-		}
+			// counts and reference are no longer needed, only the formatted rows are kept
+			region->rdata = NULL;
+			releaseRegionData(rdata, &arena);
+			region->reference = NULL;
+			if (region->output != NULL) {
+				setRegionMemory(foo->queue, region, region->output->snps.size + region->output->snvs.size + region->output->all.size);
+			} else {
+				setRegionMemory(foo->queue, region, 0);
+			}
 
-		if (foo->arguments->mode == 3) {
-			foo->target_regions->info[r]->rdata = NULL;
-			free(tmp->positions);
-			free(tmp);
+			region->elapsed += getTime() - time_start;
+			setRegionReady(foo->queue, region);
 		}
-
 	}
 
-	fai_destroy(fasta);
-	bam_index_destroy(idx);
-	samclose(in);
+	if (fasta != NULL) {
+		fai_destroy(fasta);
+	}
+	destroyThreadArena(&arena);
+	bamr_close(in);
 }
 
 
@@ -2150,6 +5206,179 @@ void *PileUp(void *args)
 // Main
 ///////////////////////////////////////////////////////////
 
+///////////////////////////////////////////////////////////
+// Binary pileup view
+///////////////////////////////////////////////////////////
+
+// Parses region as chr, chr:from or chr:from-to (from on to the end), chromosome names
+// of the index containing ':' being matched as a whole first. Returns the index of the
+// chromosome, -1 if it is not in the file, -2 if region is not valid.
+int parsePileupRegion(struct pileup_index *index, char *region, uint32_t *from, uint32_t *to)
+{
+	char *colon, end;
+	unsigned int beg, last;
+	int c, n;
+
+	*from = 0;
+	*to = UINT32_MAX;
+	for (c = 0; c < index->chrs_length; c++) {
+		if (strcmp(index->chrs[c], region) == 0) {
+			return (c);
+		}
+	}
+	colon = strrchr(region, ':');
+	if (colon == NULL) {
+		return (-1);
+	}
+	n = sscanf(colon + 1, "%u-%u%c", &beg, &last, &end);
+	if (n == 1) {
+		if (sscanf(colon + 1, "%u%c", &beg, &end) != 1) {
+			return (-2);
+		}
+		last = UINT32_MAX;
+	} else if (n != 2 || beg > last) {
+		return (-2);
+	}
+	*from = beg;
+	*to = last;
+	for (c = 0; c < index->chrs_length; c++) {
+		if (strlen(index->chrs[c]) == (size_t)(colon - region) && strncmp(index->chrs[c], region, colon - region) == 0) {
+			return (c);
+		}
+	}
+	return (-1);
+}
+
+// pacbam view: prints a binary pileup file, or the rows of a region, as the text pileup file
+int viewBinaryPileup(int argc, char *argv[])
+{
+	char *file_name = NULL, *region = NULL;
+	char *bases;
+	unsigned char *compressed = NULL, *raw = NULL;
+	size_t compressed_size = 0, raw_size = 0;
+	uint32_t from = 0, to = UINT32_MAX, pos, *gaps, *columns[POS_COUNTERS];
+	uLongf length;
+	int i, b, c, n, chr = -1;
+	FILE *file;
+	struct pileup_file_header header;
+	struct pileup_block_header block;
+	struct pileup_index index;
+	struct pileup_index_entry *entry;
+	struct pos_pileup counts;
+	struct pos_stats *stats;
+	struct region_output output;
+	pileup_emitter emit;
+
+	for (i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "in=", 3) == 0) {
+			file_name = argv[i] + 3;
+		} else if (strncmp(argv[i], "region=", 7) == 0) {
+			region = argv[i] + 7;
+		} else {
+			fprintf(stderr, "ERROR: input parameters not valid.\n");
+			return (1);
+		}
+	}
+	if (file_name == NULL) {
+		fprintf(stderr, "ERROR: binary pileup file is not specified.\n");
+		return (1);
+	}
+	file = fopen(file_name, "rb");
+	if (file == NULL) {
+		fprintf(stderr, "ERROR: binary pileup file %s does not exist.\n", file_name);
+		return (1);
+	}
+	initPileupIndex(&index);
+	if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, PILEUP_MAGIC, 4) != 0 ||
+	        (header.mode != 1 && header.mode != 4 && header.mode != 6) || !readPileupIndex(file, &index)) {
+		fprintf(stderr, "ERROR: %s is not a valid binary pileup file.\n", file_name);
+		return (1);
+	}
+	if (header.byte_order != PILEUP_BYTE_ORDER) {
+		fprintf(stderr, "ERROR: %s was written on a host with a different byte order.\n", file_name);
+		return (1);
+	}
+	if (region != NULL) {
+		chr = parsePileupRegion(&index, region, &from, &to);
+		if (chr == -2) {
+			fprintf(stderr, "ERROR: region %s not valid.\n", region);
+			return (1);
+		}
+	}
+
+	printPileupHeaderALL(stdout, header.mode, header.strand_bias, 0);
+	if (region != NULL && chr < 0) {
+		return (0);
+	}
+	emit = (header.mode == 6 ? emitFractionsRow : emitPileupRow);
+	stats = (struct pos_stats *)malloc(sizeof(struct pos_stats));
+	memset(&output, 0, sizeof(output));
+	memset(&counts, 0, sizeof(counts));
+
+	for (i = 0; i < index.length; i++) {
+		entry = &(index.entries[i]);
+		if (region != NULL && (entry->chr != (uint32_t)chr || entry->last < from || entry->first > to)) {
+			continue;
+		}
+		if (seekFile(file, entry->offset) != 0 || fread(&block, sizeof(block), 1, file) != 1 ||
+		        block.rows != entry->rows || block.rows > PILEUP_BLOCK_ROWS ||
+		        block.counters != (uint32_t)getPileupCounters(header.mode, header.strand_bias) ||
+		        block.raw_size != block.rows * (sizeof(uint32_t) * (1 + block.counters) + 1)) {
+			fprintf(stderr, "ERROR: block %d of %s is not valid.\n", i, file_name);
+			return (1);
+		}
+		if (compressed_size < block.compressed_size) {
+			compressed_size = block.compressed_size;
+			compressed = (unsigned char *)realloc(compressed, compressed_size);
+		}
+		if (raw_size < block.raw_size) {
+			raw_size = block.raw_size;
+			raw = (unsigned char *)realloc(raw, raw_size);
+		}
+		length = block.raw_size;
+		if (fread(compressed, 1, block.compressed_size, file) != block.compressed_size ||
+		        uncompress(raw, &length, compressed, block.compressed_size) != Z_OK || length != block.raw_size) {
+			fprintf(stderr, "ERROR: block %d of %s is not valid.\n", i, file_name);
+			return (1);
+		}
+		gaps = (uint32_t *)raw;
+		for (c = 0; c < (int)block.counters; c++) {
+			columns[c] = gaps + (size_t)(c + 1) * block.rows;
+		}
+		bases = (char *)(gaps + (size_t)(block.counters + 1) * block.rows);
+
+		pos = block.first;
+		for (n = 0; n < (int)block.rows; n++) {
+			pos += gaps[n];
+			if (pos < from || pos > to) {
+				continue;
+			}
+			for (b = 0; b < 4; b++) {
+				counts.base[b] = columns[b][n];
+			}
+			if (header.strand_bias == 1) {
+				for (b = 0; b < 4; b++) {
+					counts.base_rev[b] = columns[4 + b][n];
+				}
+			}
+			if (header.mode == 6) {
+				counts.del = columns[block.counters - 1][n];
+			}
+			setPosStats(stats, 0, &counts, bases[n], header.mode == 6);
+			stats->bases[0] = bases[n];
+			emit(&output, index.chrs[entry->chr], strlen(index.chrs[entry->chr]), pos, 0, &counts, stats, 0, header.strand_bias);
+		}
+		writeBuffer(&(output.all), stdout);
+	}
+
+	free(compressed);
+	free(raw);
+	free(stats);
+	destroyPileupIndex(&index);
+	fclose(file);
+	return (0);
+}
+
 int main(int argc, char *argv[])
 {
 	fprintf(stderr, "PaCBAM version 1.6.0\n");
@@ -2158,6 +5387,9 @@ int main(int argc, char *argv[])
 		printHelp();
 		return 1;
 	}
+	if (strcmp(argv[1], "view") == 0) {
+		return (viewBinaryPileup(argc - 1, argv + 1));
+	}
 
 	char *tmp_string = NULL;
 	char stmp[10000];
@@ -2187,15 +5419,13 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "ERROR: Fail to open BAM file.%s\n", arguments->bam);
 		return 1;
 	}
-	samclose(in);
 
 	// Check BAM index
-	bam_index_t *idx = bam_index_load(arguments->bam); // load BAM index
+	bai_t *idx = bai_load(arguments->bam); // load BAM index
 	if (idx == 0) {
 		fprintf(stderr, "ERROR: BAM indexing file is not available.\n");
 		return 1;
 	}
-	bam_index_destroy(idx);
 
 	// Check fasta file
 	faidx_t *fasta = fai_load(arguments->fasta);
@@ -2203,6 +5433,7 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 	fai_destroy(fasta);
+	ref_t *ref = ref_load(arguments->fasta); // shared reference, if the FASTA file can be mapped
 
 	// Init chr arrays
 	BED_CHR = (char *)malloc(sizeof(char *)*MAX_CHR);
@@ -2255,41 +5486,41 @@ int main(int argc, char *argv[])
 	printMessage(stmp);
 	pthread_t threads[arguments->cores];
 	struct args_thread args[arguments->cores];
+	struct region_queue queue;
 
-	int regions_per_core = ceil(target_regions->length / arguments->cores) + 1;
-
-	i = 0;
-	while (i < arguments->cores) {
-		args[i].start = i * regions_per_core;
-		args[i].end = (i + 1) * regions_per_core - 1;
-		args[i].target_regions = target_regions;
-		args[i].arguments = arguments;
-		args[i].duptable = duptable;
-		sprintf(args[i].bam, "%s", arguments->bam);
-		sprintf(args[i].fasta, "%s", arguments->fasta);
-
-		if (args[i].end >= (target_regions->length - 1)) {
-			args[i].end = target_regions->length - 1;
-		}
-
-		pthread_create(&threads[i], NULL, PileUp, (void*)(&args[i]));
-
-		i++;
+	if (setRegionsBAMIds(target_regions, in->header) != 0) {
+		return 1;
 	}
 
-	for (i = 0; i < arguments->cores; i++) {
-		pthread_join(threads[i], NULL);
+	// With more threads, start from the regions expected to be the most expensive
+	if (arguments->cores > 1) {
+		if (arguments->timings != NULL && loadRegionsTimings(arguments->timings, target_regions)) {
+			printMessage("Regions cost loaded from timings file");
+		} else {
+			estimateRegionsCost(target_regions, idx, arguments->dedup ? arguments->dedup_window : 0);
+		}
 	}
+	// Regions cost sorting is disabled with a memory budget: regions are computed in
+	// BED order so that the ones held in memory can be written as soon as possible
+	initRegionQueue(&queue, target_regions, arguments->cores, arguments->cores > 1 ? TILE_LENGTH : 0,
+	                arguments->cores > 1 && arguments->max_memory == 0, (size_t)arguments->max_memory * 1024 * 1024,
+	                arguments->dedup && !arguments->dedup_stream ? arguments->dedup_window : -1);
 
-	// BAM file name
+	// Output files name prefix from the BAM file name
 	FILE *outfile, *outfileSNPs, *outfileSNVs, *outfileALL, *outfileREAD, *outfileDUP;
 	outfile = outfileSNPs = outfileSNVs = outfileALL = outfileREAD = outfileDUP = NULL;
 	char *outfile_name = NULL;
-	int slash;
+	int slash, snp_index;
+	struct pileup_index binary_index;
+	struct tabix_index tabix_index;
+	struct bgzf_compressor compressor;
+	char *tabix_name = NULL;
+	uint64_t binary_offset = 0; // size of the pileup file written, with binary or bgzip
+
+	initPileupIndex(&binary_index);
+	initTabixIndex(&tabix_index);
+	initBGZFCompressor(&compressor);
 
-	if (tmp_string != NULL) {
-		free(tmp_string);
-	}
 	slash = lastSlash(arguments->bam) + 1;
 	if (strncmp(arguments->bam + (strlen(arguments->bam) - 4), ".bam", 4) == 0) {
 		tmp_string = (char *)malloc(strlen(arguments->bam) - slash - 3);
@@ -2300,46 +5531,123 @@ int main(int argc, char *argv[])
 		strcpy(tmp_string, arguments->bam + slash);
 	}
 
-	chdir(arguments->outdir);
+	// Regions are printed concurrently, each one starting from its own position in the SNPs list
+	if (snps != NULL) {
+		snp_index = 0;
+		for (i = 0; i < target_regions->length; i++) {
+			snp_index = getRegionSNPIndex(snps, target_regions->info[i], snp_index);
+			target_regions->info[i]->snp_index = snp_index;
+		}
+	}
+
+	bamr_pool_t *pool = bamr_pool_init(arguments->bgzf_threads);
+	bamr_prefetch_t *prefetch = NULL;
+	if (arguments->prefetch > 0) {
+		prefetch = bamr_prefetch_init(arguments->bam, idx);
+	}
+	bamr_cache_t *cache = bamr_cache_init((size_t)arguments->block_cache * 1024 * 1024);
+
+	i = 0;
+	while (i < arguments->cores) {
+		args[i].queue = &queue;
+		args[i].target_regions = target_regions;
+		args[i].arguments = arguments;
+		args[i].duptable = duptable;
+		args[i].snps = snps;
+		args[i].idx = idx;
+		args[i].pool = pool;
+		args[i].prefetch = prefetch;
+		args[i].cache = cache;
+		args[i].ref = ref;
+		sprintf(args[i].bam, "%s", arguments->bam);
+		sprintf(args[i].fasta, "%s", arguments->fasta);
+
+		pthread_create(&threads[i], NULL, PileUp, (void*)(&args[i]));
+
+		i++;
+	}
 
 	if (arguments->mode == 0 || arguments->mode == 1 || arguments->mode == 2 || arguments->mode == 4 || arguments->mode == 5 || arguments->mode == 6) {
-		// Print target regions positions
+		// Print target regions positions, in BED order, as soon as they are computed
 		sprintf(stmp, "Output single base pileup statistics files in folder %s", arguments->outdir);
 		printMessage(stmp);
 
 		if (arguments->mode == 0 || arguments->mode == 1 || arguments->mode == 2) {
-			if (outfile_name != NULL) {
-				free(outfile_name);
-			}
-			outfile_name = (char*)malloc(strlen(tmp_string) + 6);
-			sprintf(outfile_name, "%s.snps", tmp_string);
+			outfile_name = getOutputFileName(arguments->outdir, tmp_string, "snps");
 			outfileSNPs = fopen(outfile_name, "w");
+			free(outfile_name);
 		}
 
 		if (arguments->mode == 0 || arguments->mode == 1 || arguments->mode == 5) {
-			if (outfile_name != NULL) {
-				free(outfile_name);
-			}
-			outfile_name = (char*)malloc(strlen(tmp_string) + 6);
-			sprintf(outfile_name, "%s.pabs", tmp_string);
+			outfile_name = getOutputFileName(arguments->outdir, tmp_string, "pabs");
 			outfileSNVs = fopen(outfile_name, "w");
+			free(outfile_name);
 		}
 		if (arguments->mode == 1 || arguments->mode == 4 || arguments->mode == 5 || arguments->mode == 6) {
-			if (outfile_name != NULL) {
-				free(outfile_name);
+			outfile_name = getOutputFileName(arguments->outdir, tmp_string, arguments->binary ? "pbin" : (arguments->bgzip ? "pileup.gz" : "pileup"));
+			outfileALL = fopen(outfile_name, (arguments->binary || arguments->bgzip) ? "wb" : "w");
+			if (arguments->bgzip) {
+				tabix_name = (char *)malloc(strlen(outfile_name) + 5);
+				sprintf(tabix_name, "%s.tbi", outfile_name);
 			}
-			outfile_name = (char*)malloc(strlen(tmp_string) + 8);
-			sprintf(outfile_name, "%s.pileup", tmp_string);
-			outfileALL = fopen(outfile_name, "w");
+			free(outfile_name);
 		}
 
-		printTargetRegionSNVsPileup(outfileSNPs, outfileSNVs, outfileALL, outfileDUP, target_regions, snps, arguments, 0, target_regions->length);
+		printPileupHeaders(outfileSNPs, outfileSNVs, (arguments->binary || arguments->bgzip) ? NULL : outfileALL, arguments);
+		if (arguments->binary) {
+			writePileupFileHeader(outfileALL, arguments);
+			binary_offset = sizeof(struct pileup_file_header);
+		}
+		if (arguments->bgzip) {
+			// the header line in a block of its own
+			struct text_buffer header = {NULL, 0, 0};
+			struct text_buffer header_line = {NULL, 0, 0};
+			getPileupHeaderALL(&header_line, arguments->mode, arguments->strand_bias, arguments->ref_block >= 0);
+			compressBGZF(&header, header_line.data, header_line.length, NULL, &compressor);
+			free(header_line.data);
+			binary_offset = header.length;
+			writeBuffer(&header, outfileALL);
+		}
+		for (i = 0; i < target_regions->length; i++) {
+			waitRegionReady(&queue, target_regions->info[i]);
+			writeBuffer(&(target_regions->info[i]->output->snps), outfileSNPs);
+			writeBuffer(&(target_regions->info[i]->output->snvs), outfileSNVs);
+			if (arguments->binary) {
+				addPileupIndexBlocks(&binary_index, target_regions->info[i]->chr, target_regions->info[i]->output, binary_offset);
+			}
+			if (arguments->bgzip) {
+				addTabixSegments(&tabix_index, target_regions->info[i]->chr, target_regions->info[i]->output, binary_offset);
+			}
+			binary_offset += target_regions->info[i]->output->all.length;
+			writeBuffer(&(target_regions->info[i]->output->all), outfileALL);
+			free(target_regions->info[i]->output->blocks);
+			free(target_regions->info[i]->output->segments);
+			free(target_regions->info[i]->output);
+			target_regions->info[i]->output = NULL;
+			setRegionMemory(&queue, target_regions->info[i], 0);
+			setRegionsWritten(&queue, i + 1);
+		}
 		if (outfileSNPs != NULL) {
 			fclose(outfileSNPs);
 		}
 		if (outfileSNVs != NULL) {
 			fclose(outfileSNVs);
 		}
+		if (arguments->binary) {
+			writePileupIndex(outfileALL, &binary_index, binary_offset);
+			destroyPileupIndex(&binary_index);
+		}
+		if (arguments->bgzip) {
+			fwrite(bgzf_eof, 1, sizeof(bgzf_eof), outfileALL);
+			if (!tabix_index.sorted) {
+				fprintf(stderr, "WARNING: pileup rows are not sorted by position (BED file not sorted), the tabix index is not written.\n");
+			} else if (!writeTabixIndex(tabix_name, &tabix_index, arguments->ref_block >= 0, &compressor)) {
+				fprintf(stderr, "WARNING: cannot write tabix index %s.\n", tabix_name);
+			}
+			destroyTabixIndex(&tabix_index);
+			destroyBGZFCompressor(&compressor);
+			free(tabix_name);
+		}
 		if (outfileALL != NULL) {
 			fclose(outfileALL);
 		}
@@ -2348,17 +5656,35 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	for (i = 0; i < arguments->cores; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	destroyRegionQueue(&queue);
+	bamr_prefetch_destroy(prefetch);
+	bamr_pool_destroy(pool);
+	if (cache != NULL) {
+		uint64_t hits, misses;
+		bamr_cache_stats(cache, &hits, &misses);
+		sprintf(stmp, "Block cache: %llu hits, %llu misses", (unsigned long long)hits, (unsigned long long)misses);
+		printMessage(stmp);
+		bamr_cache_destroy(cache);
+	}
+	bai_destroy(idx);
+	ref_destroy(ref);
+	samclose(in);
+
+	if (arguments->timings != NULL) {
+		saveRegionsTimings(arguments->timings, target_regions);
+	}
+
 	if (arguments->mode == 0 || arguments->mode == 1 || arguments->mode == 3) {
 		// Print target regions read count
-		if (outfile_name != NULL) {
-			free(outfile_name);
-		}
-		outfile_name = (char*)malloc(strlen(tmp_string) + 4);
-		sprintf(outfile_name, "%s.rc", tmp_string);
+		outfile_name = getOutputFileName(arguments->outdir, tmp_string, "rc");
 
 		sprintf(stmp, "Output regions statistics file in folder %s.", arguments->outdir);
 		printMessage(stmp);
 		outfile = fopen(outfile_name, "w");
+		free(outfile_name);
 		fprintf(outfile, "chr\tfrom\tto\tfromS\ttoS\trc\trcS\tgc\n");
 		for (i = 0; i < target_regions->length; i++) {
 			printTargetRegionRC(outfile, target_regions->info[i]);
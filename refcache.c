@@ -0,0 +1,374 @@
+/*
+ * Shared read-only access to a reference FASTA file.
+ */
+#include "refcache.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/* An entry of the .fai index */
+typedef struct {
+	char *name;
+	int order;     // line of the index, later entries replace earlier ones with the same name
+	int len;
+	int line_blen; // bases per line
+	int line_len;  // bytes per line
+	int64_t offset;
+} ref_seq_t;
+
+struct ref_s {
+	int n;
+	ref_seq_t *seqs; // sorted by name
+	const unsigned char *data;
+	size_t size;
+	char base[256];  // uppercase base of a byte, 0 for bytes skipped by fai_fetch()
+};
+
+static int ref_compare_seqs(const void *a, const void *b)
+{
+	const ref_seq_t *x = (const ref_seq_t *)a;
+	const ref_seq_t *y = (const ref_seq_t *)b;
+	int c = strcmp(x->name, y->name);
+	return (c != 0 ? c : x->order - y->order);
+}
+
+/* Parse the index as fai_read() does */
+static int ref_read_index(ref_t *ref, const char *fn)
+{
+	FILE *fp;
+	char *buf, *p, *fnidx;
+	int m = 0;
+	long long offset;
+	ref_seq_t *seq;
+
+	fnidx = (char *)malloc(strlen(fn) + 5);
+	sprintf(fnidx, "%s.fai", fn);
+	fp = fopen(fnidx, "rb");
+	free(fnidx);
+	if (fp == NULL) {
+		return 0;
+	}
+	buf = (char *)calloc(0x10000, 1);
+	while (!feof(fp) && fgets(buf, 0x10000, fp)) {
+		for (p = buf; *p && isgraph(*p); ++p);
+		*p = 0;
+		++p;
+		if (ref->n == m) {
+			m = m ? m << 1 : 16;
+			ref->seqs = (ref_seq_t *)realloc(ref->seqs, sizeof(ref_seq_t) * m);
+		}
+		seq = &ref->seqs[ref->n];
+		seq->len = seq->line_blen = seq->line_len = 0;
+		offset = 0;
+		sscanf(p, "%d%lld%d%d", &seq->len, &offset, &seq->line_blen, &seq->line_len);
+		seq->offset = offset;
+		seq->name = (char *)malloc(strlen(buf) + 1);
+		strcpy(seq->name, buf);
+		seq->order = ref->n;
+		ref->n++;
+	}
+	free(buf);
+	fclose(fp);
+	if (ref->n > 0) {
+		qsort(ref->seqs, ref->n, sizeof(ref_seq_t), ref_compare_seqs);
+	}
+	return 1;
+}
+
+static const ref_seq_t *ref_get_seq(const ref_t *ref, const char *name)
+{
+	int lo = 0, hi = ref->n - 1, mid, c, found = -1;
+	// last entry with the given name
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		c = strcmp(ref->seqs[mid].name, name);
+		if (c <= 0) {
+			if (c == 0) {
+				found = mid;
+			}
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return (found >= 0 ? &ref->seqs[found] : NULL);
+}
+
+ref_t *ref_load(const char *fn)
+{
+#ifdef _WIN32
+	return NULL;
+#else
+	int fd, c;
+	struct stat st;
+	void *data;
+	ref_t *ref;
+
+	fd = open(fn, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size < 2) {
+		close(fd);
+		return NULL;
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return NULL;
+	}
+	// gzip/RAZF compressed files are left to fai_fetch()
+	if (((unsigned char *)data)[0] == 0x1f && ((unsigned char *)data)[1] == 0x8b) {
+		munmap(data, st.st_size);
+		return NULL;
+	}
+
+	ref = (ref_t *)calloc(1, sizeof(ref_t));
+	ref->data = (const unsigned char *)data;
+	ref->size = st.st_size;
+	if (!ref_read_index(ref, fn)) {
+		ref_destroy(ref);
+		return NULL;
+	}
+	for (c = 0; c < 256; c++) {
+		ref->base[c] = isgraph(c) ? toupper(c) : 0;
+	}
+	return ref;
+#endif
+}
+
+void ref_destroy(ref_t *ref)
+{
+	int i;
+	if (ref == NULL) {
+		return;
+	}
+#ifndef _WIN32
+	if (ref->data != NULL) {
+		munmap((void *)ref->data, ref->size);
+	}
+#endif
+	for (i = 0; i < ref->n; i++) {
+		free(ref->seqs[i].name);
+	}
+	free(ref->seqs);
+	free(ref);
+}
+
+// Interval [beg,end) of the reference clipped as fai_fetch() does, and offset of beg in the file
+static void ref_clip(const ref_seq_t *seq_info, int *beg, int *end, size_t *offset)
+{
+	if (*beg < 0) {
+		*beg = 0;
+	}
+	if (*beg >= seq_info->len) {
+		*beg = seq_info->len;
+	}
+	if (*end >= seq_info->len) {
+		*end = seq_info->len;
+	}
+	if (*beg > *end) {
+		*beg = *end;
+	}
+	*offset = seq_info->offset + (seq_info->line_blen > 0 ? (int64_t)(*beg / seq_info->line_blen) * seq_info->line_len + *beg % seq_info->line_blen : 0);
+}
+
+int ref_fetch_buffer(const ref_t *ref, const char *name, int beg, int end, char **seq, size_t *size)
+{
+	int l, n;
+	char *s, c;
+	size_t p;
+	const ref_seq_t *seq_info = ref_get_seq(ref, name);
+
+	if (seq_info == NULL) {
+		return -1;
+	}
+	ref_clip(seq_info, &beg, &end, &p);
+
+	n = end - beg;
+	if (*seq == NULL || *size < (size_t)n + 2) {
+		*size = (size_t)n + 2;
+		*seq = (char *)realloc(*seq, *size);
+	}
+	s = *seq;
+	for (l = 0; l < n && p < ref->size; p++) {
+		if ((c = ref->base[ref->data[p]]) != 0) {
+			s[l++] = c;
+		}
+	}
+	s[l] = '\0';
+	return l;
+}
+
+/* 2-bit code of an uppercase character plus 1, 0 for the characters kept as runs */
+static const uint8_t ref_codes[256] = {['A'] = 1, ['C'] = 2, ['G'] = 3, ['T'] = 4};
+
+/* The 4 characters packed in a byte, the first one in the low bits */
+#define REF_BYTE0(s) "A" s, "C" s, "G" s, "T" s
+#define REF_BYTE1(s) REF_BYTE0("A" s), REF_BYTE0("C" s), REF_BYTE0("G" s), REF_BYTE0("T" s)
+#define REF_BYTE2(s) REF_BYTE1("A" s), REF_BYTE1("C" s), REF_BYTE1("G" s), REF_BYTE1("T" s)
+static const char ref_byte_bases[256][5] = {REF_BYTE2("A"), REF_BYTE2("C"), REF_BYTE2("G"), REF_BYTE2("T")};
+
+void ref_packed_init(ref_packed_t *p)
+{
+	memset(p, 0, sizeof(ref_packed_t));
+}
+
+void ref_packed_destroy(ref_packed_t *p)
+{
+	free(p->words);
+	free(p->runs);
+	ref_packed_init(p);
+}
+
+/* Empty the sequence, with room for n bases */
+static void ref_packed_reset(ref_packed_t *p, int n)
+{
+	size_t words = ((size_t)n + 31) / 32 + 1;
+	if (p->words_size < words) {
+		free(p->words);
+		p->words = (uint64_t *)malloc(words * sizeof(uint64_t));
+		p->words_size = words;
+	}
+	memset(p->words, 0, words * sizeof(uint64_t));
+	p->length = 0;
+	p->runs_length = 0;
+}
+
+/* Append character c */
+static inline void ref_packed_push(ref_packed_t *p, char c)
+{
+	int i = p->length++;
+	uint8_t code = ref_codes[(unsigned char)c];
+	ref_run_t *run;
+
+	if (code != 0) {
+		p->words[i >> 5] |= (uint64_t)(code - 1) << (2 * (i & 31));
+		return;
+	}
+	if (p->runs_length > 0 && p->runs[p->runs_length - 1].end == i && p->runs[p->runs_length - 1].base == c) {
+		p->runs[p->runs_length - 1].end++;
+		return;
+	}
+	if (p->runs_length == p->runs_size) {
+		p->runs_size = p->runs_size ? p->runs_size * 2 : 16;
+		p->runs = (ref_run_t *)realloc(p->runs, p->runs_size * sizeof(ref_run_t));
+	}
+	run = &p->runs[p->runs_length++];
+	run->beg = i;
+	run->end = i + 1;
+	run->base = c;
+}
+
+void ref_pack(ref_packed_t *p, const char *seq, int len)
+{
+	int i;
+	ref_packed_reset(p, len);
+	for (i = 0; i < len; i++) {
+		ref_packed_push(p, seq[i]);
+	}
+}
+
+int ref_fetch_packed(const ref_t *ref, const char *name, int beg, int end, ref_packed_t *p)
+{
+	char c;
+	size_t o;
+	const ref_seq_t *seq_info = ref_get_seq(ref, name);
+
+	if (seq_info == NULL) {
+		return -1;
+	}
+	ref_clip(seq_info, &beg, &end, &o);
+	ref_packed_reset(p, end - beg);
+	for (; p->length < end - beg && o < ref->size; o++) {
+		if ((c = ref->base[ref->data[o]]) != 0) {
+			ref_packed_push(p, c);
+		}
+	}
+	return p->length;
+}
+
+void ref_unpack(const ref_packed_t *p, int beg, int n, char *seq)
+{
+	int i = beg, end, lo, hi, mid;
+	const ref_run_t *run;
+
+	// past the fetched sequence, as past the end of a string
+	end = (beg + n < p->length ? beg + n : p->length);
+	if (end < beg) {
+		end = beg;
+	}
+	memset(seq + (end - beg), 0, n - (end - beg));
+	n = end - beg;
+	for (; i < end && (i & 3) != 0; i++) {
+		*seq++ = "ACGT"[(p->words[i >> 5] >> (2 * (i & 31))) & 3];
+	}
+	for (; i + 4 <= end; i += 4) {
+		memcpy(seq, ref_byte_bases[(p->words[i >> 5] >> (2 * (i & 31))) & 0xFF], 4);
+		seq += 4;
+	}
+	for (; i < end; i++) {
+		*seq++ = "ACGT"[(p->words[i >> 5] >> (2 * (i & 31))) & 3];
+	}
+	seq -= n;
+
+	// first run ending after beg
+	lo = 0;
+	hi = p->runs_length;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (p->runs[mid].end <= beg) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	for (run = p->runs + lo; run < p->runs + p->runs_length && run->beg < end; run++) {
+		for (i = (run->beg > beg ? run->beg : beg); i < run->end && i < end; i++) {
+			seq[i - beg] = run->base;
+		}
+	}
+}
+
+int ref_count_gc(const ref_packed_t *p, int beg, int end)
+{
+	// C (01) and G (10) are the codes with differing bits, the other characters are packed as A
+	const uint64_t low = 0x5555555555555555ULL;
+	uint64_t w, mask;
+	int i, count = 0;
+
+	if (end > p->length) {
+		end = p->length;
+	}
+	for (i = beg; i < end; i = (i & ~31) + 32) {
+		w = p->words[i >> 5];
+		w = (w ^ (w >> 1)) & low;
+		mask = ~0ULL << (2 * (i & 31));
+		if (end - (i & ~31) < 32) {
+			mask &= ~(~0ULL << (2 * (end - (i & ~31))));
+		}
+		count += __builtin_popcountll(w & mask);
+	}
+	return count;
+}
+
+char *ref_fetch(const ref_t *ref, const char *name, int beg, int end, int *len)
+{
+	char *s = NULL;
+	size_t size = 0;
+
+	*len = ref_fetch_buffer(ref, name, beg, end, &s, &size);
+	if (*len < 0) {
+		*len = 0;
+		return NULL;
+	}
+	return s;
+}
@@ -0,0 +1,91 @@
+/*
+ * Shared read-only access to a reference FASTA file
+ *
+ * The FASTA file is memory mapped once and its .fai index is parsed once, so that
+ * all threads can fetch the sequence of their regions concurrently without their own
+ * file handle. Sequences are returned uppercase, with exactly the bases fai_fetch()
+ * would return for the same interval, either as strings or packed at 2 bits per base.
+ */
+#ifndef __REFCACHE_H__
+#define __REFCACHE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * ref_t is a pointer to an internally maintained data structure.
+ */
+typedef struct ref_s ref_t;
+
+/*
+ * Map the FASTA file fn using its index fn.fai. Returns NULL if the file cannot be
+ * mapped (e.g. it is compressed or memory mapping is not available): in that case
+ * fai_fetch() should be used.
+ */
+extern ref_t *ref_load(const char *fn);
+
+/*
+ * Unmap the FASTA file and free the index
+ */
+extern void ref_destroy(ref_t *ref);
+
+/*
+ * Get the uppercase sequence of the 0-based interval [beg,end) of reference name,
+ * clipped to the reference length. Returns a newly allocated string (to be freed by
+ * the caller) of *len bases, or NULL if name is not in the index.
+ */
+extern char *ref_fetch(const ref_t *ref, const char *name, int beg, int end, int *len);
+
+/*
+ * As ref_fetch(), but in the buffer *seq of *size bytes, reallocated when too small, so
+ * that a thread can reuse it across calls. Returns the number of bases, or -1 if name is
+ * not in the index.
+ */
+extern int ref_fetch_buffer(const ref_t *ref, const char *name, int beg, int end, char **seq, size_t *size);
+
+/*
+ * A sequence packed at 2 bits per base (A=0, C=1, G=2, T=3, base i at bits 2*(i%32) of
+ * word i/32). The other characters (N, IUPAC codes) are packed as A and kept as runs.
+ * The buffers are reused across packings.
+ */
+typedef struct {
+	int beg;   // run [beg,end) of character base
+	int end;
+	char base;
+} ref_run_t;
+
+typedef struct {
+	int length;
+	uint64_t *words;
+	size_t words_size;
+	ref_run_t *runs;   // sorted by position
+	int runs_length;
+	int runs_size;
+} ref_packed_t;
+
+extern void ref_packed_init(ref_packed_t *p);
+extern void ref_packed_destroy(ref_packed_t *p);
+
+/*
+ * Pack the len uppercase characters of seq
+ */
+extern void ref_pack(ref_packed_t *p, const char *seq, int len);
+
+/*
+ * As ref_fetch_buffer(), but packing the sequence in p. Returns the number of bases, or
+ * -1 if name is not in the index.
+ */
+extern int ref_fetch_packed(const ref_t *ref, const char *name, int beg, int end, ref_packed_t *p);
+
+/*
+ * Write the n characters of the packed sequence from position beg on in seq (not
+ * terminated). Positions past the end of the sequence are written as '\0'.
+ */
+extern void ref_unpack(const ref_packed_t *p, int beg, int n, char *seq);
+
+/*
+ * Number of C and G bases in the interval [beg,end) of the packed sequence
+ */
+extern int ref_count_gc(const ref_packed_t *p, int beg, int end);
+
+#endif
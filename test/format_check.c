@@ -0,0 +1,129 @@
+/*
+ * Checks that the row formatting functions of pacbam.c (putUInt, putInt, putFixed) write
+ * exactly what printf writes for "%llu", "%d" and "%.*f", on exhaustive ranges of the
+ * values found in pileup rows and on random values of any magnitude.
+ *
+ * Usage: format_check [floats]
+ * With floats, every float in [0,1] is also checked with 6 decimals (about a minute).
+ */
+#include <float.h>
+
+#define main pacbam_main
+#include "../pacbam.c"
+#undef main
+
+static long tests = 0;
+static long bad = 0;
+
+// Counts a value, printing the first mismatches
+static void report(const char *expected, const char *found)
+{
+	tests++;
+	if (strcmp(expected, found) != 0 && bad++ < 10) {
+		fprintf(stderr, "ERROR: printed %s instead of %s\n", found, expected);
+	}
+}
+
+static void checkFixed(double x, int digits)
+{
+	char a[FIXED_MAX_LENGTH + 1], b[FIXED_MAX_LENGTH + 1];
+
+	*putFixed(a, x, digits) = '\0';
+	snprintf(b, sizeof(b), "%.*f", digits, x);
+	report(b, a);
+}
+
+static void checkInt(int v)
+{
+	char a[32], b[32];
+
+	*putInt(a, v) = '\0';
+	snprintf(b, sizeof(b), "%d", v);
+	report(b, a);
+}
+
+static void checkUInt(uint64_t v)
+{
+	char a[32], b[32];
+
+	*putUInt(a, v) = '\0';
+	snprintf(b, sizeof(b), "%llu", (unsigned long long)v);
+	report(b, a);
+}
+
+// xorshift64, so that the values are the same on every platform
+static uint64_t random_state = 88172645463325252ULL;
+
+static uint64_t nextRandom()
+{
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 7;
+	random_state ^= random_state << 17;
+	return random_state;
+}
+
+int main(int argc, char *argv[])
+{
+	union {
+		float f;
+		uint32_t u;
+	} fbits;
+	union {
+		double d;
+		uint64_t u;
+	} dbits;
+	uint32_t u;
+	int64_t i;
+	int q, n, d;
+
+	// every ratio of counts up to 2048, as af, strand bias and mode 6 fractions
+	for (q = 1; q <= 2048; q++) {
+		for (n = 0; n <= q; n++) {
+			checkFixed(n / (double)q, 6);
+			checkFixed(n / (double)q, 4);
+			checkFixed((float)n / (float)q, 6);
+		}
+	}
+	// exact ties at every precision
+	for (d = 0; d <= 6; d++) {
+		for (n = 0; n < 200000; n++) {
+			checkFixed((n + 0.5) / pow10_table[d], d);
+			checkFixed(n / 1024.0 + 0.5 / pow10_table[d], d);
+		}
+	}
+	// random doubles of any magnitude and sign, and random dyadic values below 2^32
+	for (n = 0; n < 500000; n++) {
+		dbits.u = nextRandom();
+		checkFixed(dbits.d, n % 7);
+		checkFixed(ldexp((double)(nextRandom() >> 11), -(int)(nextRandom() % 90)), n % 7);
+	}
+	checkFixed(0.0, 6);
+	checkFixed(-0.0, 6);
+	checkFixed(1.0 / 0.0, 4);
+	checkFixed(0.0 / 0.0, 2);
+	checkFixed(4294967295.9999999, 6);
+	checkFixed(4294967296.0, 6);
+	checkFixed(DBL_MAX, 6);
+	// integers, as positions and counts
+	for (i = -1000000; i <= 2000000; i++) {
+		checkInt((int)i);
+	}
+	for (n = 0; n < 2000000; n++) {
+		u = (uint32_t)nextRandom();
+		checkInt((int)u);
+		checkUInt(u);
+		checkUInt(nextRandom() >> (n % 64));
+	}
+	checkInt(INT_MIN);
+	checkInt(INT_MAX);
+	checkUInt(UINT32_MAX);
+	checkUInt(UINT64_MAX);
+	if (argc > 1 && strcmp(argv[1], "floats") == 0) {
+		for (u = 0; u <= 0x3F800000u; u++) {
+			fbits.u = u;
+			checkFixed(fbits.f, 6);
+		}
+	}
+	printf("format_check: %ld values, %ld mismatches\n", tests, bad);
+	return (bad == 0 ? 0 : 1);
+}
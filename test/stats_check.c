@@ -0,0 +1,158 @@
+/*
+ * Checks that the block statistics of pacbam.c (computePosStats, vectorized when built
+ * with AVX2) match the statistics of single positions (setPosStats) and the original
+ * per-position functions, on random counts and reference bases. The counts include
+ * positions stored in the overflow table and blocks of every length.
+ *
+ * Usage: stats_check
+ */
+#define main pacbam_main
+#include "../pacbam.c"
+#undef main
+
+#define CHECK_POSITIONS 200000
+
+// Coverage of a position, as the former getSum()
+static int referenceSum(const struct pos_pileup *c)
+{
+	return (c->A + c->C + c->G + c->T);
+}
+
+// Sum of the counts of the bases other than ref, as the former getAlternativeSum()
+static int referenceAlternativeSum(const struct pos_pileup *c, char ref)
+{
+	int r = char_base_index[(unsigned char)ref] - 1;
+	return (r < 0 ? 0 : referenceSum(c) - c->base[r]);
+}
+
+// Count of the most frequent base other than ref, as the former FindAlternative(): 0 and
+// N on ties
+static int referenceAlternative(const struct pos_pileup *c, char ref, char *alt)
+{
+	int b, r = char_base_index[(unsigned char)ref] - 1, max = -1, ties = 0;
+
+	*alt = 'N';
+	if (r < 0) {
+		return (0);
+	}
+	for (b = 0; b < 4; b++) {
+		if (b != r && c->base[b] > max) {
+			max = c->base[b];
+			*alt = "ACGT"[b];
+		}
+	}
+	for (b = 0; b < 4; b++) {
+		ties += (b != r && c->base[b] == max);
+	}
+	if (ties > 1) {
+		*alt = 'N';
+		return (0);
+	}
+	return (max);
+}
+
+// Random count: mostly low coverage, some deep positions up to the 16-bit limit and a
+// few past it
+static int randomCount()
+{
+	switch (rand() % 8) {
+	case 0:
+		return (rand() % 3);
+	case 1:
+		return (rand() % 20);
+	case 2:
+		return (rand() % (POS_COUNT_MAX + 1));
+	case 3:
+		return (POS_COUNT_MAX - rand() % 2);
+	case 4:
+		return (rand() % 200 == 0 ? POS_COUNT_MAX + 1 + rand() % 100000 : rand() % 1000);
+	}
+	return (rand() % 2);
+}
+
+static int sameStats(const struct pos_stats *a, int i, const struct pos_stats *b, int j)
+{
+	int k;
+
+	if (a->cov[i] != b->cov[j] || a->ref[i] != b->ref[j] || a->alt_sum[i] != b->alt_sum[j] || a->alt[i] != b->alt[j] || a->alt_base[i] != b->alt_base[j]) {
+		return (0);
+	}
+	for (k = 0; k < 4; k++) {
+		if (memcmp(&a->frac[k][i], &b->frac[k][j], sizeof(double)) != 0 || memcmp(&a->strand[k][i], &b->strand[k][j], sizeof(double)) != 0) {
+			return (0);
+		}
+	}
+	return (1);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *letters = "ACGTACGTACGTNRMWY";
+	struct thread_arena arena;
+	struct region_data *rdata;
+	struct pos_stats *stats = (struct pos_stats *)malloc(sizeof(struct pos_stats));
+	struct pos_stats *single = (struct pos_stats *)malloc(sizeof(struct pos_stats));
+	struct pos_pileup c;
+	ref_packed_t reference;
+	char *sequence = (char *)malloc(CHECK_POSITIONS + 1);
+	char ref, alt;
+	int i, b, k, from, length, count, fractions, overflow, bad = 0, tests = 0;
+
+#if defined(__AVX2__) && defined(__GNUC__)
+	if (!__builtin_cpu_supports("avx2")) {
+		printf("stats_check: skipped, AVX2 not supported\n");
+		return (0);
+	}
+#endif
+	srand(3);
+	memset(&arena, 0, sizeof(struct thread_arena));
+	rdata = newRegionData(1000, 1000 + CHECK_POSITIONS, &arena);
+	for (i = 0; i < CHECK_POSITIONS; i++) {
+		memset(&c, 0, sizeof(struct pos_pileup));
+		for (b = 0; b < 4; b++) {
+			c.base[b] = randomCount();
+			c.base_rev[b] = (c.base[b] ? rand() % (c.base[b] + 1) : 0);
+		}
+		c.del = rand() % 5;
+		setPosCounts(rdata, rdata->beg + i, &c);
+		sequence[i] = letters[rand() % 17];
+	}
+	sequence[CHECK_POSITIONS] = '\0';
+	sortPosOverflow(rdata);
+	overflow = rdata->overflow->length;
+	ref_packed_init(&reference);
+	ref_pack(&reference, sequence, CHECK_POSITIONS);
+	for (fractions = 0; fractions <= 1; fractions++) {
+		for (from = 0; from < CHECK_POSITIONS; from += length) {
+			length = 1 + rand() % POS_STATS_BLOCK;
+			if (length > CHECK_POSITIONS - from) {
+				length = CHECK_POSITIONS - from;
+			}
+			memset(stats, 0, sizeof(struct pos_stats));
+			computePosStats(rdata, &reference, from, length, fractions, stats);
+			for (k = 0; k < length; k++) {
+				tests++;
+				ref = sequence[from + k];
+				getPosCounts(rdata, from + k, &c);
+				memset(single, 0, sizeof(struct pos_stats));
+				setPosStats(single, 0, &c, ref, fractions);
+				count = referenceAlternative(&c, ref, &alt);
+				if (stats->bases[k] != ref || !sameStats(stats, k, single, 0) || referenceSum(&c) != single->cov[0] ||
+				        referenceAlternativeSum(&c, ref) != single->alt_sum[0] ||
+				        count != single->alt[0] || alt != single->alt_base[0]) {
+					if (bad++ < 10) {
+						fprintf(stderr, "ERROR: statistics of position %d (reference %c) differ\n", from + k, ref);
+					}
+				}
+			}
+		}
+	}
+	ref_packed_destroy(&reference);
+	releaseRegionData(rdata, &arena);
+	free(arena.counts);
+	free(stats);
+	free(single);
+	free(sequence);
+	printf("stats_check: %d positions, %d mismatches, %d in the overflow table\n", tests, bad, overflow);
+	return (bad == 0 ? 0 : 1);
+}